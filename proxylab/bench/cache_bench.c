@@ -0,0 +1,374 @@
+/*
+ * cache_bench - measure cache lookup cost as the number of entries grows,
+ *     hit-path throughput as reader threads are added, and the object hit
+ *     ratio, byte hit ratio and origin latency saved of each eviction
+ *     policy on a Zipf trace of mixed sizes and costs cut by scans, with
+ *     and without cold compression of victims, and the cache's memory
+ *     footprint under insert/evict churn
+ *
+ * usage: ./bench/cache_bench [lookups] [max threads]
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+#include "epoch.h"
+#include "cold.h"
+#include <time.h>
+#include <math.h>
+
+#define ENTRY_SIZE 8
+#define DEFAULT_LOOKUPS 1000000
+#define HOT_KEYS 1024
+
+/*
+ * scan trace : Zipf requests over TRACE_KEYS, a scan of one-hit wonders every
+ * TRACE_SCAN_EVERY. Each hot key gets a log-uniform size and a uniform
+ * origin latency, independent of each other; scanned objects are TRACE_OBJECT
+ */
+#define TRACE_OBJECT 4096
+#define TRACE_MIN_SIZE 256
+#define TRACE_MAX_SIZE 32768
+#define TRACE_MIN_COST 1000     // usec
+#define TRACE_MAX_COST 100000
+
+/* loop : a working set of LOOP_KEYS text objects LOOP_OBJECT bytes each, some 1.5x the cache, fetched in turn */
+#define LOOP_OBJECT 20000
+#define LOOP_KEYS (MAX_CACHE_SIZE * 3 / 2 / LOOP_OBJECT)
+#define LOOP_PASSES 20
+
+/* churn : objects of log-uniform sizes, small ones first, then large, then small again */
+#define CHURN_INSERTS 200000
+#define CHURN_MIN_SIZE 64
+#define TRACE_KEYS 2000
+#define TRACE_ZIPF 0.9
+#define TRACE_REQUESTS 200000
+#define TRACE_SCAN_EVERY 5000
+#define TRACE_SCAN_LEN 1000
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* find() inside an epoch, as get_payload() does */
+static int lookup(cache *c, char *host, char *filename){
+    unsigned int h = hash_key(80, host, filename);
+    shard *s = get_shard(c, h);
+    epoch_enter();
+    int hit = find(s, h, 80, host, filename) != NULL;
+    epoch_exit();
+    return hit;
+}
+
+static void free_cache(cache *c){
+    int i, l;
+    for(i = 0; i < c -> nshards; i++){
+        shard *s = &c -> shards[i];
+        while(s -> size && evict(s))
+            ;
+        free(s -> table);
+        for(l = 0; l < CACHE_LISTS; l++){
+            free(s -> lists[l].start);
+            free(s -> lists[l].end);
+        }
+        free(s -> sketch);
+        if(s -> pq) free(s -> pq -> heap);
+        free(s -> pq);
+        pthread_rwlock_destroy(&s -> lock);
+    }
+    epoch_flush();      // every reader is done : the victims can go now
+    arena_destroy(c -> mem);
+    free(c -> shards);
+    free(c);
+}
+
+/* Time nlookups finds against a cache holding n entries */
+static void run(size_t n, size_t nlookups){
+    char payload[ENTRY_SIZE] = "payload";
+    char (*hosts)[32] = malloc(n * sizeof(*hosts));
+    char (*files)[48] = malloc(n * sizeof(*files));
+    char (*misses)[48] = malloc(n * sizeof(*misses));
+    size_t *order = malloc(nlookups * sizeof(size_t));
+    cache *c = init_cache(CACHE_SHARDS);
+    size_t i, count = 0, hits = 0;
+    unsigned int seed = 12345;
+
+    /* n entries and their nodes outgrow MAX_CACHE_SIZE : lift the budget so all of them stay */
+    for(i = 0; i < (size_t)c -> nshards; i++) c -> shards[i].capacity = (size_t)-1 / 2;
+
+    /* pre-format keys so only the lookup is inside the timed loops */
+    for(i = 0; i < n; i++){
+        sprintf(hosts[i], "host%zu.example.com", i % 16);
+        sprintf(files[i], "static/obj/%zu.html", i);
+        sprintf(misses[i], "static/miss/%zu.html", i);
+        insert(c, 80, ENTRY_SIZE, payload, hosts[i], files[i], 0);
+    }
+    for(i = 0; i < nlookups; i++) order[i] = rand_r(&seed) % n;
+    for(i = 0; i < (size_t)c -> nshards; i++) count += c -> shards[i].count;
+
+    double t0 = now_ns();
+    for(i = 0; i < nlookups; i++)
+        hits += lookup(c, hosts[order[i]], files[order[i]]);
+    double hit_ns = (now_ns() - t0) / nlookups;
+
+    t0 = now_ns();
+    for(i = 0; i < nlookups; i++)
+        hits += lookup(c, hosts[order[i]], misses[order[i]]);
+    double miss_ns = (now_ns() - t0) / nlookups;
+
+    printf("%8zu entries  %2d shards  hit %7.1f ns  miss %7.1f ns  (%zu hits)\n",
+        count, c -> nshards, hit_ns, miss_ns, hits);
+
+    free_cache(c);
+    free(hosts);
+    free(files);
+    free(misses);
+    free(order);
+}
+
+typedef struct {
+    cache *c;
+    size_t nlookups;
+    unsigned int seed;
+    double cpu_ns;      // thread CPU time the lookups took
+} reader_arg;
+
+static volatile int writing;
+
+static char hot_files[HOT_KEYS][48];
+
+static double cpu_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Hammer the full hit path(get_payload) on a small hot set */
+static void *reader(void *vargp){
+    reader_arg *arg = vargp;
+    size_t i;
+    double t0 = cpu_ns();
+    for(i = 0; i < arg -> nlookups; i++){
+        pbuf *pb = get_payload(arg -> c, 80, "hot.example.com",
+            hot_files[rand_r(&arg -> seed) % HOT_KEYS]);
+        pbuf_unpin(pb);
+    }
+    arg -> cpu_ns = cpu_ns() - t0;
+    return NULL;
+}
+
+/* Keep replacing hot objects while the readers run, so nodes are retired under them */
+static void *writer(void *vargp){
+    cache *c = vargp;
+    char payload[ENTRY_SIZE] = "payload2";
+    unsigned int seed = 7;
+    while(writing) insert(c, 80, ENTRY_SIZE, payload, "hot.example.com", hot_files[rand_r(&seed) % HOT_KEYS], 0);
+    return NULL;
+}
+
+/*
+ * Report aggregate hit throughput and CPU time per hit for 1, 2, 4 ..
+ * maxthreads readers, alone and with a writer replacing hot objects
+ */
+static void run_threads(int maxthreads, size_t nlookups, int with_writer){
+    char payload[ENTRY_SIZE] = "payload";
+    cache *c = init_cache(CACHE_SHARDS);
+    pthread_t tids[maxthreads], wtid;
+    reader_arg args[maxthreads];
+    int i, t;
+
+    for(i = 0; i < HOT_KEYS; i++){
+        sprintf(hot_files[i], "static/hot/%d.js", i);
+        insert(c, 80, ENTRY_SIZE, payload, "hot.example.com", hot_files[i], 0);
+    }
+    for(t = 1; t <= maxthreads; t *= 2){
+        double t0 = now_ns(), cpu = 0;
+        writing = with_writer;
+        if(with_writer) Pthread_create(&wtid, NULL, writer, c);
+        for(i = 0; i < t; i++){
+            args[i].c = c;
+            args[i].nlookups = nlookups;
+            args[i].seed = i + 1;
+            Pthread_create(&tids[i], NULL, reader, &args[i]);
+        }
+        for(i = 0; i < t; i++){
+            Pthread_join(tids[i], NULL);
+            cpu += args[i].cpu_ns;
+        }
+        double secs = (now_ns() - t0) / 1e9;
+        writing = 0;
+        if(with_writer) Pthread_join(wtid, NULL);
+        printf("%3d threads%s  %7.2f M hits/s  %6.1f ns cpu/hit\n", t, with_writer ? " + writer" : "",
+            t * nlookups / secs / 1e6, cpu / t / nlookups);
+    }
+    free_cache(c);
+}
+
+static char trace_payload[TRACE_MAX_SIZE];     // a response head, then web-like text
+
+/* Words drawn with a skew, so payloads compress about as well as web text(~2x with LZ4) */
+static void fill_payload(void){
+    static const char *words[] = {"the ", "proxy ", "cache ", "object ", "<div class=\"item\">", "</div>\n",
+        "request ", "response ", "origin ", "a ", "of ", "and ", "latency ", "<p>", "</p>\n", "header "};
+    unsigned int seed = 99;
+    size_t off = sprintf(trace_payload, "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n");
+    while(off < sizeof(trace_payload) - 8){
+        int r = rand_r(&seed);
+        off += (r & 3) ? (size_t)sprintf(trace_payload + off, "%s", words[(r >> 8) & 15])
+            : (size_t)sprintf(trace_payload + off, "%05d ", (r >> 4) % 100000);
+    }
+}
+
+/* Replay the scan trace through get_payload/insert as the proxy does, under policy p */
+static void run_trace(policy *p, double *cdf, size_t *sizes, unsigned long *costs){
+    char *payload = trace_payload;
+    char file[48];
+    unsigned int seed = 4242;
+    size_t i, hits = 0, hot = 0, hothits = 0, scanned = 0, bytes = 0, hitbytes = 0;
+    double cost = 0, saved = 0;
+
+    cache_policy = p;
+    cache *c = init_cache(CACHE_SHARDS);
+    for(i = 0; i < TRACE_REQUESTS; i++){
+        int is_hot = (i % TRACE_SCAN_EVERY) >= TRACE_SCAN_LEN;
+        size_t size = TRACE_OBJECT;
+        unsigned long us = TRACE_MIN_COST;
+        if(is_hot){
+            double u = rand_r(&seed) / (RAND_MAX + 1.0);
+            int lo = 0, hi = TRACE_KEYS - 1;
+            while(lo < hi){     // first rank whose cumulative probability reaches u
+                int mid = (lo + hi) / 2;
+                if(cdf[mid] < u) lo = mid + 1;
+                else hi = mid;
+            }
+            sprintf(file, "hot/%d", lo);
+            size = sizes[lo];
+            us = costs[lo];
+            hot++;
+        }
+        else sprintf(file, "scan/%zu", scanned++);
+        bytes += size;
+        cost += us;
+
+        pbuf *pb = get_payload(c, 80, "trace.example.com", file);
+        if(pb){
+            hits++;
+            hothits += is_hot;
+            hitbytes += size;
+            saved += us;
+            pbuf_unpin(pb);
+        }
+        else insert(c, 80, size, payload, "trace.example.com", file, us);
+    }
+    printf("%-7s %-6s hit ratio %5.1f%% (%5.1f%% outside scans)  byte hit ratio %5.1f%%  latency saved %5.1f%%\n",
+        p -> name, cold_hook ? "+ cold" : "", 100.0 * hits / TRACE_REQUESTS, 100.0 * hothits / hot,
+        100.0 * hitbytes / bytes, 100.0 * saved / cost);
+    free_cache(c);
+    cache_policy = policy_find("lru");
+}
+
+/* Fetch the loop working set in turn under policy p : plain LRU gets no hits at all without help */
+static void run_loop(policy *p){
+    char file[48];
+    size_t i, hits = 0, n = (size_t)LOOP_KEYS * LOOP_PASSES;
+
+    cache_policy = p;
+    cache *c = init_cache(CACHE_SHARDS);
+    for(i = 0; i < n; i++){
+        sprintf(file, "loop/%zu", i % LOOP_KEYS);
+        pbuf *pb = get_payload(c, 80, "loop.example.com", file);
+        if(pb){
+            hits++;
+            pbuf_unpin(pb);
+        }
+        else insert(c, 80, LOOP_OBJECT, trace_payload, "loop.example.com", file, TRACE_MIN_COST);
+    }
+    printf("%-7s %-6s hit ratio %5.1f%%\n", p -> name, cold_hook ? "+ cold" : "", 100.0 * hits / n);
+    free_cache(c);
+    cache_policy = policy_find("lru");
+}
+
+static void run_policies(){
+    char *names[] = {"lru", "slru", "clock", "tinylfu", "gdsf"};
+    double cdf[TRACE_KEYS], sum = 0;
+    size_t sizes[TRACE_KEYS];
+    unsigned long costs[TRACE_KEYS];
+    unsigned int seed = 777;
+    int i;
+
+    for(i = 0; i < TRACE_KEYS; i++) sum += 1 / pow(i + 1, TRACE_ZIPF);
+    for(i = 0; i < TRACE_KEYS; i++) cdf[i] = (i ? cdf[i - 1] : 0) + 1 / pow(i + 1, TRACE_ZIPF) / sum;
+    for(i = 0; i < TRACE_KEYS; i++){
+        double u = rand_r(&seed) / (RAND_MAX + 1.0);
+        sizes[i] = TRACE_MIN_SIZE * pow((double)TRACE_MAX_SIZE / TRACE_MIN_SIZE, u);
+        costs[i] = TRACE_MIN_COST + rand_r(&seed) % (TRACE_MAX_COST - TRACE_MIN_COST);
+    }
+    printf("scan trace : %d Zipf(%.1f) objects of %d-%d B and %d-%d ms, %d-request scans every %d\n",
+        TRACE_KEYS, TRACE_ZIPF, TRACE_MIN_SIZE, TRACE_MAX_SIZE, TRACE_MIN_COST / 1000, TRACE_MAX_COST / 1000,
+        TRACE_SCAN_LEN, TRACE_SCAN_EVERY);
+    fill_payload();
+    for(i = 0; i < 5; i++) run_trace(policy_find(names[i]), cdf, sizes, costs);
+    cold_init();        // victims get their compressed second pass
+    for(i = 0; i < 5; i++) run_trace(policy_find(names[i]), cdf, sizes, costs);
+    cold_hook = NULL;
+
+    printf("loop : %d text objects of %d B(%d KiB) fetched in turn %d times into a %d KiB cache\n",
+        LOOP_KEYS, LOOP_OBJECT, LOOP_KEYS * LOOP_OBJECT >> 10, LOOP_PASSES, MAX_CACHE_SIZE >> 10);
+    for(i = 0; i < 5; i++) run_loop(policy_find(names[i]));
+    cold_init();
+    for(i = 0; i < 5; i++) run_loop(policy_find(names[i]));
+    cold_hook = NULL;
+    cold_report(stdout);
+}
+
+/* Process resident set in KiB */
+static long rss_kib(){
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if(fp == NULL) return 0;
+    if(fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) >> 10);
+}
+
+/* Insert and evict objects whose size mix shifts, checking memory stays near the budget */
+static void run_churn(){
+    static char payload[MAX_OBJECT_SIZE];
+    size_t maxsize[] = {1024, MAX_OBJECT_SIZE, 1024};
+    char *names[] = {"small", "large", "small"};
+    char file[48];
+    unsigned int seed = 99;
+    size_t i, phase, n = 0;
+    long rss0 = rss_kib();
+
+    cache *c = init_cache(CACHE_SHARDS);
+    printf("churn : %d inserts per phase into a %d KiB cache\n", CHURN_INSERTS, MAX_CACHE_SIZE >> 10);
+    for(phase = 0; phase < 3; phase++){
+        for(i = 0; i < CHURN_INSERTS; i++){
+            double u = rand_r(&seed) / (RAND_MAX + 1.0);
+            size_t size = CHURN_MIN_SIZE * pow((double)maxsize[phase] / CHURN_MIN_SIZE, u);
+            sprintf(file, "churn/%zu", n++);
+            insert(c, 80, size, payload, "churn.example.com", file, 0);
+        }
+        size_t charged = 0;
+        for(i = 0; i < (size_t)c -> nshards; i++) charged += c -> shards[i].size;
+        printf("  %-5s up to %6zu B : %5zu KiB charged, %5zu KiB arena resident, process rss +%ld KiB\n",
+            names[phase], maxsize[phase], charged >> 10, arena_resident(c -> mem) >> 10, rss_kib() - rss0);
+    }
+    free_cache(c);
+}
+
+int main(int argc, char **argv){
+    size_t nlookups = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEFAULT_LOOKUPS;
+    int maxthreads = (argc > 2) ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n;
+    for(n = 10; n <= 100000; n *= 10) run(n, nlookups);
+    if(maxthreads > 0){
+        run_threads(maxthreads, nlookups, 0);
+        run_threads(maxthreads, nlookups, 1);
+    }
+    run_policies();
+    run_churn();
+    return 0;
+}
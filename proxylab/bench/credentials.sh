@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# credentials.sh - check each mode keeps per-user responses out of the
+#     shared cache : a page fetched with a Cookie must not be served to
+#     a client without one, nor the other way round, unless the origin
+#     marked it public. Exits 1 on a leak
+#
+# usage: ./bench/credentials.sh
+#
+cd "$(dirname "$0")/.." || exit 1
+OPORT=${OPORT:-15801}
+PPORT=${PPORT:-15802}
+
+make -s proxy bench/origin || exit 1
+./bench/origin $OPORT 64 &
+ORIGIN=$!
+trap 'kill $ORIGIN 2>/dev/null' EXIT
+sleep 0.3
+
+STATUS=0
+get(){      # path [cookie] : the body the proxy answers with
+    curl -s -x localhost:$PPORT ${2:+-H "Cookie: $2"} http://localhost:$OPORT$1
+}
+check(){    # what, body, expected
+    if [ "$2" = "$3" ]; then echo "  ok    $1"
+    else echo "  LEAK  $1 : got '$(echo "$2" | head -c 40)'"; STATUS=1; fi
+}
+for mode in thread epoll uring; do
+    ./proxy --mode=$mode $PPORT > /dev/null 2>&1 &
+    PROXY=$!
+    sleep 0.3
+    if kill -0 $PROXY 2>/dev/null; then
+        echo "$mode"
+        ANON=$(curl -s http://localhost:$OPORT/obj/$mode)
+        get /private/$mode id=alice > /dev/null
+        check "cookie then none" "$(get /private/$mode)" "$(curl -s http://localhost:$OPORT/private/$mode)"
+        get /obj/$mode > /dev/null
+        check "none then cookie" "$(get /obj/$mode id=bob)" "id=bob"
+        check "cookie then another" "$(get /obj/$mode id=carol)" "id=carol"
+        check "anonymous copy kept" "$(get /obj/$mode)" "$ANON"
+        get /public/$mode id=alice > /dev/null
+        check "public shared" "$(get /public/$mode)" "id=alice"
+        kill $PROXY
+        wait $PROXY 2>/dev/null
+    else
+        echo "$mode unavailable"
+    fi
+done
+exit $STATUS
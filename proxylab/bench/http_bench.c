@@ -0,0 +1,264 @@
+/*
+ * http_bench - measure the request head parser against the sscanf/strstr
+ *     line splitting it replaced, on whole heads and on heads trickling
+ *     in a few bytes at a time; with -f, replay a fuzz corpus instead
+ *
+ * usage: ./bench/http_bench [iterations]
+ *        ./bench/http_bench -f [-m mutations] file...
+ *
+ * Corpus files are named for the result their unmutated bytes must give :
+ * ok-*(complete head), part-*(needs more bytes), bad-*(malformed) or
+ * big-*(over a limit). Every input, and mutations of it, is also parsed
+ * fed in two pieces at each split point and one byte at a time, which
+ * must agree with the one-shot parse, and every span must lie inside the
+ * input. Build with sanitizers to catch the rest(make http-fuzz)
+ */
+#include "csapp.h"
+#include "http.h"
+#include <time.h>
+
+#define DEFAULT_ITERATIONS 200000
+#define DEFAULT_MUTATIONS 2000
+#define TRICKLE 16              // bytes per read in the trickle runs
+#define INPUT_MAX 65536         // largest corpus input
+#define HEAD_MAX 16384          // the proxy's MAX_HEADER_SIZE
+#define SPLITS 64               // split points tried on inputs longer than this
+
+static char *heads[] = {
+    /* curl */
+    "GET http://example.com/index.html HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "Proxy-Connection: Keep-Alive\r\n"
+    "\r\n",
+    /* a browser */
+    "GET http://www.example.org:8080/static/js/app.min.js?v=20240117 HTTP/1.1\r\n"
+    "Host: www.example.org:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.org:8080/dashboard\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; tz=Europe%2FBerlin\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-None-Match: \"5f1c-61f0a3b2c4d80\"\r\n"
+    "If-Modified-Since: Wed, 17 Jan 2024 09:12:44 GMT\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n",
+    NULL,       // many headers, built in main()
+};
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * The request head handling the parser replaced : find the head's end
+ * with strstr, sscanf the request line, strstr each header line out
+ */
+static int legacy_parse(char *head){
+    char method[MAXLINE], uri[MAXLINE], version;
+    char *line = head, *eol;
+    int n = 0;
+    if(!strstr(head, "\r\n\r\n") || !(eol = strstr(line, "\r\n"))) return -1;
+    *eol = '\0';
+    if(sscanf(line, "%s %s HTTP/1.%c", method, uri, &version) != 3) return -1;
+    *eol = '\r';
+    for(line = eol + 2; (eol = strstr(line, "\r\n")) && eol != line; line = eol + 2)
+        n += strcspn(line, ":") < (size_t)(eol - line);
+    return n;
+}
+
+static void run(char *head, int iterations){
+    size_t len = strlen(head);
+    char *copy = Malloc(len + 1);
+    httpreq r;
+    double t0, t1;
+    int i, sink = 0;
+    size_t off;
+
+    t0 = now_ns();
+    for(i = 0; i < iterations; i++){
+        memcpy(copy, head, len + 1);    // legacy_parse writes into it
+        sink += legacy_parse(copy);
+    }
+    t1 = now_ns();
+    double legacy = (t1 - t0) / iterations;
+
+    t0 = now_ns();
+    for(i = 0; i < iterations; i++){
+        memcpy(copy, head, len + 1);    // same copy cost as above
+        http_init(&r);
+        sink += http_parse(&r, copy, len, INPUT_MAX);
+    }
+    t1 = now_ns();
+    double whole = (t1 - t0) / iterations;
+
+    t0 = now_ns();
+    for(i = 0; i < iterations; i++){
+        memcpy(copy, head, len + 1);
+        http_init(&r);
+        for(off = TRICKLE; off < len; off += TRICKLE) sink += http_parse(&r, copy, off, INPUT_MAX);
+        sink += http_parse(&r, copy, len, INPUT_MAX);
+    }
+    t1 = now_ns();
+    double trickle = (t1 - t0) / iterations;
+
+    printf("%6zu bytes %3d headers   legacy %7.1f ns   parse %7.1f ns(%6.0f MB/s)   %d-byte reads %7.1f ns\n",
+        len, r.nheaders, legacy, whole, len / whole * 1e3, TRICKLE, trickle);
+    if(sink == 42) printf("\n");    // keep the loops
+    free(copy);
+}
+
+/* Parse buf[0, len) in one go into r */
+static int parse_whole(httpreq *r, char *buf, size_t len){
+    http_init(r);
+    return http_parse(r, buf, len, HEAD_MAX);
+}
+
+static void check_spans(httpreq *r, size_t len, char *name){
+    span *s[4] = {&r -> method, &r -> uri, &r -> host, &r -> path};
+    int i;
+    for(i = 0; i < 4; i++)
+        if(s[i] -> off + (size_t)s[i] -> len > len){
+            fprintf(stderr, "%s: span out of bounds\n", name);
+            abort();
+        }
+    for(i = 0; i < r -> nheaders; i++)
+        if(r -> headers[i].name.off + (size_t)r -> headers[i].name.len > len
+            || r -> headers[i].value.off + (size_t)r -> headers[i].value.len > len){
+            fprintf(stderr, "%s: header span out of bounds\n", name);
+            abort();
+        }
+}
+
+/* Results agree if both take the same head or both refuse it, for whichever reason */
+static int same(int a, int b){
+    return a == b || (a < 0 && b < 0);
+}
+
+/* Feed buf[0, len) in every other way; returns the one-shot result */
+static int check(char *buf, size_t len, char *name){
+    httpreq whole, r;
+    size_t split, off;
+    int rc = parse_whole(&whole, buf, len), rc2;
+
+    check_spans(&whole, len, name);
+    for(split = 1; split < len; split += len > SPLITS ? len / SPLITS : 1){
+        http_init(&r);
+        if((rc2 = http_parse(&r, buf, split, HEAD_MAX)) == HTTP_AGAIN) rc2 = http_parse(&r, buf, len, HEAD_MAX);
+        if(!same(rc2, rc)){
+            fprintf(stderr, "%s: split at %zu gives %d, whole gives %d\n", name, split, rc2, rc);
+            abort();
+        }
+        if(rc > 0 && (r.nheaders != whole.nheaders || memcmp(&r.uri, &whole.uri, sizeof(span)))){
+            fprintf(stderr, "%s: split at %zu parses differently\n", name, split);
+            abort();
+        }
+    }
+    http_init(&r);
+    for(off = 1, rc2 = HTTP_AGAIN; off <= len && rc2 == HTTP_AGAIN; off++) rc2 = http_parse(&r, buf, off, HEAD_MAX);
+    if(!same(rc2, rc)){
+        fprintf(stderr, "%s: byte at a time gives %d, whole gives %d\n", name, rc2, rc);
+        abort();
+    }
+    return rc;
+}
+
+/* Mutate buf[0, *len) in place : flip, insert, delete or duplicate bytes, or splice in a line break */
+static void mutate(char *buf, size_t *len, unsigned int *seed){
+    static char *pieces[] = {"\r\n", "\n", "\r", ":", " ", "\t", "\r\n\r\n", "\0", "[", "]", "http://", NULL};
+    size_t pos = *len ? rand_r(seed) % *len : 0;
+    int what = rand_r(seed) % 4;
+    if(what == 0 && *len) buf[pos] ^= 1 << (rand_r(seed) % 8);
+    else if(what == 1 && *len){
+        memmove(buf + pos, buf + pos + 1, *len - pos - 1);
+        (*len)--;
+    }
+    else if(what == 2 && *len + 1 < INPUT_MAX){
+        memmove(buf + pos + 1, buf + pos, *len - pos);
+        buf[pos] = rand_r(seed);
+        (*len)++;
+    }
+    else{
+        int i, n = 0;
+        while(pieces[n]) n++;
+        char *p = pieces[rand_r(seed) % n];
+        size_t plen = *p ? strlen(p) : 1;
+        if(*len + plen >= INPUT_MAX) return;
+        memmove(buf + pos + plen, buf + pos, *len - pos);
+        for(i = 0; i < (int)plen; i++) buf[pos + i] = p[i];
+        *len += plen;
+    }
+}
+
+static int fuzz(char **files, int nfiles, int mutations){
+    static char buf[INPUT_MAX], orig[INPUT_MAX];
+    unsigned int seed = 1;
+    int i, j, failed = 0;
+
+    for(i = 0; i < nfiles; i++){
+        char *base = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+        int fd = open(files[i], O_RDONLY);
+        if(fd < 0){
+            fprintf(stderr, "%s: %s\n", files[i], strerror(errno));
+            return 1;
+        }
+        ssize_t n = read(fd, orig, sizeof(orig));
+        close(fd);
+        if(n < 0) n = 0;
+
+        int rc = check(orig, n, base), want;
+        if(!strncmp(base, "ok-", 3)) want = rc > 0;
+        else if(!strncmp(base, "part-", 5)) want = rc == HTTP_AGAIN;
+        else if(!strncmp(base, "bad-", 4)) want = rc == HTTP_ERROR;
+        else if(!strncmp(base, "big-", 4)) want = rc == HTTP_TOO_LARGE;
+        else want = 1;
+        if(!want){
+            printf("FAIL %s: parser says %d\n", base, rc);
+            failed++;
+        }
+
+        for(j = 0; j < mutations; j++){
+            size_t len = n;
+            memcpy(buf, orig, n);
+            mutate(buf, &len, &seed);
+            if(j % 2) mutate(buf, &len, &seed);
+            check(buf, len, base);
+        }
+    }
+    printf("%d corpus files, %d mutations each, %d failed\n", nfiles, mutations, failed);
+    return failed != 0;
+}
+
+int main(int argc, char **argv){
+    int i, iterations = DEFAULT_ITERATIONS, mutations = DEFAULT_MUTATIONS;
+
+    if(argc > 1 && !strcmp(argv[1], "-f")){
+        i = 2;
+        if(argc > 3 && !strcmp(argv[2], "-m")){
+            mutations = atoi(argv[3]);
+            i = 4;
+        }
+        return fuzz(argv + i, argc - i, mutations);
+    }
+    if(argc > 1) iterations = atoi(argv[1]);
+
+    /* a cookie-heavy head near the header count limit */
+    char *big = Malloc(INPUT_MAX);
+    size_t len = sprintf(big, "GET http://api.example.net/v2/items?page=3 HTTP/1.1\r\nHost: api.example.net\r\n");
+    for(i = 0; i < HTTP_MAX_HEADERS - 2; i++)
+        len += sprintf(big + len, "X-Trace-%02d: %08x-%04x-%04x, hop=%d\r\n", i, i * 2654435761u, i * 7, i * 13, i);
+    sprintf(big + len, "\r\n");
+    heads[2] = big;
+
+    for(i = 0; heads[i]; i++) run(heads[i], iterations);
+    free(big);
+    return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * loadgen - HTTP load generator for the proxy
+ *
+ * Client threads ask the proxy for http://127.0.0.1:<origin port>/obj/<id>
+ * and read each response whole. With -k N the ids range over N keys :
+ * in turn by default(a hit workload once warm), or drawn from a Zipf
+ * distribution of exponent -z; with -k 0 every request uses a fresh id
+ * (a miss workload).
+ *
+ * Closed loop by default : each client sends its next request once the
+ * last one is answered. With -r the load is open loop instead : requests
+ * arrive at that total rate(Poisson), and latency counts from when a
+ * request was due, so a stalled proxy can't hide its queueing delay.
+ * -K keeps connections open(HTTP/1.1) instead of one per request.
+ *
+ * The hit ratio comes from the proxy's /__proxy_stats, read before and
+ * after the run.
+ *
+ * usage: ./bench/loadgen -p proxyport -o originport [-c clients] [-n requests] [-k keys]
+ *            [-z zipf exponent] [-r requests/s] [-K]
+ */
+#include "csapp.h"
+#include <time.h>
+#include <math.h>
+
+typedef struct {
+    int id;
+    long nreq;
+    double *lat_us;     // latency of every request
+    long errors;
+    long bytes;
+    unsigned long rng;  // xorshift state
+    int fd;             // kept-alive connection, -1 if none
+    rio_t rio;
+} client_arg;
+
+static char *proxy_port = NULL;
+static char *origin_port = NULL;
+static long nkeys = 16;
+static double zipf = 0;         // 0 : ids in turn
+static double *zipf_cdf;        // P(id <= i), for drawing ids by binary search
+static double rate = 0;         // open loop requests/s over all clients, 0 : closed loop
+static int keepalive = 0;
+static int nclients = 8;
+static unsigned long next_unique = 0;
+
+static double now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static unsigned long xorshift(unsigned long *s){
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/* Uniform in (0, 1) */
+static double unit(unsigned long *s){
+    return ((xorshift(s) >> 11) + 0.5) / (double)(1UL << 53);
+}
+
+static void zipf_init(void){
+    double sum = 0;
+    long i;
+    zipf_cdf = Malloc(nkeys * sizeof(double));
+    for(i = 0; i < nkeys; i++) zipf_cdf[i] = (sum += 1 / pow(i + 1, zipf));
+    for(i = 0; i < nkeys; i++) zipf_cdf[i] /= sum;
+}
+
+/* Id of the i-th request of client arg */
+static unsigned long next_id(client_arg *arg, long i){
+    if(nkeys == 0) return __atomic_fetch_add(&next_unique, 1, __ATOMIC_RELAXED) + (unsigned long)time(NULL) * 1000000;
+    if(zipf == 0) return (arg -> id * arg -> nreq + i) % nkeys;
+    double u = unit(&arg -> rng);
+    long lo = 0, hi = nkeys - 1;
+    while(lo < hi){
+        long mid = (lo + hi) / 2;
+        if(zipf_cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Read one response from rio : its head, then Content-Length bytes of
+ * body, or everything up to EOF. Returns the bytes read, -1 on error or
+ * a status other than 2xx. *reusable tells if the connection may be kept
+ */
+static long read_response(rio_t *rio, int *reusable){
+    char buf[MAXBUF];
+    long total = 0, length = -1;
+    ssize_t n;
+    int status = 0;
+
+    *reusable = 0;
+    if((n = rio_readlineb(rio, buf, MAXLINE)) <= 0 || sscanf(buf, "HTTP/1.%*d %d", &status) != 1) return -1;
+    total += n;
+    *reusable = 1;
+    while((n = rio_readlineb(rio, buf, MAXLINE)) > 0){
+        total += n;
+        if(!strcmp(buf, "\r\n")) break;
+        if(!strncasecmp(buf, "Content-Length:", 15)) length = atol(buf + 15);
+        else if(!strncasecmp(buf, "Connection:", 11) && strstr(buf + 11, "close")) *reusable = 0;
+    }
+    if(n <= 0) return -1;
+    if(length < 0) *reusable = 0;
+    while(length != 0){
+        size_t want = (length < 0 || length > (long)sizeof(buf)) ? sizeof(buf) : (size_t)length;
+        if((n = rio_readnb(rio, buf, want)) < 0) return -1;
+        if(n == 0) break;
+        total += n;
+        if(length > 0) length -= n;
+    }
+    if(length > 0) return -1;       // cut short
+    return status / 100 == 2 ? total : -1;
+}
+
+/* One request/response, over the client's open connection if it has one; returns bytes read or -1 */
+static long fetch(client_arg *arg, unsigned long id){
+    char buf[MAXLINE];
+    int reusable, retried = 0;
+    long got;
+
+    int len = sprintf(buf, "GET http://127.0.0.1:%s/obj/%lu HTTP/1.%d\r\nHost: 127.0.0.1:%s\r\n\r\n",
+        origin_port, id, keepalive, origin_port);
+    while(1){
+        int fresh = arg -> fd < 0;
+        if(fresh){
+            if((arg -> fd = open_clientfd("127.0.0.1", proxy_port)) < 0) return -1;
+            rio_readinitb(&arg -> rio, arg -> fd);
+        }
+        got = -1;
+        if(rio_writen(arg -> fd, buf, len) == len) got = read_response(&arg -> rio, &reusable);
+        if(got < 0 || !keepalive || !reusable){
+            close(arg -> fd);
+            arg -> fd = -1;
+        }
+        /* a kept connection the proxy closed while idle : once more on a new one */
+        if(got >= 0 || fresh || retried++) return got;
+    }
+}
+
+static void *client(void *vargp){
+    client_arg *arg = vargp;
+    double due = now_us(), sent;
+    long i, got;
+
+    for(i = 0; i < arg -> nreq; i++){
+        unsigned long id = next_id(arg, i);
+        if(rate > 0){       // open loop : the next arrival of this client's share of the rate
+            due += -log(unit(&arg -> rng)) * 1e6 * nclients / rate;
+            double wait = due - now_us();
+            if(wait > 0) usleep(wait);
+            sent = due;
+        }
+        else sent = now_us();
+        if((got = fetch(arg, id)) < 0) arg -> errors++;
+        else arg -> bytes += got;
+        arg -> lat_us[i] = now_us() - sent;
+    }
+    if(arg -> fd >= 0) close(arg -> fd);
+    return NULL;
+}
+
+/* The proxy's request and hit counts from its stats page; -1 if it has none */
+static int proxy_stats(long *requests, long *hits){
+    char buf[MAXBUF], *p, *q;
+    size_t len = 0;
+    ssize_t n;
+    int fd = open_clientfd("127.0.0.1", proxy_port);
+
+    if(fd < 0) return -1;
+    n = sprintf(buf, "GET /__proxy_stats?format=json HTTP/1.0\r\n\r\n");
+    if(rio_writen(fd, buf, n) != n){
+        close(fd);
+        return -1;
+    }
+    while(len < sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) len += n;
+    close(fd);
+    buf[len] = '\0';
+    if(!(p = strstr(buf, "\"requests\":")) || !(q = strstr(buf, "\"hits\":"))) return -1;
+    *requests = atol(p + 11);
+    *hits = atol(q + 7);
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b){
+    double x = *(double*)a, y = *(double*)b;
+    return (x > y) - (x < y);
+}
+
+static double quantile(double *sorted, long n, double q){
+    long i = n * q;
+    return sorted[i < n ? i : n - 1];
+}
+
+int main(int argc, char **argv){
+    int opt, i, bad = 0;
+    long nreq = 1000, req0, hits0, req1, hits1;
+    while((opt = getopt(argc, argv, "p:o:c:n:k:z:r:K")) != -1){
+        switch(opt){
+        case 'p': proxy_port = optarg; break;
+        case 'o': origin_port = optarg; break;
+        case 'c': nclients = atoi(optarg); break;
+        case 'n': nreq = atol(optarg); break;
+        case 'k': nkeys = atol(optarg); break;
+        case 'z': zipf = atof(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'K': keepalive = 1; break;
+        default: bad = 1;
+        }
+    }
+    if(bad || !proxy_port || !origin_port || nclients <= 0 || nreq <= 0 || nkeys < 0 || zipf < 0 || rate < 0){
+        fprintf(stderr, "usage: %s -p proxyport -o originport [-c clients] [-n requests] [-k keys]\n"
+            "           [-z zipf exponent] [-r requests/s] [-K]\n", argv[0]);
+        return 1;
+    }
+    Signal(SIGPIPE, SIG_IGN);
+    if(zipf > 0 && nkeys > 0) zipf_init();
+    int counted = proxy_stats(&req0, &hits0) == 0;
+
+    long per = nreq / nclients ? nreq / nclients : 1;
+    pthread_t tids[nclients];
+    client_arg args[nclients];
+    double t0 = now_us();
+    for(i = 0; i < nclients; i++){
+        args[i].id = i;
+        args[i].nreq = per;
+        args[i].lat_us = Malloc(per * sizeof(double));
+        args[i].errors = args[i].bytes = 0;
+        args[i].rng = 0x9e3779b97f4a7c15UL * (i + 1) ^ (unsigned long)t0;
+        args[i].fd = -1;
+        Pthread_create(&tids[i], NULL, client, &args[i]);
+    }
+    for(i = 0; i < nclients; i++) Pthread_join(tids[i], NULL);
+    double secs = (now_us() - t0) / 1e6;
+
+    long total = per * nclients, errors = 0, bytes = 0, k = 0;
+    double *all = Malloc(total * sizeof(double));
+    for(i = 0; i < nclients; i++){
+        memcpy(all + k, args[i].lat_us, per * sizeof(double));
+        k += per;
+        errors += args[i].errors;
+        bytes += args[i].bytes;
+        free(args[i].lat_us);
+    }
+    qsort(all, total, sizeof(double), cmp_double);
+
+    char hit[32] = "hit -";
+    if(counted && proxy_stats(&req1, &hits1) == 0 && req1 > req0)
+        sprintf(hit, "hit %.1f%%", 100.0 * (hits1 - hits0) / (req1 - req0));
+    printf("%ld requests  %ld errors  %.0f req/s  %.1f MB/s  %s  p50 %.0f us  p99 %.0f us  p999 %.0f us\n",
+        total, errors, total / secs, bytes / secs / 1e6, hit,
+        quantile(all, total, 0.5), quantile(all, total, 0.99), quantile(all, total, 0.999));
+    free(all);
+    return 0;
+}
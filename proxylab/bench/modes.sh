@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# modes.sh - compare the proxy's I/O engines on cache-hit and cache-miss
+#     workloads against the local origin stub
+#
+# usage: ./bench/modes.sh [clients] [requests] [body size]
+#
+cd "$(dirname "$0")/.." || exit 1
+CLIENTS=${1:-16}
+REQUESTS=${2:-20000}
+SIZE=${3:-4096}
+OPORT=${OPORT:-15801}
+PPORT=${PPORT:-15802}
+
+make -s proxy bench/origin bench/loadgen || exit 1
+./bench/origin $OPORT $SIZE &
+ORIGIN=$!
+trap 'kill $ORIGIN 2>/dev/null' EXIT
+sleep 0.3
+
+for mode in thread epoll uring; do
+    ./proxy --mode=$mode $PPORT > /dev/null 2>&1 &
+    PROXY=$!
+    sleep 0.3
+    if kill -0 $PROXY 2>/dev/null; then
+        ./bench/loadgen -p $PPORT -o $OPORT -c 1 -n 64 -k 16 > /dev/null     # warm the hit set
+        printf "%-7s hit   " $mode
+        ./bench/loadgen -p $PPORT -o $OPORT -c $CLIENTS -n $REQUESTS -k 16
+        printf "%-7s miss  " $mode
+        ./bench/loadgen -p $PPORT -o $OPORT -c $CLIENTS -n $REQUESTS -k 0
+        kill $PROXY
+        wait $PROXY 2>/dev/null
+    else
+        printf "%-7s unavailable\n" $mode
+    fi
+done
+exit 0
@@ -0,0 +1,178 @@
+/*
+ * origin - tiny local origin server for proxy benchmarks
+ *
+ * Answers every GET with a 200 whose body size is drawn from a size
+ * distribution, seeded by the requested path, so one object always has
+ * the same size. Requests for /obj/<id> are sized by id. HTTP/1.1 clients
+ * keep the connection unless they ask to close; HTTP/1.0 ones don't.
+ *
+ *   fixed:N                  every object N bytes(also: a bare N)
+ *   uniform:MIN-MAX          uniform between MIN and MAX bytes
+ *   lognormal:MEDIAN:SIGMA   web-like : most objects small, a long tail
+ *
+ * Bodies are mixed text, so compression sees realistic ratios. -d adds a
+ * fixed service delay to every response, like a far origin.
+ *
+ * A request with a Cookie gets a per-user page instead : a one line body
+ * naming the cookie, public only under /public/ (see credentials.sh).
+ *
+ * usage: ./bench/origin [-s size distribution] [-d delay us] <port> [body size]
+ */
+#include "csapp.h"
+#include <math.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
+
+#define MAX_BODY (16 << 20)     // sizes past this are clamped
+
+enum { D_FIXED, D_UNIFORM, D_LOGNORMAL };
+
+static int dist = D_FIXED;
+static double arg1 = 1024, arg2 = 0;
+static char *body;              // MAX_BODY bytes every response's body is a prefix of
+static long delay_us = 0;
+
+/* splitmix64 : a well mixed 64-bit value per input */
+static unsigned long mix(unsigned long x){
+    x += 0x9e3779b97f4a7c15UL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+    return x ^ (x >> 31);
+}
+
+/* Uniform in (0, 1) */
+static double unit(unsigned long x){
+    return ((x >> 11) + 0.5) / (double)(1UL << 53);
+}
+
+/* The object's seed : its id for /obj/<id>, else a hash of the path */
+static unsigned long seed_of(const char *path){
+    const char *p = strstr(path, "/obj/");
+    unsigned long h = 14695981039346656037UL;
+    if(p) return strtoul(p + 5, NULL, 10);
+    for(; *path && *path != ' '; path++) h = (h ^ (unsigned char)*path) * 1099511628211UL;
+    return h;
+}
+
+static size_t size_of(unsigned long seed){
+    unsigned long r = mix(seed);
+    double s;
+    switch(dist){
+    case D_UNIFORM:
+        s = arg1 + unit(r) * (arg2 - arg1 + 1);
+        break;
+    case D_LOGNORMAL:       // Box-Muller from two draws
+        s = arg1 * exp(arg2 * sqrt(-2 * log(unit(r))) * cos(2 * M_PI * unit(mix(r))));
+        break;
+    default:
+        s = arg1;
+    }
+    if(s < 0) s = 0;
+    return s > MAX_BODY ? MAX_BODY : (size_t)s;
+}
+
+static int has_close(const char *v){
+    for(; *v; v++) if(!strncasecmp(v, "close", 5)) return 1;
+    return 0;
+}
+
+/* Answer requests on one connection until the client closes or asks to */
+static void *serve(void *vargp){
+    int connfd = (int)(long)vargp;
+    char buf[MAXLINE], path[MAXLINE], head[MAXLINE], user[MAXLINE];
+    int minor, keep, one = 1;
+    rio_t rio;
+
+    Pthread_detach(pthread_self());
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));    // head and body are separate writes
+    Rio_readinitb(&rio, connfd);
+    while(rio_readlineb(&rio, buf, MAXLINE) > 0){
+        if(sscanf(buf, "%*s %s HTTP/1.%d", path, &minor) != 2) break;
+        keep = minor >= 1;
+        user[0] = '\0';
+        while(rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")){
+            if(!strncasecmp(buf, "Connection:", 11) && has_close(buf + 11)) keep = 0;
+            else if(!strncasecmp(buf, "Cookie:", 7)) sscanf(buf + 7, " %[^\r\n]", user);
+        }
+
+        const char *data = body;
+        size_t size = size_of(seed_of(path));
+        if(user[0]){        // a page for this user only, unless the path says otherwise
+            strcat(user, "\n");
+            data = user;
+            size = strlen(user);
+        }
+        int len = sprintf(head, "HTTP/1.1 200 OK\r\nServer: bench-origin\r\nContent-Type: text/plain\r\n"
+            "Content-Length: %zu\r\nCache-Control: %smax-age=3600\r\nConnection: %s\r\n\r\n",
+            size, user[0] && !strncmp(path, "/public/", 8) ? "public, " : "", keep ? "keep-alive" : "close");
+        if(delay_us) usleep(delay_us);
+        if(rio_writen(connfd, head, len) != len || rio_writen(connfd, (void *)data, size) != (ssize_t)size) break;
+        if(!keep) break;
+    }
+    Close(connfd);
+    return NULL;
+}
+
+/* Words drawn with a skew, so the body compresses about as well as web text */
+static void fill_body(void){
+    static const char *words[] = {"the ", "proxy ", "cache ", "object ", "<div class=\"item\">", "</div>\n",
+        "request ", "response ", "origin ", "a ", "of ", "and ", "latency ", "<p>", "</p>\n", "header "};
+    unsigned long r = 42;
+    size_t off = 0;
+    while(off < MAX_BODY){
+        r = mix(r);
+        const char *w = (r & 3) ? words[(r >> 8) & 15] : NULL;
+        char junk[8];
+        if(w == NULL){      // some entropy : ids, numbers
+            sprintf(junk, "%05lu ", (r >> 16) % 100000);
+            w = junk;
+        }
+        size_t n = strlen(w);
+        if(n > MAX_BODY - off) n = MAX_BODY - off;
+        memcpy(body + off, w, n);
+        off += n;
+    }
+}
+
+/* Parse a size distribution; 0 on success */
+static int parse_dist(const char *s){
+    if(!strncmp(s, "fixed:", 6)) s += 6;
+    if(!strncmp(s, "uniform:", 8)){
+        dist = D_UNIFORM;
+        return sscanf(s + 8, "%lf-%lf", &arg1, &arg2) == 2 && arg1 <= arg2 ? 0 : -1;
+    }
+    if(!strncmp(s, "lognormal:", 10)){
+        dist = D_LOGNORMAL;
+        return sscanf(s + 10, "%lf:%lf", &arg1, &arg2) == 2 && arg1 > 0 && arg2 >= 0 ? 0 : -1;
+    }
+    dist = D_FIXED;
+    return sscanf(s, "%lf", &arg1) == 1 && arg1 >= 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv){
+    int opt, bad = 0;
+    while((opt = getopt(argc, argv, "s:d:")) != -1){
+        switch(opt){
+        case 's': bad |= parse_dist(optarg) < 0; break;
+        case 'd': delay_us = atol(optarg); break;
+        default: bad = 1;
+        }
+    }
+    if(bad || optind >= argc || (argc - optind > 1 && parse_dist(argv[optind + 1]) < 0)){
+        fprintf(stderr, "usage: %s [-s fixed:N|uniform:MIN-MAX|lognormal:MEDIAN:SIGMA] [-d delay us] <port> [body size]\n",
+            argv[0]);
+        return 1;
+    }
+    body = Malloc(MAX_BODY);
+    fill_body();
+
+    Signal(SIGPIPE, SIG_IGN);
+    int listenfd = Open_listenfd(argv[optind]);
+    if(listenfd < 0) return 1;
+    while(1){
+        int connfd = accept(listenfd, NULL, NULL);
+        if(connfd < 0) continue;
+        pthread_t tid;
+        Pthread_create(&tid, NULL, serve, (void*)(long)connfd);
+    }
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# report.sh - end-to-end load test of a proxy binary against the local
+#     origin stub, offline on this box : throughput, hit ratio and
+#     p50/p99/p999 latency of each mode on closed-loop and open-loop
+#     Zipf workloads and an all-miss one. Exits 1 if a run had errors
+#     or the proxy died, so it can gate regressions
+#
+# usage: ./bench/report.sh [proxy binary]
+#     MODES, CLIENTS, REQUESTS, KEYS, ZIPF, RATE, SIZES, DELAY override
+#     the workload below
+#
+cd "$(dirname "$0")/.." || exit 1
+PROXY=${1:-./proxy}
+MODES=${MODES:-"thread epoll uring"}
+CLIENTS=${CLIENTS:-16}
+REQUESTS=${REQUESTS:-20000}
+KEYS=${KEYS:-1000}
+ZIPF=${ZIPF:-0.99}
+RATE=${RATE:-2000}                  # open loop requests/s
+SIZES=${SIZES:-lognormal:4096:1.2}  # origin object sizes
+DELAY=${DELAY:-500}                 # origin service time, us
+OPORT=${OPORT:-15801}
+PPORT=${PPORT:-15802}
+
+make -s bench/origin bench/loadgen || exit 1
+[ -x "$PROXY" ] || { echo "no proxy binary $PROXY" >&2; exit 1; }
+./bench/origin -s $SIZES -d $DELAY $OPORT &
+ORIGIN=$!
+trap 'kill $ORIGIN 2>/dev/null' EXIT
+sleep 0.3
+
+echo "proxy $PROXY : $CLIENTS clients, $REQUESTS requests, $KEYS keys zipf $ZIPF, open loop $RATE req/s"
+echo "origin : $SIZES bytes, ${DELAY} us service time"
+STATUS=0
+run(){
+    printf "%-7s %-12s " "$1" "$2"
+    shift 2
+    OUT=$(./bench/loadgen -p $PPORT -o $OPORT "$@")
+    echo "$OUT"
+    case "$OUT" in *" 0 errors"*) ;; *) STATUS=1 ;; esac
+}
+for mode in $MODES; do
+    # a worker per client : thread mode would queue kept-alive connections behind each other
+    $PROXY --mode=$mode --threads=$((CLIENTS + 8)) $PPORT > /dev/null 2>&1 &
+    PID=$!
+    sleep 0.3
+    if ! kill -0 $PID 2>/dev/null; then
+        printf "%-7s unavailable\n" $mode
+        continue
+    fi
+    ./bench/loadgen -p $PPORT -o $OPORT -c 8 -n $KEYS -k $KEYS -K > /dev/null    # warm every key once
+    run $mode "zipf closed" -c $CLIENTS -n $REQUESTS -k $KEYS -z $ZIPF -K
+    run $mode "zipf open" -c $CLIENTS -n $REQUESTS -k $KEYS -z $ZIPF -r $RATE -K
+    run $mode "miss" -c $CLIENTS -n $((REQUESTS / 4)) -k 0 -K
+    if ! kill -0 $PID 2>/dev/null; then
+        echo "$mode : proxy died" >&2
+        STATUS=1
+    fi
+    kill $PID 2>/dev/null
+    wait $PID 2>/dev/null
+done
+exit $STATUS
@@ -0,0 +1,146 @@
+/*
+ * rio_bench - measure Rio line reading on origin response headers : the
+ *     classic byte-at-a-time rio_readlineb against the vectorized one
+ *     with each newline scanner, and rio_peeklineb, which copies nothing
+ *
+ * usage: ./bench/rio_bench [MiB]
+ */
+#include "csapp.h"
+#include <time.h>
+
+#define DEFAULT_MIB 64
+#define REPEATS 3
+
+static char *head =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Wed, 17 Jan 2024 09:12:44 GMT\r\n"
+    "Server: Apache/2.4.58 (Unix)\r\n"
+    "Last-Modified: Tue, 16 Jan 2024 18:03:10 GMT\r\n"
+    "ETag: \"5f1c-61f0a3b2c4d80\"\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Content-Length: 24348\r\n"
+    "Cache-Control: public, max-age=3600\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Content-Type: application/javascript; charset=utf-8\r\n"
+    "Set-Cookie: visitor=8f14e45fceea167a5a36dedd4bea2543; Path=/; Max-Age=31536000; HttpOnly\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "Keep-Alive: timeout=5, max=100\r\n"
+    "Connection: Keep-Alive\r\n"
+    "\r\n";
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The CS:APP rio_readlineb : one rio_read() call, and one copy, per byte */
+static ssize_t byte_read(rio_t *rp, char *usrbuf, size_t n){
+    while(rp -> rio_cnt <= 0){
+        if((rp -> rio_cnt = read(rp -> rio_fd, rp -> rio_buf, sizeof(rp -> rio_buf))) < 0){
+            if(errno != EINTR) return -1;
+        }
+        else if(rp -> rio_cnt == 0) return 0;
+        else rp -> rio_bufptr = rp -> rio_buf;
+    }
+    size_t cnt = n < (size_t)rp -> rio_cnt ? n : (size_t)rp -> rio_cnt;
+    memcpy(usrbuf, rp -> rio_bufptr, cnt);
+    rp -> rio_bufptr += cnt;
+    rp -> rio_cnt -= cnt;
+    return cnt;
+}
+
+static ssize_t classic_readlineb(rio_t *rp, void *usrbuf, size_t maxlen){
+    int rc;
+    size_t n;
+    char c, *bufp = usrbuf;
+    for(n = 1; n < maxlen; n++){
+        if((rc = byte_read(rp, &c, 1)) == 1){
+            *bufp++ = c;
+            if(c == '\n'){
+                n++;
+                break;
+            }
+        }
+        else if(rc == 0){
+            if(n == 1) return 0;
+            break;
+        }
+        else return -1;
+    }
+    *bufp = 0;
+    return n - 1;
+}
+
+/* What forward() does with each line : look for a few headers */
+static int inspect(char *line){
+    return !strncasecmp(line, "Content-Length:", 15) || !strncasecmp(line, "Connection:", 11);
+}
+
+enum { CLASSIC, READLINE, PEEKLINE };
+
+/* Read every line of fd; returns the best ns per MiB over REPEATS passes */
+static double run(int fd, int how, size_t *lines){
+    static rio_t rio;
+    char buf[MAXLINE], *line;
+    double best = 0;
+    ssize_t n;
+    int r;
+
+    for(r = 0; r < REPEATS; r++){
+        size_t count = 0, bytes = 0;
+        lseek(fd, 0, SEEK_SET);
+        rio_readinitb(&rio, fd);
+        double t0 = now_ns();
+        if(how == CLASSIC)
+            while((n = classic_readlineb(&rio, buf, MAXLINE)) > 0) count += inspect(buf), bytes += n;
+        else if(how == READLINE)
+            while((n = rio_readlineb(&rio, buf, MAXLINE)) > 0) count += inspect(buf), bytes += n;
+        else
+            while((n = rio_peeklineb(&rio, &line)) > 0){
+                count += inspect(line);
+                bytes += n;
+                rio_skipb(&rio, n);
+            }
+        double t = (now_ns() - t0) / (bytes / 1048576.0);
+        if(best == 0 || t < best) best = t;
+        *lines = count;
+    }
+    return best;
+}
+
+int main(int argc, char **argv){
+    size_t mib = (argc > 1) ? strtoul(argv[1], NULL, 10) : DEFAULT_MIB;
+    char path[] = "/tmp/rio_benchXXXXXX";
+    size_t len = strlen(head), total = 0, lines;
+    char *block = Malloc(1 << 20);
+    size_t fill = 0;
+    int fd, isa;
+
+    /* a file of back-to-back response heads, read through the page cache */
+    if((fd = mkstemp(path)) < 0) unix_error("mkstemp error");
+    unlink(path);
+    while(fill + len <= (1 << 20)){
+        memcpy(block + fill, head, len);
+        fill += len;
+    }
+    while(total < mib << 20){
+        Rio_writen(fd, block, fill);
+        total += fill;
+    }
+    free(block);
+    printf("%zu MiB of %zu-byte response heads\n", total >> 20, len);
+
+    double classic = run(fd, CLASSIC, &lines);
+    printf("%-28s %8.0f MB/s\n", "classic rio_readlineb", 1e9 / classic);
+    static char *names[] = {"scalar", "sse2", "avx2"};
+    for(isa = RIO_SCAN_SCALAR; isa <= RIO_SCAN_BEST; isa++){
+        if(rio_scan_isa(isa) != isa) continue;      // not on this CPU
+        double t = run(fd, READLINE, &lines);
+        double p = run(fd, PEEKLINE, &lines);
+        printf("rio_readlineb %-14s %8.0f MB/s %5.1fx   rio_peeklineb %8.0f MB/s %5.1fx\n",
+            names[isa], 1e9 / t, classic / t, 1e9 / p, classic / p);
+    }
+    close(fd);
+    return 0;
+}
@@ -1,103 +1,381 @@
 #include "csapp.h"
 #include "cache.h"
+#include "policy.h"
+#include "epoch.h"
+
+void (*evict_hook)(node *nd) = NULL;
+int (*cold_hook)(shard *s, node *nd) = NULL;
+
+static void pbuf_free(pbuf *pb);
+static void retire_node(void *s, void *nd);
+static void retire_table(void *t, void *unused);
+static htable *table_new(size_t nbuckets);
+
+/* Initialize cache split into nshards shards, each owning an equal share of MAX_CACHE_SIZE */
+cache *init_cache(int nshards){
+    int i, l, n = 1;
+    /* round down to a power of 2 and keep room for the largest object in every shard */
+    while(n * 2 <= nshards && MAX_CACHE_SIZE / (n * 2) >= MAX_OBJECT_SIZE) n *= 2;
 
-/* Initialize cache */
-cache *init_cache(){
     cache *c = (cache*)malloc(sizeof(cache));
-    c -> size = 0;
-    c -> start = (node*)malloc(sizeof(node));
-    c -> end = (node*)malloc(sizeof(node));
-    c -> start -> prev = NULL;
-    c -> end -> next = NULL;
-    c -> start -> next = c -> end;
-    c -> end -> prev = c -> start;
+    c -> nshards = n;
+    c -> shards = (shard*)calloc(n, sizeof(shard));
+    c -> mem = arena_new();
+    for(i = 0; i < n; i++){
+        shard *s = &c -> shards[i];
+        pthread_rwlock_init(&s -> lock, NULL);
+        s -> size = 0;
+        s -> capacity = MAX_CACHE_SIZE / n;
+        s -> count = 0;
+        s -> table = table_new(CACHE_INIT_BUCKETS);
+        s -> seq = 0;
+        for(l = 0; l < CACHE_LISTS; l++){
+            nlist *ls = &s -> lists[l];
+            ls -> start = (node*)malloc(sizeof(node));
+            ls -> end = (node*)malloc(sizeof(node));
+            ls -> start -> prev = NULL;
+            ls -> end -> next = NULL;
+            ls -> start -> next = ls -> end;
+            ls -> end -> prev = ls -> start;
+            ls -> size = 0;
+        }
+        s -> hand = NULL;
+        s -> sketch = NULL;
+        s -> pq = NULL;
+        memset(&s -> stats, 0, sizeof(s -> stats));
+        s -> mem = c -> mem;
+        if(cache_policy -> init) cache_policy -> init(s);
+    }
     return c;
 }
 
-/* Insert new node into cache list(linked list) */
-void insert(cache *c, int port, size_t size, char* payload, char* host, char* filename){
-    node *new = (node*) malloc(sizeof(node));
+/* Pick the shard owning a key hash; high bits so bucket index(low bits) stays independent */
+shard *get_shard(cache *c, unsigned int hash){
+    return &c -> shards[(hash >> 24) & (c -> nshards - 1)];
+}
+
+/*
+ * Insert new node into its shard's hash index and let the policy place
+ * it, evicting as many victims as its size needs. cost is the object's
+ * miss latency in usec, 0 if unknown. The node and its key take one arena
+ * allocation, the payload another, and the shard is charged for both
+ */
+void insert(cache *c, int port, size_t size, char* payload, char* host, char* filename, unsigned long cost){
+    insert_at(c, port, size, payload, host, filename, cost, 0);
+}
+
+/* insert() of an object that entered the cache at stored(0 : now), so it keeps its age */
+void insert_at(cache *c, int port, size_t size, char* payload, char* host, char* filename, unsigned long cost, time_t stored){
+    size_t hostlen = strlen(host) + 1, filelen = strlen(filename) + 1;
+    size_t nodesize = sizeof(node) + hostlen + filelen;
+    size_t charge = arena_charge(c -> mem, nodesize) + (payload ? arena_charge(c -> mem, sizeof(pbuf) + size) : 0);
+    shard *s = get_shard(c, hash_key(port, host, filename));
+    if(charge > s -> capacity) return;      // would empty the shard and still not fit
+    node *new = arena_alloc(c -> mem, nodesize);
+    if(new == NULL) return;
     new -> port = port;
     new -> size = size;
-    if(payload){
-        new -> payload = (char*)malloc(size);
-        memcpy(new -> payload, payload, size);
+    new -> cost = cost;
+    new -> hits = new -> seen = 0;
+    new -> referenced = 0;
+    new -> host = (char*)(new + 1);
+    new -> filename = new -> host + hostlen;
+    memcpy(new -> host, host, hostlen);
+    memcpy(new -> filename, filename, filelen);
+    new -> payload = NULL;
+    new -> charge = charge;
+    if(payload && (new -> payload = pbuf_new(c -> mem, payload, size)) == NULL){
+        arena_free(c -> mem, new, nodesize);
+        return;
     }
-    if(host){
-        new -> host = (char*)malloc(strlen(host));
-        strcpy(new -> host, host);
+    if(payload && stored) new -> payload -> stored = stored;
+    new -> hash = hash_key(port, new -> host, new -> filename);
+
+    pthread_rwlock_wrlock(&s -> lock);
+    /* a racing fetch of the same object already cached it : the newer copy replaces it */
+    node *old = find(s, new -> hash, port, new -> host, new -> filename);
+    if(old){
+        unlink_node(s, old);
+        hash_remove(s, old);
+        s -> size -= old -> charge;
+        epoch_retire(retire_node, s, old);
     }
-    if(filename){
-        new -> filename = (char*)malloc(strlen(filename));
-        strcpy(new -> filename, filename);
+    while(s -> size + new -> charge > s -> capacity && evict(s))    // make room for all of it
+        ;
+    if(s -> size + new -> charge > s -> capacity){      // what is left can't be evicted
+        pthread_rwlock_unlock(&s -> lock);
+        clear_node(s, new);     // never visible to readers
+        epoch_reclaim();
+        return;
     }
 
-    if((c -> size) + size > MAX_CACHE_SIZE) evict(c);   // evict if cache is full
-
-    front_append(c, new);
-    c -> size += size;
+    cache_policy -> admit(s, new);
+    hash_insert(s, new);
+    s -> size += new -> charge;
+    pthread_rwlock_unlock(&s -> lock);
+    epoch_reclaim();    // free victims no reader can see any more
 	return;
 }
 
-/* LRU policy : evict if cache is full */
-void evict(cache *c){
-    if(c == NULL || c->size == 0) return;
-    node *nd = c -> end -> prev;
-    nd -> prev -> next = c -> end;
-    c -> end -> prev = nd -> prev;
-    c -> size -= (nd -> size);
-    clear_node(nd);
+/*
+ * Evict the node the policy picks; hits only set flags, so the policy
+ * catches up on them here. Returns 0 if there was nothing to evict
+ */
+int evict(shard *s){
+    if(s == NULL || s->size == 0) return 0;
+    node *nd = cache_policy -> victim(s);
+    if(nd == NULL) return 0;
+    if(cold_hook && cold_hook(s, nd)) return 1;     // kept, smaller : maybe that is room enough
+    unlink_node(s, nd);
+    hash_remove(s, nd);
+    s -> size -= nd -> charge;
+    __atomic_add_fetch(&s -> stats.evictions, 1, __ATOMIC_RELAXED);
+    if(evict_hook) evict_hook(nd);  // called under the write lock : must not block
+    epoch_retire(retire_node, s, nd);   // readers may still be looking at it
+    return 1;
+}
+
+/* Free a node and its key; the payload lives on until its last reader unpins it */
+void clear_node(shard *s, node *nd){
+    pbuf_unpin(nd -> payload);
+    arena_free(s -> mem, nd, sizeof(node) + strlen(nd -> host) + strlen(nd -> filename) + 2);
     return;
 }
 
-/* Free a node and all the ptrs inside it */
-void clear_node(node *nd){
-    free(nd -> host);
-    free(nd -> payload);
-    free(nd -> filename);
-    free(nd);
+static void retire_node(void *s, void *nd){
+    clear_node(s, nd);
+}
+
+/* Append a node to the very front of list l */
+void list_push(shard *s, int l, node *nd){
+    if(s == NULL || nd == NULL) return;
+    nlist *ls = &s -> lists[l];
+    ls -> start -> next -> prev = nd;
+    nd -> prev = ls -> start;
+    nd -> next = ls -> start -> next;
+    ls -> start -> next = nd;
+    ls -> size += nd -> size;
+    nd -> list = l;
     return;
 }
 
-/* LRU policy : append a node to the very front which is recently used */
-void front_append(cache *c, node *nd){
-    if(c == NULL || nd == NULL) return;
-    c -> start -> next -> prev = nd;
-    nd -> prev = c -> start;
-    nd -> next = c -> start -> next;
-    c -> start -> next = nd;
+/* Move a node to the very front of list l, from whichever list holds it */
+void list_move(shard *s, int l, node *nd){
+    if(s == NULL || nd == NULL || nd -> next == NULL || nd -> prev == NULL) return;
+    list_unlink(s, nd);
+    list_push(s, l, nd);
     return;
 }
 
-/* LRU policy : move a node to the very front which is recently used */
-void front_move(cache *c, node *nd){
-    if(c == NULL || nd == NULL || nd -> next == NULL || nd -> prev == NULL) return;
+/* Take a node out of the policy's structures : its list, and whatever else the policy keeps */
+void unlink_node(shard *s, node *nd){
+    if(cache_policy -> remove) cache_policy -> remove(s, nd);
+    list_unlink(s, nd);
+}
+
+/* Give a linked node a new size and charge where it stands in the policy's order */
+void resize_node(shard *s, node *nd, size_t size, size_t charge){
+    s -> lists[nd -> list].size += size - nd -> size;
+    nd -> size = size;
+    s -> size += charge - nd -> charge;
+    nd -> charge = charge;
+}
+
+/* Take a node off its list, stepping CLOCK's hand past it */
+void list_unlink(shard *s, node *nd){
+    if(s -> hand == nd) s -> hand = nd -> prev -> prev ? nd -> prev : NULL;
     nd -> prev -> next = nd -> next;
     nd -> next -> prev = nd -> prev;
-    front_append(c, nd);
+    nd -> prev = nd -> next = NULL;
+    s -> lists[nd -> list].size -= nd -> size;
     return;
 }
 
 /* Find a node that matches port, host, filename information */
-node *find(cache *c, int port, char *host, char *filename){
-    if(!c) return NULL;
-    node* nd = c -> start -> next;
-    while(nd != (c -> end)){
-        if(!strcmp(nd -> host, host)
-            && !strcmp(nd -> filename, filename)
-            && (nd -> port == port)) return nd;
-        nd = nd -> next;
+node *find(shard *s, unsigned int hash, int port, char *host, char *filename){
+    if(!s || !host || !filename) return NULL;
+    htable *t = __atomic_load_n(&s -> table, __ATOMIC_ACQUIRE);
+    node* nd = __atomic_load_n(&t -> buckets[hash & (t -> nbuckets - 1)], __ATOMIC_ACQUIRE);
+    while(nd){
+        if(nd -> hash == hash
+            && (nd -> port == port)
+            && !strcmp(nd -> host, host)
+            && !strcmp(nd -> filename, filename)) return nd;
+        nd = __atomic_load_n(&nd -> hnext, __ATOMIC_ACQUIRE);
     }
     return NULL;
 }
 
-/* Return payload of the node found to match */
-char *get_payload(cache *c, int port, size_t* size, char* host, char* filename){
-    node* nd = find(c, port, host, filename);
-    if(nd == NULL) return NULL;
-    char *res = (char*)malloc(nd -> size);
-    memcpy(res, nd -> payload, nd -> size);
-    (*size) = nd -> size;
-    front_move(c, nd);
+/*
+ * Return the payload of the node found to match, pinned so it outlives an
+ * eviction. Takes no lock : the epoch keeps the node alive while it's read,
+ * and a miss that raced a resize is retried. Caller must pbuf_unpin() it
+ */
+pbuf *get_payload(cache *c, int port, char* host, char* filename){
+    unsigned int h = hash_key(port, host, filename), seq;
+    shard *s = get_shard(c, h);
+    pbuf *res = NULL;
+    node *nd;
+
+    epoch_enter();
+    do{
+        seq = __atomic_load_n(&s -> seq, __ATOMIC_ACQUIRE);
+        nd = find(s, h, port, host, filename);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }while(nd == NULL && ((seq & 1) || __atomic_load_n(&s -> seq, __ATOMIC_RELAXED) != seq));
+    if(nd && (res = __atomic_load_n(&nd -> payload, __ATOMIC_ACQUIRE))){
+        pbuf_pin(res);
+        __atomic_add_fetch(&s -> stats.hits, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s -> stats.saved_us, nd -> cost, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&s -> stats.lookups, 1, __ATOMIC_RELAXED);
+    policy_touch(s, res ? nd : NULL, h);     // record the access without list surgery
+    epoch_exit();
+
+    /* a compressed payload is inflated outside the epoch, so reclamation needn't wait on it */
+    if(res && (res = pbuf_open(res))) __atomic_add_fetch(&s -> stats.hit_bytes, res -> size, __ATOMIC_RELAXED);
     return res;
-}
\ No newline at end of file
+}
+
+/* Account the bytes of a response that had to come from the origin */
+void count_miss(cache *c, int port, char *host, char *filename, size_t bytes){
+    shard *s = get_shard(c, hash_key(port, host, filename));
+    __atomic_add_fetch(&s -> stats.miss_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Hit accounting summed over all shards */
+void cache_totals(cache *c, cache_stats *t){
+    int i;
+    memset(t, 0, sizeof(cache_stats));
+    for(i = 0; i < c -> nshards; i++){
+        cache_stats *st = &c -> shards[i].stats;
+        t -> lookups += __atomic_load_n(&st -> lookups, __ATOMIC_RELAXED);
+        t -> hits += __atomic_load_n(&st -> hits, __ATOMIC_RELAXED);
+        t -> hit_bytes += __atomic_load_n(&st -> hit_bytes, __ATOMIC_RELAXED);
+        t -> miss_bytes += __atomic_load_n(&st -> miss_bytes, __ATOMIC_RELAXED);
+        t -> saved_us += __atomic_load_n(&st -> saved_us, __ATOMIC_RELAXED);
+        t -> evictions += __atomic_load_n(&st -> evictions, __ATOMIC_RELAXED);
+    }
+}
+
+/* Object and byte hit ratios, and the origin latency hits saved, over all shards */
+void cache_report(cache *c, FILE *fp){
+    cache_stats t;
+    cache_totals(c, &t);
+    fprintf(fp, "cache: %lu lookups, %.1f%% hit ratio, %.1f%% byte hit ratio, %.3f s origin latency saved, %lu evictions\n",
+        t.lookups, t.lookups ? 100.0 * t.hits / t.lookups : 0.0,
+        t.hit_bytes + t.miss_bytes ? 100.0 * t.hit_bytes / (t.hit_bytes + t.miss_bytes) : 0.0,
+        t.saved_us / 1e6, t.evictions);
+}
+
+/* Allocate a payload buffer in arena a holding a copy of data, owned by the caller */
+pbuf *pbuf_new(arena *a, char *data, size_t size){
+    pbuf *pb = arena_alloc(a, sizeof(pbuf) + size);
+    if(pb == NULL) return NULL;
+    pb -> refs = 1;
+    pb -> size = size;
+    pb -> data = (char*)(pb + 1);
+    pb -> stored = time(NULL);
+    pb -> expires = pb -> stale_until = 0;
+    pb -> refreshing = 0;
+    pb -> release = pbuf_free;
+    pb -> open = NULL;
+    pb -> owner = a;
+    pb -> stored_as = NULL;
+    memcpy(pb -> data, data, size);
+    return pb;
+}
+
+/* Take a reference; caller must already hold one or the shard lock protecting the owner */
+void pbuf_pin(pbuf *pb){
+    __atomic_add_fetch(&pb -> refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * The object's bytes from a pinned payload : pb itself, or an inflated
+ * copy of it(pb unpinned) if it is stored compressed. NULL if that fails
+ */
+pbuf *pbuf_open(pbuf *pb){
+    return (pb && pb -> open) ? pb -> open(pb) : pb;
+}
+
+/* Drop a reference and free the buffer(releasing borrowed data) with the last one */
+void pbuf_unpin(pbuf *pb){
+    if(pb && __atomic_sub_fetch(&pb -> refs, 1, __ATOMIC_ACQ_REL) == 0) pb -> release(pb);
+}
+
+static void pbuf_free(pbuf *pb){
+    arena_free(pb -> owner, pb, sizeof(pbuf) + pb -> size);
+}
+
+/* FNV-1a hash over host, port and filename */
+unsigned int hash_key(int port, char *host, char *filename){
+    unsigned int h = 2166136261u;
+    unsigned char *p;
+    for(p = (unsigned char*)host; p && *p; p++) h = (h ^ *p) * 16777619u;
+    h = (h ^ (port & 0xff)) * 16777619u;
+    h = (h ^ ((port >> 8) & 0xff)) * 16777619u;
+    for(p = (unsigned char*)filename; p && *p; p++) h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+/* Link a node into its bucket, doubling the table when load factor exceeds 1 */
+void hash_insert(shard *s, node *nd){
+    if(s -> count + 1 > s -> table -> nbuckets) hash_resize(s, s -> table -> nbuckets * 2);
+    node **bucket = &s -> table -> buckets[nd -> hash & (s -> table -> nbuckets - 1)];
+    nd -> hnext = *bucket;
+    __atomic_store_n(bucket, nd, __ATOMIC_RELEASE);     // publish the node fully built
+    s -> count++;
+    return;
+}
+
+/* Unlink a node from its bucket; its own hnext stays intact for readers standing on it */
+void hash_remove(shard *s, node *nd){
+    node **pp = &s -> table -> buckets[nd -> hash & (s -> table -> nbuckets - 1)];
+    while(*pp){
+        if(*pp == nd){
+            __atomic_store_n(pp, nd -> hnext, __ATOMIC_RELEASE);
+            s -> count--;
+            return;
+        }
+        pp = &(*pp) -> hnext;
+    }
+    return;
+}
+
+/*
+ * Rehash every node into a new table of nbuckets(power of 2) buckets and
+ * swap it in. Relinking moves nodes between chains under readers' feet,
+ * so seq is odd meanwhile and a reader that missed looks again
+ */
+void hash_resize(shard *s, size_t nbuckets){
+    htable *old = s -> table, *t = table_new(nbuckets);
+    if(t == NULL) return;     // keep the old table, chains just grow longer
+    size_t i;
+    __atomic_store_n(&s -> seq, s -> seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(i = 0; i < old -> nbuckets; i++){
+        node *nd = old -> buckets[i];
+        while(nd){
+            node *next = nd -> hnext;
+            node **bucket = &t -> buckets[nd -> hash & (nbuckets - 1)];
+            __atomic_store_n(&nd -> hnext, *bucket, __ATOMIC_RELAXED);
+            *bucket = nd;
+            nd = next;
+        }
+    }
+    __atomic_store_n(&s -> table, t, __ATOMIC_RELEASE);
+    __atomic_store_n(&s -> seq, s -> seq + 1, __ATOMIC_RELEASE);
+    epoch_retire(retire_table, old, NULL);
+    return;
+}
+
+static htable *table_new(size_t nbuckets){
+    htable *t = calloc(1, sizeof(htable) + nbuckets * sizeof(node*));
+    if(t) t -> nbuckets = nbuckets;
+    return t;
+}
+
+static void retire_table(void *t, void *unused){
+    free(t);
+}
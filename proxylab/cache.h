@@ -1,32 +1,140 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include "slab.h"
+
 #define MAX_CACHE_SIZE 1048576
+#define MAX_OBJECT_SIZE 102400
+#define CACHE_INIT_BUCKETS 64
+#define CACHE_SHARDS 8      // default shard count, see init_cache()
+#define CACHE_LISTS 3       // recency lists per shard, as many as any policy needs
+
+/*
+ * Immutable, reference-counted payload : one ref for the owning node plus
+ * one per pinned reader. data follows the header in the cache's arena, or
+ * lives in memory owned by someone else(a disk segment mapping); either
+ * way release frees it when the last ref drops. How long it stays fresh
+ * is worked out from its headers on first use(fresh_state()). A cold
+ * payload may be stored compressed, with open set : pbuf_open() gives
+ * readers the object's bytes
+ */
+typedef struct pbuf{
+    int refs;
+    size_t size;
+    char *data;
+    time_t stored;          // when it entered the cache, wall clock
+    time_t expires;         // fresh until then, 0 until worked out
+    time_t stale_until;     // may be served stale, while one refresh runs, until then
+    int refreshing;         // a background refresh of it is queued or running
+    void (*release)(struct pbuf *pb);   // frees pb and lets owner know
+    struct pbuf *(*open)(struct pbuf *pb);  // NULL if data is the object as is
+    void *owner;
+    struct pbuf *stored_as; // an opened copy's pinned stored payload, which keeps the freshness state; else NULL
+} pbuf;
 
 typedef struct node{
     int port;
     size_t size;
-    char* payload;
-    char* host;
+    unsigned int hash;      // hash of (host, port, filename)
+    int referenced;         // set by readers on hit, consumed by the policy under the write lock
+    int list;               // which of its shard's lists holds it
+    unsigned long cost;     // measured miss latency in usec, 0 if unknown
+    unsigned int hits;      // counted by readers for GDSF
+    unsigned int seen;      // hits already folded into prio
+    double prio;            // GDSF priority
+    size_t heapidx;         // position in GDSF's heap
+    size_t charge;          // arena bytes the node, its key and payload take
+    pbuf* payload;
+    char* host;             // both stored right after the node
     char* filename;
     struct node *prev;
     struct node *next;
+    struct node *hnext;     // next node in the same hash bucket
 } node;
 
-typedef struct cache{
-    size_t size;
+/* Doubly-linked list between two sentinels, most recent at the start */
+typedef struct nlist{
     struct node *start;
     struct node *end;
+    size_t size;            // payload bytes on the list
+} nlist;
+
+/* Hit accounting, updated with atomics by lock-free readers */
+typedef struct cache_stats{
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long hit_bytes;
+    unsigned long miss_bytes;   // relayed from origins, cacheable or not
+    unsigned long saved_us;     // miss latency the hits avoided, by each object's measured cost
+    unsigned long evictions;
+} cache_stats;
+
+/* Hash index; replaced whole on resize, the old one retired once readers are done with it */
+typedef struct htable{
+    size_t nbuckets;        // always a power of 2
+    struct node *buckets[];
+} htable;
+
+/*
+ * One independently locked slice of the cache : own recency lists, hash
+ * index and budget. Hits take no lock : they read the index inside an
+ * epoch, and unlinked nodes are only freed once no reader can hold them
+ */
+typedef struct shard{
+    pthread_rwlock_t lock;  // writers, and readers of the lists(snapshots)
+    size_t size;            // arena bytes charged to the shard's nodes
+    size_t capacity;
+    size_t count;           // number of nodes in shard
+    htable *table;
+    unsigned int seq;       // odd while a resize relinks nodes : readers retry a miss
+    nlist lists[CACHE_LISTS];   // what each list means is up to the eviction policy
+    struct node *hand;          // CLOCK's hand, NULL to start over from the tail
+    struct sketch *sketch;      // TinyLFU's frequency sketch, NULL for other policies
+    struct pqueue *pq;          // GDSF's priority queue, NULL for other policies
+    cache_stats stats;
+    arena *mem;             // the cache's, shared by every shard
+} shard;
+
+typedef struct cache{
+    int nshards;            // always a power of 2
+    struct shard *shards;
+    arena *mem;             // nodes, keys and payloads
 } cache;
 
 
-cache *init_cache();
-void insert(cache *c, int port, size_t size, char* payload, char* host, char* filename);
-void clear_node(node *nd);
-void evict(cache *c);
-void front_append(cache *c, node *nd);
-void front_move(cache *c, node *nd);
-node *find(cache *c, int port, char *host, char *filename);
-char *get_payload(cache *c, int port, size_t *size, char* host, char* filename);
+extern void (*evict_hook)(node *nd);   // sees every victim of evict() before it is freed
+extern int (*cold_hook)(shard *s, node *nd);   // may shrink a victim in place of evicting it
+
+cache *init_cache(int nshards);
+void insert(cache *c, int port, size_t size, char* payload, char* host, char* filename, unsigned long cost);
+void insert_at(cache *c, int port, size_t size, char* payload, char* host, char* filename, unsigned long cost, time_t stored);
+pbuf *get_payload(cache *c, int port, char* host, char* filename);
+shard *get_shard(cache *c, unsigned int hash);
+void count_miss(cache *c, int port, char *host, char *filename, size_t bytes);
+void cache_totals(cache *c, cache_stats *t);
+void cache_report(cache *c, FILE *fp);
+
+/* Shard internals : caller holds the shard lock (write lock unless noted) */
+void clear_node(shard *s, node *nd);
+int evict(shard *s);
+void list_push(shard *s, int l, node *nd);
+void list_move(shard *s, int l, node *nd);
+void list_unlink(shard *s, node *nd);
+void unlink_node(shard *s, node *nd);
+void resize_node(shard *s, node *nd, size_t size, size_t charge);
+node *find(shard *s, unsigned int hash, int port, char *host, char *filename);   // or inside an epoch
+
+pbuf *pbuf_new(arena *a, char *data, size_t size);
+void pbuf_pin(pbuf *pb);
+void pbuf_unpin(pbuf *pb);
+pbuf *pbuf_open(pbuf *pb);
+
+unsigned int hash_key(int port, char *host, char *filename);
+void hash_insert(shard *s, node *nd);
+void hash_remove(shard *s, node *nd);
+void hash_resize(shard *s, size_t nbuckets);
 
 #endif
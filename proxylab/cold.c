@@ -0,0 +1,123 @@
+#include "csapp.h"
+#include "cold.h"
+#include "policy.h"
+#include "epoch.h"
+#include "http.h"
+#include "lz4.h"
+
+/*
+ * Compressed payloads hold the object's length, then its LZ4 block. They
+ * are only ever read through pbuf_open(), which inflates a private copy
+ */
+typedef unsigned int rawlen;
+
+/* updated with atomics : shrinks run under different shards' locks */
+static unsigned long shrunk, incompressible, raw_bytes, packed_bytes, opened;
+
+static __thread char *scratch;      // each thread's compression buffer
+static __thread size_t scratchcap;
+
+static int cold_shrink(shard *s, node *nd);
+static pbuf *cold_open(pbuf *pb);
+static void copy_free(pbuf *pb);
+static void retire_payload(void *pb, void *unused);
+
+/* Compress victims from now on, evicting them only once they come round again */
+void cold_init(void){
+    cold_hook = cold_shrink;
+}
+
+/*
+ * cold_hook : rather than evict victim nd, store its payload compressed,
+ * charged what the compressed copy takes, and let the policy requeue it
+ * for a second pass : mid-list, back on probation, or behind the hand,
+ * never ahead of what was used since. It goes for real when the policy
+ * picks it again. Runs under the shard's write lock. Returns 0 to let
+ * evict() go ahead : nd is compressed already, or wouldn't shrink by a
+ * COLD_SAVING-th(too small, or already encoded by its origin)
+ */
+static int cold_shrink(shard *s, node *nd){
+    pbuf *old = nd -> payload, *pb;
+    rawlen raw;
+    hline h;
+    int n;
+
+    if(old == NULL || old -> open || old -> size < COLD_MIN) return 0;
+    if(http_find_header(old -> data, old -> size, "Content-Encoding", 16, &h)){    // gzip, br : no gain
+        __atomic_fetch_add(&incompressible, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if(scratchcap < old -> size){
+        scratch = Realloc(scratch, old -> size);
+        scratchcap = old -> size;
+    }
+    raw = old -> size;
+    n = lz4_compress(old -> data, raw, scratch + sizeof(raw), raw - raw / COLD_SAVING - sizeof(raw));
+    if(n == 0){
+        __atomic_fetch_add(&incompressible, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    memcpy(scratch, &raw, sizeof(raw));
+    if((pb = pbuf_new(s -> mem, scratch, sizeof(raw) + n)) == NULL) return 0;
+    pb -> stored = old -> stored;
+    pb -> expires = __atomic_load_n(&old -> expires, __ATOMIC_ACQUIRE);     // worked out already, maybe
+    pb -> stale_until = __atomic_load_n(&old -> stale_until, __ATOMIC_RELAXED);
+    pb -> open = cold_open;
+
+    resize_node(s, nd, pb -> size, nd -> charge - arena_charge(s -> mem, sizeof(pbuf) + old -> size)
+        + arena_charge(s -> mem, sizeof(pbuf) + pb -> size));
+    cache_policy -> requeue(s, nd);
+    __atomic_store_n(&nd -> payload, pb, __ATOMIC_RELEASE);
+    epoch_retire(retire_payload, old, NULL);    // a reader may be about to pin it
+
+    __atomic_fetch_add(&shrunk, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&raw_bytes, raw, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&packed_bytes, pb -> size, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * pbuf open of a compressed payload : a private inflated copy, freed by its
+ * last unpin. Only the bytes are private : the copy keeps pb pinned, and
+ * freshness is worked out and refreshes are claimed on pb
+ */
+static pbuf *cold_open(pbuf *pb){
+    rawlen raw;
+
+    memcpy(&raw, pb -> data, sizeof(raw));
+    pbuf *copy = Malloc(sizeof(pbuf) + raw);
+    copy -> refs = 1;
+    copy -> size = raw;
+    copy -> data = (char *)(copy + 1);
+    copy -> stored = pb -> stored;
+    copy -> expires = copy -> stale_until = 0;
+    copy -> refreshing = 0;
+    copy -> release = copy_free;
+    copy -> open = NULL;
+    copy -> owner = NULL;
+    copy -> stored_as = pb;
+    int n = lz4_decompress(pb -> data + sizeof(raw), pb -> size - sizeof(raw), copy -> data, raw);
+    if(n != (int)raw){
+        pbuf_unpin(pb);
+        free(copy);
+        return NULL;
+    }
+    __atomic_fetch_add(&opened, 1, __ATOMIC_RELAXED);
+    return copy;
+}
+
+void cold_report(FILE *fp){
+    unsigned long r = __atomic_load_n(&raw_bytes, __ATOMIC_RELAXED), p = __atomic_load_n(&packed_bytes, __ATOMIC_RELAXED);
+    fprintf(fp, "cold: %lu payloads compressed(%lu -> %lu bytes, %.2fx), %lu incompressible, %lu hits inflated\n",
+        __atomic_load_n(&shrunk, __ATOMIC_RELAXED), r, p, p ? (double)r / p : 0.0,
+        __atomic_load_n(&incompressible, __ATOMIC_RELAXED), __atomic_load_n(&opened, __ATOMIC_RELAXED));
+}
+
+static void copy_free(pbuf *pb){
+    pbuf_unpin(pb -> stored_as);
+    free(pb);
+}
+
+static void retire_payload(void *pb, void *unused){
+    pbuf_unpin(pb);
+}
@@ -0,0 +1,13 @@
+#ifndef __COLD_H__
+#define __COLD_H__
+
+#include <stdio.h>
+#include "cache.h"
+
+#define COLD_MIN 1024           // smaller payloads aren't worth compressing
+#define COLD_SAVING 8           // a compressed copy must save at least 1/COLD_SAVING of the payload
+
+void cold_init(void);
+void cold_report(FILE *fp);
+
+#endif
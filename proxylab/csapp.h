@@ -42,7 +42,7 @@ typedef struct sockaddr SA;
 
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 16384   /* Holds a whole request head (MAX_HEADER_SIZE) */
 typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
@@ -51,6 +51,12 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* Newline scanners behind the Rio line readers, for rio_scan_isa() */
+#define RIO_SCAN_SCALAR 0
+#define RIO_SCAN_SSE2 1
+#define RIO_SCAN_AVX2 2
+#define RIO_SCAN_BEST RIO_SCAN_AVX2
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -178,6 +184,11 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_fillb(rio_t *rp);
+ssize_t	rio_peeklineb(rio_t *rp, char **linep);
+void	rio_skipb(rio_t *rp, size_t n);
+char	*rio_findnl(char *p, size_t n);
+int	rio_scan_isa(int isa);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -0,0 +1,450 @@
+#include "csapp.h"
+#include "cache.h"
+#include "disk.h"
+#include <dirent.h>
+
+#define RECORD_ALIGN 8
+
+static char *segdir;
+static segment **segs;          // oldest first; the last one is being appended to
+static int nsegs, maxsegs, next_id;
+static dentry *buckets[DISK_BUCKETS];
+static spill *head, *tail;      // spill queue
+static size_t queued;           // payload bytes in the queue
+static spill *writing;          // item the writer is appending right now
+static int writing_forgotten;   // its key was forgotten meanwhile : don't index it
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int enabled;
+static unsigned long entries, hits, misses, spilled, dropped, compacted, retired;
+
+static void *writer(void *vargp);
+static segment *seg_open(void);
+static void seg_unpin(void *vseg);
+static void disk_release(pbuf *pb);
+static long write_record(int port, char *host, char *filename, char *data, size_t size, time_t stored);
+static size_t record_size(char *host, char *filename, size_t size);
+static dentry *lookup(unsigned int hash, int port, char *host, char *filename);
+static void unindex(dentry *d);
+static void retire(segment *s);
+static int compact(void);
+
+/*
+ * Start the L2 tier : up to mbytes of segment files in dir, which is
+ * created if needed and emptied of old segments. Returns -1 if it can't
+ */
+int disk_init(char *dir, long mbytes){
+    char path[MAXLINE];
+    struct dirent *de;
+    DIR *dp;
+    pthread_t tid;
+    sigset_t all, prev;
+
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+        fprintf(stderr, "disk: can't create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    if((dp = opendir(dir)) == NULL){
+        fprintf(stderr, "disk: can't open %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    while((de = readdir(dp)) != NULL){
+        if(strncmp(de -> d_name, "seg.", 4)) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de -> d_name);
+        unlink(path);
+    }
+    closedir(dp);
+
+    segdir = strdup(dir);
+    maxsegs = (mbytes << 20) / DISK_SEGMENT_SIZE;
+    if(maxsegs < 2) maxsegs = 2;    // one being filled, one being compacted
+    segs = Calloc(maxsegs + 1, sizeof(segment*));
+    if((segs[0] = seg_open()) == NULL) return -1;
+    nsegs = 1;
+    enabled = 1;
+    /* the writer never handles signals : keep SIGUSR1 for the accept loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &prev);
+    Pthread_create(&tid, NULL, writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+    return 0;
+}
+
+int disk_enabled(){
+    return enabled;
+}
+
+/*
+ * Return the payload of (port, host, filename) if the tier holds it. The
+ * pbuf points straight into the segment mapping, which stays mapped until
+ * the caller pbuf_unpin()s it
+ */
+pbuf *disk_get(int port, char *host, char *filename){
+    if(!enabled) return NULL;
+    unsigned int h = hash_key(port, host, filename);
+    pbuf *pb = Malloc(sizeof(pbuf));
+
+    pthread_mutex_lock(&lock);
+    dentry *d = lookup(h, port, host, filename);
+    if(d == NULL){
+        misses++;
+        pthread_mutex_unlock(&lock);
+        free(pb);
+        return NULL;
+    }
+    hits++;
+    d -> seg -> refs++;
+    drecord *rec = (drecord*)(d -> seg -> base + d -> off);
+    pb -> refs = 1;
+    pb -> size = rec -> size;
+    pb -> data = (char*)(rec + 1) + rec -> hostlen + rec -> filelen;
+    pb -> stored = rec -> stored;
+    pb -> expires = pb -> stale_until = 0;
+    pb -> refreshing = 0;
+    pb -> release = disk_release;
+    pb -> open = NULL;
+    pb -> owner = d -> seg;
+    pb -> stored_as = NULL;
+    pthread_mutex_unlock(&lock);
+    return pb;
+}
+
+/*
+ * evict_hook : queue a victim of the memory tier for the writer. Runs
+ * under the shard's write lock, so it only pins the payload and links it
+ */
+void disk_spill(node *nd){
+    if(!enabled || nd -> payload == NULL) return;
+
+    pthread_mutex_lock(&lock);
+    dentry *d = lookup(nd -> hash, nd -> port, nd -> host, nd -> filename);
+    if(d && d -> size == record_size(nd -> host, nd -> filename, nd -> size)){
+        pthread_mutex_unlock(&lock);    // promoted from here earlier, the copy is still good
+        return;
+    }
+    if(queued + nd -> size > DISK_SPILL_MAX){
+        dropped++;      // the writer can't keep up; losing an L2 copy is cheaper than waiting
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    spill *sp = Malloc(sizeof(spill));
+    sp -> hash = nd -> hash;
+    sp -> port = nd -> port;
+    sp -> host = strdup(nd -> host);
+    sp -> filename = strdup(nd -> filename);
+    sp -> payload = nd -> payload;
+    pbuf_pin(sp -> payload);
+    sp -> next = NULL;
+    if(tail) tail -> next = sp;
+    else head = sp;
+    tail = sp;
+    queued += nd -> size;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+/* A fresh copy of the object was fetched : whatever the tier holds or is about to write is stale */
+void disk_forget(int port, char *host, char *filename){
+    if(!enabled) return;
+    unsigned int h = hash_key(port, host, filename);
+    spill **pp, *sp;
+
+    pthread_mutex_lock(&lock);
+    dentry *d = lookup(h, port, host, filename);
+    if(d) unindex(d);
+    for(pp = &head, sp = NULL; *pp; ){
+        spill *cur = *pp;
+        if(cur -> hash == h && cur -> port == port
+            && !strcmp(cur -> host, host) && !strcmp(cur -> filename, filename)){
+            *pp = cur -> next;
+            queued -= cur -> payload -> size;
+            pbuf_unpin(cur -> payload);
+            free(cur -> host);
+            free(cur -> filename);
+            free(cur);
+            continue;
+        }
+        sp = cur;
+        pp = &cur -> next;
+    }
+    tail = sp;
+    if(writing && writing -> hash == h && writing -> port == port
+        && !strcmp(writing -> host, host) && !strcmp(writing -> filename, filename)) writing_forgotten = 1;
+    pthread_mutex_unlock(&lock);
+}
+
+void disk_report(FILE *fp){
+    size_t live = 0;
+    int i;
+    if(!enabled) return;
+    pthread_mutex_lock(&lock);
+    for(i = 0; i < nsegs; i++) live += segs[i] -> live;
+    fprintf(fp, "disk: %d/%d segments, %lu objects, %zu live bytes, %lu hits, %lu misses\n",
+        nsegs, maxsegs, entries, live, hits, misses);
+    fprintf(fp, "disk: %lu spilled, %lu spills dropped, %lu segments compacted, %lu retired\n",
+        spilled, dropped, compacted, retired);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Background writer : append queued victims to the last segment, and
+ * compact sparse segments whenever the queue is empty
+ */
+static void *writer(void *vargp){
+    struct timespec until;
+    Pthread_detach(pthread_self());
+    while(1){
+        pthread_mutex_lock(&lock);
+        while(head == NULL){
+            pthread_mutex_unlock(&lock);
+            if(compact()) {
+                pthread_mutex_lock(&lock);
+                continue;   // more may be worth compacting
+            }
+            pthread_mutex_lock(&lock);
+            if(head) break;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += 1;
+            pthread_cond_timedwait(&wake, &lock, &until);
+        }
+        spill *sp = head;
+        if((head = sp -> next) == NULL) tail = NULL;
+        queued -= sp -> payload -> size;
+        writing = sp;
+        writing_forgotten = 0;
+        pthread_mutex_unlock(&lock);
+
+        time_t stored = sp -> payload -> stored;
+        if((sp -> payload = pbuf_open(sp -> payload)) == NULL){    // records hold objects as they are
+            free(sp -> host);
+            free(sp -> filename);
+            free(sp);
+            pthread_mutex_lock(&lock);
+            writing = NULL;
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        long off = write_record(sp -> port, sp -> host, sp -> filename, sp -> payload -> data, sp -> payload -> size, stored);
+
+        pthread_mutex_lock(&lock);
+        if(off >= 0 && !writing_forgotten){
+            segment *s = segs[nsegs - 1];
+            dentry *d = lookup(sp -> hash, sp -> port, sp -> host, sp -> filename);
+            if(d) unindex(d);
+            d = Malloc(sizeof(dentry));
+            d -> hash = sp -> hash;
+            d -> port = sp -> port;
+            d -> host = sp -> host;
+            d -> filename = sp -> filename;
+            d -> seg = s;
+            d -> off = off;
+            d -> size = record_size(sp -> host, sp -> filename, sp -> payload -> size);
+            d -> next = buckets[d -> hash & (DISK_BUCKETS - 1)];
+            buckets[d -> hash & (DISK_BUCKETS - 1)] = d;
+            s -> live += d -> size;
+            entries++;
+            spilled++;
+            sp -> host = sp -> filename = NULL;     // now owned by the entry
+        }
+        writing = NULL;
+        pthread_mutex_unlock(&lock);
+
+        pbuf_unpin(sp -> payload);
+        free(sp -> host);
+        free(sp -> filename);
+        free(sp);
+    }
+    return NULL;
+}
+
+/*
+ * Writer only : append a record to the last segment, opening a new one
+ * (and retiring the oldest if the tier is full) when it doesn't fit.
+ * Returns the record's offset in segs[nsegs - 1], -1 on failure
+ */
+static long write_record(int port, char *host, char *filename, char *data, size_t size, time_t stored){
+    size_t need = record_size(host, filename, size);
+    segment *s = segs[nsegs - 1];
+    if(need > DISK_SEGMENT_SIZE) return -1;
+
+    if(s -> used + need > DISK_SEGMENT_SIZE){
+        segment *fresh = seg_open();
+        if(fresh == NULL) return -1;
+        if(nsegs == maxsegs) retire(segs[0]);
+        pthread_mutex_lock(&lock);
+        segs[nsegs++] = fresh;
+        pthread_mutex_unlock(&lock);
+        s = fresh;
+    }
+
+    drecord rec = {DISK_MAGIC, port, strlen(host) + 1, strlen(filename) + 1, size, stored};
+    char *p = s -> base + s -> used;
+    memcpy(p, &rec, sizeof(rec));
+    memcpy(p + sizeof(rec), host, rec.hostlen);
+    memcpy(p + sizeof(rec) + rec.hostlen, filename, rec.filelen);
+    memcpy(p + sizeof(rec) + rec.hostlen + rec.filelen, data, size);
+
+    /* readers only reach the bytes through the index, published under the lock after this */
+    long off = s -> used;
+    pthread_mutex_lock(&lock);
+    s -> used += need;
+    pthread_mutex_unlock(&lock);
+    return off;
+}
+
+static size_t record_size(char *host, char *filename, size_t size){
+    size_t n = sizeof(drecord) + strlen(host) + 1 + strlen(filename) + 1 + size;
+    return (n + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+/* Create, size and map the next segment file */
+static segment *seg_open(void){
+    char path[MAXLINE];
+    snprintf(path, sizeof(path), "%s/seg.%d", segdir, next_id);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, DISK_SEGMENT_SIZE) < 0){
+        fprintf(stderr, "disk: can't create %s: %s\n", path, strerror(errno));
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+    char *base = mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED){
+        fprintf(stderr, "disk: can't map %s: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    segment *s = Calloc(1, sizeof(segment));
+    s -> id = next_id++;
+    s -> fd = fd;
+    s -> base = base;
+    s -> refs = 1;
+    return s;
+}
+
+/* Drop a segment reference; the last one unmaps it */
+/* pbuf release of a hit : unpin the segment it points into */
+static void disk_release(pbuf *pb){
+    seg_unpin(pb -> owner);
+    free(pb);
+}
+
+static void seg_unpin(void *vseg){
+    segment *s = vseg;
+    pthread_mutex_lock(&lock);
+    int last = --s -> refs == 0;
+    pthread_mutex_unlock(&lock);
+    if(!last) return;
+    munmap(s -> base, DISK_SEGMENT_SIZE);
+    close(s -> fd);
+    free(s);
+}
+
+/* Find the entry of a key; caller holds lock */
+static dentry *lookup(unsigned int hash, int port, char *host, char *filename){
+    dentry *d;
+    for(d = buckets[hash & (DISK_BUCKETS - 1)]; d; d = d -> next)
+        if(d -> hash == hash && d -> port == port
+            && !strcmp(d -> host, host) && !strcmp(d -> filename, filename)) return d;
+    return NULL;
+}
+
+/* Remove an entry from the index and free it; caller holds lock */
+static void unindex(dentry *d){
+    dentry **pp = &buckets[d -> hash & (DISK_BUCKETS - 1)];
+    while(*pp != d) pp = &(*pp) -> next;
+    *pp = d -> next;
+    d -> seg -> live -= d -> size;
+    entries--;
+    free(d -> host);
+    free(d -> filename);
+    free(d);
+}
+
+/*
+ * Writer only : drop a segment from the tier with every entry still in
+ * it. Its file goes now, the mapping once the last pinned hit is done
+ */
+static void retire(segment *s){
+    char path[MAXLINE];
+    size_t off;
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for(off = 0; off < s -> used; ){
+        drecord *rec = (drecord*)(s -> base + off);
+        char *host = (char*)(rec + 1), *filename = host + rec -> hostlen;
+        dentry *d = lookup(hash_key(rec -> port, host, filename), rec -> port, host, filename);
+        if(d && d -> seg == s && d -> off == off) unindex(d);
+        off += record_size(host, filename, rec -> size);
+    }
+    for(i = 0; i < nsegs && segs[i] != s; i++)
+        ;
+    if(i < nsegs){
+        memmove(&segs[i], &segs[i + 1], (nsegs - i - 1) * sizeof(segment*));
+        nsegs--;
+    }
+    retired++;
+    pthread_mutex_unlock(&lock);
+
+    snprintf(path, sizeof(path), "%s/seg.%d", segdir, s -> id);
+    unlink(path);
+    seg_unpin(s);
+}
+
+/*
+ * Writer only : copy the live records of the sparsest sealed segment to
+ * the end of the tier and retire it. Returns 1 if a segment was compacted
+ */
+static int compact(void){
+    segment *s = NULL;
+    size_t off;
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for(i = 0; i < nsegs - 1; i++){
+        segment *c = segs[i];
+        if(c -> live * 100 >= c -> used * DISK_COMPACT_LIVE) continue;
+        if(s == NULL || c -> live * s -> used < s -> live * c -> used) s = c;
+    }
+    if(s) s -> refs++;      // keep it mapped even if write_record retires it under us
+    pthread_mutex_unlock(&lock);
+    if(s == NULL) return 0;
+
+    for(off = 0; off < s -> used; ){
+        drecord *rec = (drecord*)(s -> base + off);
+        char *host = (char*)(rec + 1), *filename = host + rec -> hostlen;
+        char *data = filename + rec -> filelen;
+        unsigned int h = hash_key(rec -> port, host, filename);
+        size_t size = record_size(host, filename, rec -> size);
+
+        pthread_mutex_lock(&lock);
+        dentry *d = lookup(h, rec -> port, host, filename);
+        int live = d && d -> seg == s && d -> off == off;
+        pthread_mutex_unlock(&lock);
+
+        if(live){
+            long to = write_record(rec -> port, host, filename, data, rec -> size, rec -> stored);
+            pthread_mutex_lock(&lock);
+            /* move the entry only if nobody forgot or replaced it while we copied */
+            d = lookup(h, rec -> port, host, filename);
+            if(to >= 0 && d && d -> seg == s && d -> off == off){
+                s -> live -= d -> size;
+                d -> seg = segs[nsegs - 1];
+                d -> off = to;
+                d -> seg -> live += d -> size;
+            }
+            pthread_mutex_unlock(&lock);
+        }
+        off += size;
+    }
+    pthread_mutex_lock(&lock);
+    for(i = 0; i < nsegs && segs[i] != s; i++)
+        ;
+    compacted++;
+    pthread_mutex_unlock(&lock);
+    if(i < nsegs) retire(s);
+    seg_unpin(s);
+    return 1;
+}
@@ -0,0 +1,63 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stdio.h>
+#include "cache.h"
+
+#define DISK_SEGMENT_SIZE (64L << 20)   // bytes per mmap'd segment file
+#define DISK_DEFAULT_SIZE 1024          // MiB of segments kept when --disk-size isn't given
+#define DISK_BUCKETS 65536
+#define DISK_SPILL_MAX (8L << 20)       // evicted bytes waiting for the writer before spills are dropped
+#define DISK_COMPACT_LIVE 50            // compact a sealed segment once less than this % of it is live
+#define DISK_MAGIC 0x4c32u              // "L2"
+
+/* Record header in a segment : key and payload follow it */
+typedef struct drecord{
+    unsigned int magic;
+    int port;
+    unsigned int hostlen;   // both with their NUL
+    unsigned int filelen;
+    size_t size;            // payload bytes
+    time_t stored;          // when the object first entered the cache : promotions keep its age
+} drecord;
+
+/* One segment file, mapped whole and filled by appending records */
+typedef struct segment{
+    int id;
+    int fd;
+    char *base;
+    size_t used;            // append offset
+    size_t live;            // record bytes the index still points at
+    int refs;               // one while listed in the tier, plus one per pinned hit
+} segment;
+
+/* Index entry : where the payload of (port, host, filename) lives */
+typedef struct dentry{
+    unsigned int hash;
+    int port;
+    char *host;
+    char *filename;
+    segment *seg;
+    size_t off;             // of the record header in seg
+    size_t size;            // whole record
+    struct dentry *next;
+} dentry;
+
+/* An evicted object waiting for the writer thread */
+typedef struct spill{
+    unsigned int hash;
+    int port;
+    char *host;
+    char *filename;
+    pbuf *payload;          // pinned
+    struct spill *next;
+} spill;
+
+int disk_init(char *dir, long mbytes);
+int disk_enabled();
+pbuf *disk_get(int port, char *host, char *filename);
+void disk_spill(node *nd);
+void disk_forget(int port, char *host, char *filename);
+void disk_report(FILE *fp);
+
+#endif
@@ -0,0 +1,369 @@
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "dns.h"
+#include "stats.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+
+static dnsentry *table[DNS_BUCKETS];
+static dnsentry *qhead, *qtail;         // waiting for a resolver thread
+static int nentries;
+static long long ttl_usec;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static unsigned long hits, stale, negative, misses, timeouts, failures, resolved;
+
+static void *resolver(void *vargp);
+static dnsentry *lookup(char *host, int create);
+static void enqueue(dnsentry *e);
+static int answer(dnsentry *e, int port, struct addrinfo **res, long long now, int count);
+static void happy_order(dnsentry *e, int *order);
+static void prune(long long now);
+static int same_addr(struct sockaddr *a, struct sockaddr *b);
+
+/*
+ * Start the resolver threads; positive answers are trusted for ttl seconds.
+ * getaddrinfo() doesn't report record TTLs, so this stands in for them
+ */
+void dns_init(int ttl){
+    sigset_t all, prev;
+    pthread_t tid;
+    int i;
+
+    ttl_usec = (ttl > 0 ? ttl : DNS_DEFAULT_TTL) * 1000000LL;
+    /* resolvers never handle signals : keep SIGUSR1 for the accept loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &prev);
+    for(i = 0; i < DNS_RESOLVERS; i++){
+        Pthread_create(&tid, NULL, resolver, NULL);
+        Pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * Addresses of host with port filled in, happy-eyeballs ordered, into
+ * *res(free with dns_free()). A fresh entry answers at once; one past its
+ * TTL still answers while a resolver refreshes it. Otherwise a resolver is
+ * asked and the caller either waits up to DNS_WAIT seconds(w == NULL) or
+ * gets DNS_PENDING and w is posted to its box when the answer is in
+ */
+int dns_lookup(char *host, int port, struct addrinfo **res, dnswait *w){
+    struct timespec until;
+    long long now = now_usec();
+    int rc;
+
+    *res = NULL;
+    pthread_mutex_lock(&lock);
+    dnsentry *e = lookup(host, 1);
+    int count = !(w && w -> parked);    // a woken waiter was already counted as a miss
+    if(w) w -> parked = 0;
+    if((rc = answer(e, port, res, now, count)) != DNS_PENDING){
+        pthread_mutex_unlock(&lock);
+        return rc;
+    }
+    misses++;
+    enqueue(e);
+    if(w){
+        w -> parked = 1;
+        w -> next = e -> waiters;
+        e -> waiters = w;
+        pthread_mutex_unlock(&lock);
+        return DNS_PENDING;
+    }
+
+    unsigned long gen = e -> gen;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += DNS_WAIT;
+    while(e -> gen == gen)
+        if(pthread_cond_timedwait(&done, &lock, &until) == ETIMEDOUT) break;
+    if(e -> gen == gen){
+        timeouts++;
+        rc = DNS_FAILED;
+    }
+    else rc = answer(e, port, res, now_usec(), 0);
+    pthread_mutex_unlock(&lock);
+    return rc == DNS_PENDING ? DNS_FAILED : rc;
+}
+
+void dns_free(struct addrinfo *res){
+    free(res);      // one block, see answer()
+}
+
+/* A connect to sa failed : sort that address of host last for a while */
+void dns_failed(char *host, struct sockaddr *sa){
+    int i;
+    pthread_mutex_lock(&lock);
+    dnsentry *e = lookup(host, 0);
+    for(i = 0; e && i < e -> naddrs; i++)
+        if(same_addr((struct sockaddr*)&e -> addrs[i].sa, sa)) e -> addrs[i].failed = time(NULL);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Connect to host:port, racing its addresses happy-eyeballs style : the
+ * next one is tried DNS_ATTEMPT_DELAY msec after the last unless that
+ * already failed, and the first to connect wins. Returns -1 on failure
+ */
+int dns_connect(char *host, int port){
+    struct addrinfo *list, *p, *tried[DNS_MAX_ADDRS];
+    struct pollfd pfd[DNS_MAX_ADDRS];
+    long long next = 0;
+    int i, n = 0, pending = 0, fd = -1;
+
+    long long start = stats_now();
+    if(dns_lookup(host, port, &list, NULL) != DNS_OK) return -1;
+    start = stats_time(PH_DNS, start);
+    for(p = list; fd < 0 && (p || pending);){
+        if(p && (pending == 0 || now_usec() >= next)){
+            int s = socket(p -> ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if(s >= 0 && connect(s, p -> ai_addr, p -> ai_addrlen) == 0) fd = s;
+            else if(s >= 0 && errno == EINPROGRESS){
+                pfd[n].fd = s;
+                pfd[n].events = POLLOUT;
+                tried[n++] = p;
+                pending++;
+            }
+            else{
+                if(s >= 0) close(s);
+                dns_failed(host, p -> ai_addr);
+            }
+            p = p -> ai_next;
+            next = now_usec() + DNS_ATTEMPT_DELAY * 1000LL;
+            continue;
+        }
+
+        int timeout = p ? (int)((next - now_usec()) / 1000) : -1;
+        if(poll(pfd, n, timeout < 0 && p ? 0 : timeout) < 0 && errno != EINTR) break;
+        for(i = 0; i < n && fd < 0; i++){
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if(pfd[i].fd < 0 || pfd[i].revents == 0) continue;
+            if(getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0){
+                fd = pfd[i].fd;
+                pfd[i].fd = -1;
+                continue;
+            }
+            dns_failed(host, tried[i] -> ai_addr);
+            close(pfd[i].fd);
+            pfd[i].fd = -1;     // poll() skips negative fds
+            pending--;
+        }
+    }
+    for(i = 0; i < n; i++) if(pfd[i].fd >= 0) close(pfd[i].fd);    // losers of the race
+    dns_free(list);
+    if(fd >= 0){
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        stats_time(PH_CONNECT, start);
+    }
+    return fd;
+}
+
+void dns_report(FILE *fp){
+    pthread_mutex_lock(&lock);
+    fprintf(fp, "dns: %d hosts, %lu hits, %lu stale hits, %lu negative hits, %lu misses, %lu timeouts, "
+        "%lu resolved, %lu failed\n", nentries, hits, stale, negative, misses, timeouts, resolved, failures);
+    pthread_mutex_unlock(&lock);
+}
+
+void dnsbox_init(dnsbox *b){
+    if((b -> fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) unix_error("eventfd error");
+    b -> head = NULL;
+}
+
+/* Every waiter posted to b since the last call; clears its eventfd */
+dnswait *dnsbox_take(dnsbox *b){
+    uint64_t count;
+    if(read(b -> fd, &count, sizeof(count)) < 0 && errno != EAGAIN) unix_error("eventfd read error");
+    return __atomic_exchange_n(&b -> head, NULL, __ATOMIC_ACQUIRE);
+}
+
+/* Resolver thread : take queued hosts, resolve them, store the answers and wake whoever waits */
+static void *resolver(void *vargp){
+    struct addrinfo hints, *list, *p;
+    dnswait *w, *next;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    while(1){
+        pthread_mutex_lock(&lock);
+        while(qhead == NULL) pthread_cond_wait(&work, &lock);
+        dnsentry *e = qhead;
+        if((qhead = e -> qnext) == NULL) qtail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        int rc = getaddrinfo(e -> host, NULL, &hints, &list);   // e stays put while resolving
+
+        pthread_mutex_lock(&lock);
+        long long now = now_usec();
+        if(rc == 0){
+            e -> naddrs = 0;
+            for(p = list; p && e -> naddrs < DNS_MAX_ADDRS; p = p -> ai_next){
+                dnsaddr *a = &e -> addrs[e -> naddrs];
+                if(p -> ai_addrlen > sizeof(a -> sa)) continue;
+                memcpy(&a -> sa, p -> ai_addr, p -> ai_addrlen);
+                a -> len = p -> ai_addrlen;
+                a -> family = p -> ai_family;
+                a -> failed = 0;
+                e -> naddrs++;
+            }
+            freeaddrinfo(list);
+            e -> error = e -> naddrs ? 0 : EAI_NONAME;
+            e -> expires = now + (e -> naddrs ? ttl_usec : DNS_NEGATIVE_TTL * 1000000LL);
+            resolved++;
+        }
+        else{
+            /* a resolver hiccup doesn't erase what we knew : keep serving it, retry soon */
+            if(e -> naddrs == 0 || rc == EAI_NONAME) e -> error = rc;
+            e -> expires = now + DNS_NEGATIVE_TTL * 1000000LL;
+            failures++;
+        }
+        e -> resolved = 1;
+        e -> resolving = 0;
+        e -> gen++;
+        w = e -> waiters;
+        e -> waiters = NULL;
+        pthread_cond_broadcast(&done);
+        pthread_mutex_unlock(&lock);
+
+        for(; w; w = next){
+            uint64_t one = 1;
+            dnsbox *box = w -> box;     // w may be gone as soon as it is pushed
+            next = w -> next;
+            w -> next = __atomic_load_n(&box -> head, __ATOMIC_RELAXED);
+            while(!__atomic_compare_exchange_n(&box -> head, &w -> next, w, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+            if(write(box -> fd, &one, sizeof(one)) < 0 && errno != EAGAIN) unix_error("eventfd write error");
+        }
+    }
+    return NULL;
+}
+
+/* Find(or create) the entry of host; caller holds lock */
+static dnsentry *lookup(char *host, int create){
+    unsigned int h = hash_key(0, host, "");
+    dnsentry *e;
+    for(e = table[h & (DNS_BUCKETS - 1)]; e; e = e -> next)
+        if(e -> hash == h && !strcmp(e -> host, host)) return e;
+    if(!create) return NULL;
+    if(nentries >= DNS_MAX_ENTRIES) prune(now_usec());
+    e = Calloc(1, sizeof(dnsentry));
+    e -> host = strdup(host);
+    e -> hash = h;
+    e -> next = table[h & (DNS_BUCKETS - 1)];
+    table[h & (DNS_BUCKETS - 1)] = e;
+    nentries++;
+    return e;
+}
+
+/* Hand e to the resolvers unless they already have it; caller holds lock */
+static void enqueue(dnsentry *e){
+    if(e -> resolving) return;
+    e -> resolving = 1;
+    e -> qnext = NULL;
+    if(qtail) qtail -> qnext = e;
+    else qhead = e;
+    qtail = e;
+    pthread_cond_signal(&work);
+}
+
+/*
+ * Answer from e if it can : DNS_OK with the list built, DNS_FAILED for a
+ * remembered failure, DNS_PENDING if a resolver must be asked first.
+ * count says whether this lookup goes into the hit counters. Caller holds lock
+ */
+static int answer(dnsentry *e, int port, struct addrinfo **res, long long now, int count){
+    int order[DNS_MAX_ADDRS];
+    int k, n = e -> naddrs;
+
+    if(!e -> resolved) return DNS_PENDING;
+    if(e -> error){
+        if(now >= e -> expires) return DNS_PENDING;
+        negative += count;
+        return DNS_FAILED;
+    }
+    if(now >= e -> expires + DNS_STALE * 1000000LL) return DNS_PENDING;
+    if(now >= e -> expires){
+        stale += count;
+        enqueue(e);     // refresh in the background
+    }
+    else hits += count;
+
+    happy_order(e, order);
+
+    /* one block : addrinfo nodes, then their sockaddrs */
+    struct addrinfo *ai = Calloc(n, sizeof(struct addrinfo) + sizeof(struct sockaddr_storage));
+    struct sockaddr_storage *sa = (struct sockaddr_storage*)(ai + n);
+    for(k = 0; k < n; k++){
+        dnsaddr *a = &e -> addrs[order[k]];
+        memcpy(&sa[k], &a -> sa, a -> len);
+        if(a -> family == AF_INET6) ((struct sockaddr_in6*)&sa[k]) -> sin6_port = htons(port);
+        else ((struct sockaddr_in*)&sa[k]) -> sin_port = htons(port);
+        ai[k].ai_family = a -> family;
+        ai[k].ai_socktype = SOCK_STREAM;
+        ai[k].ai_addrlen = a -> len;
+        ai[k].ai_addr = (struct sockaddr*)&sa[k];
+        ai[k].ai_next = k + 1 < n ? &ai[k + 1] : NULL;
+    }
+    *res = ai;
+    return DNS_OK;
+}
+
+/*
+ * Happy-eyeballs order(RFC 8305) : addresses that didn't fail to connect
+ * lately first, and within each group alternate families starting with
+ * the one the resolver put first
+ */
+static void happy_order(dnsentry *e, int *order){
+    int fam[2][DNS_MAX_ADDRS], nfam[2];
+    int bad, i, k = 0;
+    time_t now = time(NULL);
+
+    for(bad = 0; bad < 2; bad++){
+        int first = -1;
+        nfam[0] = nfam[1] = 0;
+        for(i = 0; i < e -> naddrs; i++){
+            dnsaddr *a = &e -> addrs[i];
+            if((a -> failed && now - a -> failed < DNS_FAIL_PENALTY) != bad) continue;
+            if(first < 0) first = a -> family;
+            int f = a -> family != first;
+            fam[f][nfam[f]++] = i;
+        }
+        for(i = 0; i < nfam[0] || i < nfam[1]; i++){
+            if(i < nfam[0]) order[k++] = fam[0][i];
+            if(i < nfam[1]) order[k++] = fam[1][i];
+        }
+    }
+}
+
+/* Forget hosts nobody asked about since well past their TTL; caller holds lock */
+static void prune(long long now){
+    dnsentry **pp, *e;
+    int i;
+    for(i = 0; i < DNS_BUCKETS; i++){
+        for(pp = &table[i]; (e = *pp);){
+            if(e -> resolving || e -> waiters || now < e -> expires + DNS_STALE * 1000000LL){
+                pp = &e -> next;
+                continue;
+            }
+            *pp = e -> next;
+            free(e -> host);
+            free(e);
+            nentries--;
+        }
+    }
+}
+
+/* Same host address, whatever the port */
+static int same_addr(struct sockaddr *a, struct sockaddr *b){
+    if(a -> sa_family != b -> sa_family) return 0;
+    if(a -> sa_family == AF_INET)
+        return ((struct sockaddr_in*)a) -> sin_addr.s_addr == ((struct sockaddr_in*)b) -> sin_addr.s_addr;
+    if(a -> sa_family == AF_INET6)
+        return !memcmp(&((struct sockaddr_in6*)a) -> sin6_addr, &((struct sockaddr_in6*)b) -> sin6_addr,
+            sizeof(struct in6_addr));
+    return 0;
+}
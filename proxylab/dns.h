@@ -0,0 +1,73 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <stdio.h>
+#include "csapp.h"
+
+#define DNS_BUCKETS 256
+#define DNS_MAX_ENTRIES 4096        // hosts remembered before expired ones are pruned
+#define DNS_MAX_ADDRS 8             // addresses kept per host
+#define DNS_DEFAULT_TTL 60          // seconds a resolution is trusted when --dns-ttl isn't given
+#define DNS_NEGATIVE_TTL 5          // seconds a failed lookup is remembered
+#define DNS_STALE 300               // seconds past its TTL an entry is still served while it refreshes
+#define DNS_RESOLVERS 2             // resolver threads
+#define DNS_WAIT 5                  // seconds a blocking caller waits for a first resolution
+#define DNS_FAIL_PENALTY 30         // seconds an address that failed to connect sorts last
+#define DNS_ATTEMPT_DELAY 250       // msec before racing the next address(RFC 8305)
+
+/* dns_lookup() results */
+#define DNS_OK 0
+#define DNS_PENDING 1               // the waiter will be told; look up again then
+#define DNS_FAILED (-1)
+
+/* One address of a host; ports are filled in per lookup */
+typedef struct dnsaddr{
+    struct sockaddr_storage sa;
+    socklen_t len;
+    int family;
+    time_t failed;          // last failed connect, 0 if none
+} dnsaddr;
+
+/*
+ * An event loop's inbox for finished lookups : resolver threads push
+ * waiters onto it and poke fd, which the loop watches
+ */
+typedef struct dnsbox{
+    int fd;                 // eventfd
+    struct dnswait *head;
+} dnsbox;
+
+/* A non-blocking caller waiting for a host to resolve */
+typedef struct dnswait{
+    dnsbox *box;
+    void *arg;
+    int parked;             // queued on an entry, not yet looked up again
+    struct dnswait *next;
+} dnswait;
+
+typedef struct dnsentry{
+    char *host;
+    unsigned int hash;
+    int naddrs;
+    dnsaddr addrs[DNS_MAX_ADDRS];
+    int error;              // getaddrinfo error of a negative entry, 0 if positive
+    long long expires;      // usec, monotonic
+    int resolved;           // has completed at least once
+    int resolving;          // queued for or held by a resolver thread
+    unsigned long gen;      // completions so far
+    dnswait *waiters;
+    struct dnsentry *next;  // hash chain
+    struct dnsentry *qnext; // resolver queue
+} dnsentry;
+
+void dns_init(int ttl);
+int dns_lookup(char *host, int port, struct addrinfo **res, dnswait *w);
+void dns_free(struct addrinfo *res);
+void dns_failed(char *host, struct sockaddr *sa);
+int dns_connect(char *host, int port);
+void dns_report(FILE *fp);
+
+void dnsbox_init(dnsbox *b);
+dnswait *dnsbox_take(dnsbox *b);
+
+#endif
@@ -0,0 +1,96 @@
+#include "csapp.h"
+#include "epoch.h"
+
+static unsigned long global = 2;        // even, so state's low bit is free
+static ethread *threads;                // pushed with CAS, never removed
+static __thread ethread *self;
+static retired *limbo;                  // newest first, so epochs never increase along it
+static unsigned long pending;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void run(retired *r);
+
+/*
+ * Start a read-side critical section : nothing retired from now on is
+ * freed before the matching epoch_exit(). Not reentrant
+ */
+void epoch_enter(void){
+    if(self == NULL){
+        self = Calloc(1, sizeof(ethread));
+        self -> next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&threads, &self -> next, self, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    __atomic_store_n(&self -> state, __atomic_load_n(&global, __ATOMIC_RELAXED) << 1 | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);    // announce before any pointer is read
+}
+
+void epoch_exit(void){
+    __atomic_store_n(&self -> state, 0, __ATOMIC_RELEASE);
+}
+
+/* Have fn(a, b) called once no reader can still reach what it frees */
+void epoch_retire(void (*fn)(void *a, void *b), void *a, void *b){
+    retired *r = Malloc(sizeof(retired));
+    r -> fn = fn;
+    r -> a = a;
+    r -> b = b;
+    pthread_mutex_lock(&lock);
+    r -> epoch = __atomic_load_n(&global, __ATOMIC_SEQ_CST);
+    r -> next = limbo;
+    limbo = r;
+    pthread_mutex_unlock(&lock);
+    __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Advance the epoch if every reader inside has seen the current one, then
+ * free what was retired two epochs ago. Cheap to call often; skips if
+ * another thread is at it
+ */
+void epoch_reclaim(void){
+    retired *r, **pp;
+    ethread *t;
+
+    if(pthread_mutex_trylock(&lock)) return;
+    unsigned long g = __atomic_load_n(&global, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t; t = t -> next){
+        unsigned long st = __atomic_load_n(&t -> state, __ATOMIC_ACQUIRE);
+        if((st & 1) && (st >> 1) != g) break;   // still inside an older epoch
+    }
+    if(t == NULL) __atomic_store_n(&global, ++g, __ATOMIC_SEQ_CST);
+
+    for(pp = &limbo; *pp && (*pp) -> epoch + 2 > g; pp = &(*pp) -> next)
+        ;
+    r = *pp;
+    *pp = NULL;
+    pthread_mutex_unlock(&lock);
+    run(r);
+}
+
+/* Free everything retired at once; only when no reader can be inside */
+void epoch_flush(void){
+    pthread_mutex_lock(&lock);
+    retired *r = limbo;
+    limbo = NULL;
+    pthread_mutex_unlock(&lock);
+    run(r);
+}
+
+/* Entries waiting in limbo */
+unsigned long epoch_pending(void){
+    return __atomic_load_n(&pending, __ATOMIC_RELAXED);
+}
+
+static void run(retired *r){
+    unsigned long n = 0;
+    while(r){
+        retired *next = r -> next;
+        r -> fn(r -> a, r -> b);
+        free(r);
+        r = next;
+        n++;
+    }
+    if(n) __atomic_sub_fetch(&pending, n, __ATOMIC_RELAXED);
+}
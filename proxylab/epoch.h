@@ -0,0 +1,33 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+/*
+ * Epoch-based reclamation. Readers bracket lock-free accesses with
+ * epoch_enter()/epoch_exit(); writers epoch_retire() what they unlinked,
+ * and it is freed once every reader that could still see it has left
+ * (two epoch advances later)
+ */
+
+/* One per thread that has ever entered, linked for good */
+typedef struct ethread{
+    unsigned long state;        // epoch << 1 | inside
+    struct ethread *next;
+} ethread;
+
+/* Something unlinked, waiting out the readers */
+typedef struct retired{
+    void (*fn)(void *a, void *b);
+    void *a;
+    void *b;
+    unsigned long epoch;        // global epoch when retired
+    struct retired *next;
+} retired;
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void (*fn)(void *a, void *b), void *a, void *b);
+void epoch_reclaim(void);
+void epoch_flush(void);
+unsigned long epoch_pending(void);
+
+#endif
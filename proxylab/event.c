@@ -0,0 +1,421 @@
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "event.h"
+#include "dns.h"
+#include "range.h"
+#include "stats.h"
+#include <sys/epoll.h>
+
+/* glibc only declares accept4 under _GNU_SOURCE, which clashes with csapp.h's gai_error */
+extern int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+
+#define MAX_EVENTS 256
+#define REQ_INIT_SIZE 1024
+
+/* Connection states, in the order a request walks through them */
+enum { C_READ_REQ, C_WRITE_HIT, C_RESOLVE, C_CONNECT, C_SEND_REQ, C_RELAY };
+
+typedef struct conn conn;
+
+/* One registered descriptor; epoll hands a pointer to it back on readiness */
+typedef struct handle{
+    conn *c;                // NULL for the listening socket and the dns box
+    int fd;
+    unsigned int events;    // currently registered interest, 0 if not registered
+} handle;
+
+/* A client connection and the origin connection serving its miss */
+struct conn{
+    int state;
+    handle client;
+    handle origin;
+    char *req;              // client request head(s), grows up to MAX_HEADER_SIZE
+    size_t reqlen, reqcap;
+    size_t headlen;         // length of the first complete head in req
+    httpreq hp;             // that head, parsed in place as it arrives
+    request rq;             // parsed request, with the origin request in rq.out
+    size_t outoff;
+    pbuf *hit;              // pinned cache payload being written to the client
+    size_t hitoff;
+    char *buf;              // origin bytes not yet written to the client
+    size_t buflen, bufoff;
+    capture cap;            // response copy for the cache
+    dnswait dw;             // posted to the loop's box once the origin resolves
+    struct addrinfo *addrs; // origin addresses(dns_free)
+    struct addrinfo *addr;  // the address being connected to
+    long long start;        // stats_now() the request was asked for, 0 once its first byte is out
+};
+
+typedef struct loop{
+    int epfd;
+    int listenfd;
+    handle listen;
+    dnsbox box;             // finished lookups of this loop's connections
+    handle dns;             // box's eventfd
+} loop;
+
+static void *loop_thread(void *vargp);
+static void loop_run(loop *lp);
+static void accept_all(loop *lp);
+static void resolved_all(loop *lp);
+static void conn_run(loop *lp, conn *c);
+static void conn_close(loop *lp, conn *c);
+static int read_request(loop *lp, conn *c);
+static int start_request(loop *lp, conn *c);
+static int next_request(loop *lp, conn *c);
+static int resolve(loop *lp, conn *c);
+static int start_connect(loop *lp, conn *c);
+static int finish_connect(loop *lp, conn *c);
+static void watch(loop *lp, handle *h, unsigned int events);
+static void count_sent(conn *c, ssize_t n);
+
+/* Serve listenfd from nloops epoll event-loop threads; never returns */
+void event_serve(int listenfd, int nloops){
+    int i, flags;
+    pthread_t tid;
+
+    if((flags = fcntl(listenfd, F_GETFL)) < 0 || fcntl(listenfd, F_SETFL, flags | O_NONBLOCK) < 0)
+        unix_error("fcntl error");
+    for(i = 0; i < nloops; i++){
+        loop *lp = Malloc(sizeof(loop));
+        if((lp -> epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) unix_error("epoll_create1 error");
+        lp -> listenfd = listenfd;
+        lp -> listen.c = NULL;
+        lp -> listen.fd = listenfd;
+
+        /* every loop watches the listener; EPOLLEXCLUSIVE wakes only one of them per connection */
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &lp -> listen;
+        if(epoll_ctl(lp -> epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) unix_error("epoll_ctl error");
+        lp -> listen.events = ev.events;
+        dnsbox_init(&lp -> box);
+        lp -> dns.c = NULL;
+        lp -> dns.fd = lp -> box.fd;
+        lp -> dns.events = 0;
+        watch(lp, &lp -> dns, EPOLLIN);
+
+        if(i == nloops - 1) loop_run(lp);   // the calling thread runs the last loop
+        Pthread_create(&tid, NULL, loop_thread, lp);
+        Pthread_detach(tid);
+    }
+}
+
+static void *loop_thread(void *vargp){
+    loop_run((loop*)vargp);
+    return NULL;
+}
+
+/*
+ * Wait for readiness and step the owning connection's state machine. A
+ * connection only ever has one of its two handles registered, so a batch
+ * holds at most one event per connection and closing it can't leave a
+ * dangling pointer later in the same batch
+ */
+static void loop_run(loop *lp){
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+    while(1){
+        if((n = epoll_wait(lp -> epfd, events, MAX_EVENTS, -1)) < 0){
+            if(errno != EINTR) unix_error("epoll_wait error");
+            continue;
+        }
+        for(i = 0; i < n; i++){
+            handle *h = events[i].data.ptr;
+            if(h == &lp -> dns) resolved_all(lp);
+            else if(h -> c == NULL) accept_all(lp);
+            else conn_run(lp, h -> c);
+        }
+    }
+}
+
+/* Accept every pending connection into this loop */
+static void accept_all(loop *lp){
+    int fd;
+    while((fd = accept4(lp -> listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+        conn *c = Calloc(1, sizeof(conn));
+        set_nodelay(fd);
+        c -> state = C_READ_REQ;
+        c -> client.c = c;
+        c -> client.fd = fd;
+        c -> origin.c = c;
+        c -> origin.fd = -1;
+        c -> start = stats_now();
+        c -> dw.box = &lp -> box;
+        c -> dw.arg = c;
+        http_init(&c -> hp);
+        watch(lp, &c -> client, EPOLLIN);
+    }
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) unix_error("Accept error");
+}
+
+/*
+ * Resume the connections whose origin finished resolving. They had no
+ * handle registered while waiting, so no event in this batch points at them
+ */
+static void resolved_all(loop *lp){
+    dnswait *w, *next;
+    for(w = dnsbox_take(&lp -> box); w; w = next){
+        next = w -> next;
+        conn_run(lp, w -> arg);
+    }
+}
+
+/*
+ * Advance c as far as it can go without blocking. Each step returns 1 to
+ * keep going, 0 once it registered the readiness it is waiting for, and
+ * -1 when the connection is finished or broken
+ */
+static void conn_run(loop *lp, conn *c){
+    ssize_t n;
+    int rc = 1;
+    while(rc > 0){
+        switch(c -> state){
+        case C_READ_REQ:
+            if((rc = read_request(lp, c)) > 0) rc = start_request(lp, c);
+            break;
+
+        case C_WRITE_HIT:
+            n = write(c -> client.fd, c -> hit -> data + c -> hitoff, c -> hit -> size - c -> hitoff);
+            if(n < 0 && (errno == EAGAIN || errno == EINTR)){
+                watch(lp, &c -> client, EPOLLOUT);
+                rc = 0;
+            }
+            else if(n < 0) rc = -1;
+            else{
+                count_sent(c, n);
+                if((c -> hitoff += n) == c -> hit -> size) rc = next_request(lp, c);  // done
+            }
+            break;
+
+        case C_RESOLVE:
+            rc = resolve(lp, c);
+            break;
+
+        case C_CONNECT:
+            rc = finish_connect(lp, c);
+            break;
+
+        case C_SEND_REQ:
+            n = write(c -> origin.fd, c -> rq.out + c -> outoff, c -> rq.outlen - c -> outoff);
+            if(n < 0 && (errno == EAGAIN || errno == EINTR)){
+                watch(lp, &c -> origin, EPOLLOUT);
+                rc = 0;
+            }
+            else if(n < 0) rc = -1;
+            else if((c -> outoff += n) == c -> rq.outlen){
+                c -> rq.mark = stats_now();
+                c -> buf = Malloc(MAXBUF);
+                c -> state = C_RELAY;
+            }
+            break;
+
+        case C_RELAY:
+            /* flush what we have to the client before reading more from the origin */
+            if(c -> bufoff < c -> buflen){
+                n = write(c -> client.fd, c -> buf + c -> bufoff, c -> buflen - c -> bufoff);
+                if(n < 0 && (errno == EAGAIN || errno == EINTR)){
+                    watch(lp, &c -> origin, 0);
+                    watch(lp, &c -> client, EPOLLOUT);
+                    rc = 0;
+                }
+                else if(n < 0) rc = -1;
+                else{
+                    count_sent(c, n);
+                    c -> bufoff += n;
+                }
+                break;
+            }
+            n = read(c -> origin.fd, c -> buf, MAXBUF);
+            if(n < 0 && (errno == EAGAIN || errno == EINTR)){
+                watch(lp, &c -> client, 0);
+                watch(lp, &c -> origin, EPOLLIN);
+                rc = 0;
+            }
+            else if(n < 0) rc = -1;
+            else if(n == 0){
+                stats_time(PH_BODY, c -> rq.mark);
+                /* Save the payload in cache */
+                if(!c -> cap.dropped) cache_store(&c -> rq, c -> cap.data, c -> cap.len);
+                count_miss(caches, c -> rq.port, c -> rq.server, c -> rq.filename, c -> cap.total);
+                rc = -1;
+            }
+            else{
+                if(c -> cap.total == 0) c -> rq.mark = stats_time(PH_TTFB, c -> rq.mark);
+                stats_add(ST_BYTES_IN, n);
+                capture_append(&c -> cap, c -> buf, n);
+                c -> buflen = n;
+                c -> bufoff = 0;
+            }
+            break;
+        }
+    }
+    if(rc < 0) conn_close(lp, c);
+}
+
+/* Release everything a connection holds; closing the fds also drops them from epoll */
+static void conn_close(loop *lp, conn *c){
+    Close(c -> client.fd);
+    if(c -> origin.fd >= 0) Close(c -> origin.fd);
+    if(c -> hit) pbuf_unpin(c -> hit);
+    if(c -> addrs) dns_free(c -> addrs);
+    free(c -> req);
+    free(c -> buf);
+    free_request(&c -> rq);
+    capture_free(&c -> cap);
+    free(c);
+}
+
+/* Read and parse until the blank line ending the request head; a pipelined one may already be buffered */
+static int read_request(loop *lp, conn *c){
+    int rc;
+    while(1){
+        if(c -> reqlen && (rc = http_parse(&c -> hp, c -> req, c -> reqlen, MAX_HEADER_SIZE)) != HTTP_AGAIN){
+            if(rc < 0) return -1;   // malformed or too large
+            c -> headlen = rc;
+            return 1;
+        }
+        if(c -> reqlen + 1 >= c -> reqcap){
+            if(c -> reqcap >= MAX_HEADER_SIZE) return -1;   // request head too large
+            c -> reqcap = c -> reqcap ? c -> reqcap * 2 : REQ_INIT_SIZE;
+            c -> req = Realloc(c -> req, c -> reqcap);
+        }
+        ssize_t n = read(c -> client.fd, c -> req + c -> reqlen, c -> reqcap - c -> reqlen - 1);
+        if(n < 0 && (errno == EAGAIN || errno == EINTR)){
+            watch(lp, &c -> client, EPOLLIN);
+            return 0;
+        }
+        if(n <= 0) return -1;
+
+        c -> reqlen += n;
+        c -> req[c -> reqlen] = '\0';
+    }
+}
+
+/* Parse the request head, then answer from the cache or start the origin fetch */
+static int start_request(loop *lp, conn *c){
+    if(parse_request(&c -> hp, c -> req, &c -> rq, 0) < 0) return -1;
+    if(c -> start == 0) c -> start = stats_now();   // a kept-alive connection's next request
+
+    /* The proxy's own stats, sent like a hit */
+    if(c -> rq.stats){
+        c -> hit = stats_page(c -> rq.stats);
+        c -> state = C_WRITE_HIT;
+        return 1;
+    }
+    stats_add(ST_REQUESTS, 1);
+
+    /* Check if the finding payload exist in cache, or pieces of it holding the range asked for */
+    long long start = stats_now();
+    c -> hit = cache_lookup(&c -> rq, 0);
+    if(c -> rq.range && (c -> hit || (c -> hit = range_lookup(&c -> rq))))
+        c -> hit = range_apply(&c -> rq, c -> hit);
+    c -> rq.mark = stats_time(PH_LOOKUP, start);
+    if(c -> hit){
+        stats_add(ST_HITS, 1);
+        c -> state = C_WRITE_HIT;
+        return 1;
+    }
+
+    stats_add(ST_MISSES, 1);
+    c -> rq.started = now_usec();
+    c -> state = C_RESOLVE;
+    watch(lp, &c -> client, 0);
+    return resolve(lp, c);
+}
+
+/*
+ * A hit was fully written : keep the connection for the client's next
+ * request if it asked to, starting with any bytes it already pipelined
+ */
+static int next_request(loop *lp, conn *c){
+    if(!c -> rq.keepalive) return -1;
+    pbuf_unpin(c -> hit);
+    c -> hit = NULL;
+    c -> hitoff = 0;
+    free_request(&c -> rq);
+    memmove(c -> req, c -> req + c -> headlen, c -> reqlen - c -> headlen + 1);
+    c -> reqlen -= c -> headlen;
+    c -> headlen = 0;
+    http_init(&c -> hp);
+    c -> state = C_READ_REQ;
+    return 1;
+}
+
+/* Look the origin up, parking c on the loop's dns box if a resolver has to be asked */
+static int resolve(loop *lp, conn *c){
+    int rc = dns_lookup(c -> rq.server, c -> rq.port, &c -> addrs, &c -> dw);
+    if(rc == DNS_PENDING) return 0;
+    if(rc != DNS_OK){
+        fprintf(stderr, "could not resolve %s\n", c -> rq.server);
+        return -1;
+    }
+    c -> rq.mark = stats_time(PH_DNS, c -> rq.mark);
+    c -> addr = c -> addrs;
+    c -> state = C_CONNECT;
+    return start_connect(lp, c);
+}
+
+/* Start a non-blocking connect to the next untried origin address */
+static int start_connect(loop *lp, conn *c){
+    for(; c -> addr; c -> addr = c -> addr -> ai_next){
+        struct addrinfo *p = c -> addr;
+        int fd = socket(p -> ai_family, p -> ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p -> ai_protocol);
+        if(fd < 0) continue;
+        c -> origin.fd = fd;
+        c -> origin.events = 0;
+        if(connect(fd, p -> ai_addr, p -> ai_addrlen) == 0){
+            stats_time(PH_CONNECT, c -> rq.mark);
+            c -> state = C_SEND_REQ;
+            return 1;
+        }
+        if(errno == EINPROGRESS){
+            watch(lp, &c -> origin, EPOLLOUT);
+            return 0;
+        }
+        dns_failed(c -> rq.server, p -> ai_addr);
+        Close(fd);
+        c -> origin.fd = -1;
+    }
+    fprintf(stderr, "connect failed (%s:%d)\n", c -> rq.server, c -> rq.port);
+    return -1;
+}
+
+/* The origin socket became writable : see whether the connect worked */
+static int finish_connect(loop *lp, conn *c){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(c -> origin.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    if(err == EINPROGRESS || err == EALREADY) return 0;
+    if(err == 0){
+        stats_time(PH_CONNECT, c -> rq.mark);
+        c -> state = C_SEND_REQ;
+        return 1;
+    }
+    dns_failed(c -> rq.server, c -> addr -> ai_addr);
+    Close(c -> origin.fd);
+    c -> origin.fd = -1;
+    c -> addr = c -> addr -> ai_next;
+    return start_connect(lp, c);
+}
+
+/* Change the readiness c waits for on h, skipping the syscall if nothing changed */
+static void watch(loop *lp, handle *h, unsigned int events){
+    if(h -> events == events) return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = h;
+    int op = (h -> events == 0) ? EPOLL_CTL_ADD : (events == 0) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if(epoll_ctl(lp -> epfd, op, h -> fd, &ev) < 0) unix_error("epoll_ctl error");
+    h -> events = events;
+}
+
+/* Account n bytes written to c's client, the first of a response ending its first-byte time */
+static void count_sent(conn *c, ssize_t n){
+    stats_add(ST_BYTES_OUT, n);
+    if(c -> start){
+        stats_time(PH_FIRST_BYTE, c -> start);
+        c -> start = 0;
+    }
+}
@@ -0,0 +1,7 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+/* Serve listenfd from nloops epoll event-loop threads; never returns */
+void event_serve(int listenfd, int nloops);
+
+#endif
@@ -0,0 +1,251 @@
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "flight.h"
+
+static flight *table[FLIGHT_BUCKETS];   // fetches still open to followers
+static sem_t mutex;
+static unsigned long led, followed, refetched, alone, lagged;
+
+static flight *flight_new(int port, char *host, char *filename, unsigned int hash);
+
+void flight_init(){
+    Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * Attach to the fetch of (port, host, filename) already in flight, or
+ * start one. *leader tells the caller it must fetch from the origin and
+ * flight_finish() the flight; either way it flight_release()s it
+ */
+flight *flight_join(int port, char *host, char *filename, int *leader){
+    unsigned int hash = hash_key(port, host, filename);
+    flight **bucket = &table[hash & (FLIGHT_BUCKETS - 1)];
+    flight *f;
+
+    P(&mutex);
+    for(f = *bucket; f; f = f -> next){
+        if(f -> hash != hash || f -> port != port
+            || strcmp(f -> host, host) || strcmp(f -> filename, filename)) continue;
+        pthread_mutex_lock(&f -> lock);
+        int open = !f -> cap.dropped && f -> base == 0;     // bytes already discarded can't be replayed
+        if(open){
+            f -> followers++;
+            f -> refs++;
+        }
+        pthread_mutex_unlock(&f -> lock);
+        if(open){
+            followed++;
+            V(&mutex);
+            *leader = 0;
+            return f;
+        }
+    }
+
+    f = flight_new(port, host, filename, hash);
+    f -> next = *bucket;
+    *bucket = f;
+    led++;
+    V(&mutex);
+    *leader = 1;
+    return f;
+}
+
+/*
+ * A flight nobody can join, for a request whose own headers(validators,
+ * credentials) may change the response : the caller leads it, alone
+ */
+flight *flight_alone(int port, char *host, char *filename){
+    P(&mutex);
+    alone++;
+    V(&mutex);
+    return flight_new(port, host, filename, hash_key(port, host, filename));
+}
+
+static flight *flight_new(int port, char *host, char *filename, unsigned int hash){
+    flight *f = Calloc(1, sizeof(flight));
+    f -> port = port;
+    f -> hash = hash;
+    f -> host = strdup(host);
+    f -> filename = strdup(filename);
+    pthread_mutex_init(&f -> lock, NULL);
+    pthread_cond_init(&f -> grown, NULL);
+    pthread_cond_init(&f -> room, NULL);
+    f -> state = FL_FETCHING;
+    f -> refs = 1;
+    return f;
+}
+
+/*
+ * With f locked : discard all but the last FLIGHT_WINDOW bytes of cap,
+ * once the followers reading them are done or FLIGHT_WAIT has passed
+ */
+static void slide(flight *f){
+    size_t cut = f -> cap.len - FLIGHT_WINDOW;
+    struct timespec until;
+    reader *r;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += FLIGHT_WAIT;
+    for(r = f -> readers; r; ){
+        if(r -> cut || r -> off >= f -> base + cut) r = r -> next;
+        else if(pthread_cond_timedwait(&f -> room, &f -> lock, &until) == 0) r = f -> readers;  // the list may have changed
+        else{
+            for(r = f -> readers; r; r = r -> next) r -> cut |= r -> off < f -> base + cut;
+            break;
+        }
+    }
+    memmove(f -> cap.data, f -> cap.data + cut, FLIGHT_WINDOW);
+    f -> cap.len = FLIGHT_WINDOW;
+    f -> base += cut;
+}
+
+/*
+ * Leader : add response bytes and wake the followers. With nobody
+ * following, a response past MAX_OBJECT_SIZE is dropped like any capture;
+ * otherwise it slides, keeping the last FLIGHT_WINDOW bytes once it holds
+ * twice that(one copy per byte, amortized)
+ */
+void flight_append(flight *f, char *data, size_t n){
+    pthread_mutex_lock(&f -> lock);
+    f -> cap.total += n;
+    if(!f -> cap.dropped && f -> followers == 0 && f -> cap.len + n > MAX_OBJECT_SIZE){
+        capture_free(&f -> cap);
+        f -> cap.dropped = 1;
+    }
+    if(!f -> cap.dropped && f -> cap.len > FLIGHT_WINDOW && f -> cap.len + n > 2 * FLIGHT_WINDOW) slide(f);
+    if(!f -> cap.dropped) capture_grow(&f -> cap, data, n);
+    if(f -> followers) pthread_cond_broadcast(&f -> grown);
+    pthread_mutex_unlock(&f -> lock);
+}
+
+/* Leader : the response won't be cached, stop keeping it unless someone needs the bytes */
+void flight_drop(flight *f){
+    pthread_mutex_lock(&f -> lock);
+    if(f -> followers == 0){
+        capture_free(&f -> cap);
+        f -> cap.dropped = 1;
+    }
+    pthread_mutex_unlock(&f -> lock);
+}
+
+/* Leader : whether anyone still reads this flight */
+int flight_shared(flight *f){
+    pthread_mutex_lock(&f -> lock);
+    int shared = f -> followers > 0;
+    pthread_mutex_unlock(&f -> lock);
+    return shared;
+}
+
+/*
+ * Leader : close the flight to newcomers and tell the followers how it
+ * ended. Insert into the cache before this so no miss falls in between
+ */
+void flight_finish(flight *f, int ok, int framed){
+    flight **pp = &table[f -> hash & (FLIGHT_BUCKETS - 1)];
+
+    P(&mutex);
+    while(*pp && *pp != f) pp = &(*pp) -> next;
+    if(*pp) *pp = f -> next;
+    V(&mutex);
+
+    pthread_mutex_lock(&f -> lock);
+    f -> state = ok ? FL_DONE : FL_FAILED;
+    f -> framed = framed;
+    pthread_cond_broadcast(&f -> grown);
+    pthread_mutex_unlock(&f -> lock);
+}
+
+/* With f locked : a follower stops reading */
+static void unfollow(flight *f, reader *me){
+    reader **pp = &f -> readers;
+    while(*pp != me) pp = &(*pp) -> next;
+    *pp = me -> next;
+    f -> followers--;
+    pthread_cond_signal(&f -> room);
+}
+
+/*
+ * Follower : write the leader's response to out as it arrives. Returns
+ * 1 once all of it was written, 0 if the leader failed before producing
+ * any byte(the caller may fetch on its own) or left it a window behind
+ * before it wrote any, -1 otherwise
+ */
+int flight_follow(flight *f, wbuf *out, int *framed){
+    char buf[MAXBUF];
+    size_t n;
+    reader me = {0};        // me.off : response offset
+    int state;
+
+    pthread_mutex_lock(&f -> lock);
+    me.next = f -> readers;
+    f -> readers = &me;
+    while(1){
+        while(me.off == f -> base + f -> cap.len && f -> state == FL_FETCHING)
+            pthread_cond_wait(&f -> grown, &f -> lock);
+        if(me.off < f -> base){     // the bytes it needs next were discarded
+            unfollow(f, &me);
+            pthread_mutex_unlock(&f -> lock);
+            P(&mutex);
+            lagged++;
+            V(&mutex);
+            return me.off > 0 ? -1 : 0;
+        }
+        n = f -> base + f -> cap.len - me.off;
+        if(n > MAXBUF) n = MAXBUF;
+        if(n) memcpy(buf, f -> cap.data + me.off - f -> base, n);   // copy out : the leader may realloc cap
+        state = f -> state;
+        *framed = f -> framed;
+        if(n == 0){
+            unfollow(f, &me);
+            pthread_mutex_unlock(&f -> lock);
+            break;
+        }
+        pthread_mutex_unlock(&f -> lock);
+
+        int rc = wbuf_add(out, buf, n) < 0 || wbuf_flush(out) < 0 ? -1 : 0;
+        pthread_mutex_lock(&f -> lock);
+        if(rc < 0){
+            unfollow(f, &me);
+            pthread_mutex_unlock(&f -> lock);
+            return -1;
+        }
+        me.off += n;
+        pthread_cond_signal(&f -> room);
+    }
+    if(state == FL_DONE) return 1;
+    if(me.off > 0) return -1;
+    P(&mutex);
+    refetched++;
+    V(&mutex);
+    return 0;
+}
+
+/* Follower : stop following without reading anything */
+void flight_leave(flight *f){
+    pthread_mutex_lock(&f -> lock);
+    f -> followers--;
+    pthread_mutex_unlock(&f -> lock);
+}
+
+/* Drop one reference; the last one frees the flight */
+void flight_release(flight *f){
+    pthread_mutex_lock(&f -> lock);
+    int last = --f -> refs == 0;
+    pthread_mutex_unlock(&f -> lock);
+    if(!last) return;
+    pthread_mutex_destroy(&f -> lock);
+    pthread_cond_destroy(&f -> grown);
+    pthread_cond_destroy(&f -> room);
+    capture_free(&f -> cap);
+    free(f -> host);
+    free(f -> filename);
+    free(f);
+}
+
+void flight_report(FILE *fp){
+    P(&mutex);
+    fprintf(fp, "flight: %lu origin fetches, %lu misses coalesced, %lu refetched after a failed leader, "
+        "%lu cut off a window behind, %lu unshared\n", led, followed, refetched, lagged, alone);
+    V(&mutex);
+}
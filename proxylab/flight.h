@@ -0,0 +1,63 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include "proxy.h"
+#include "wbuf.h"
+
+#define FLIGHT_BUCKETS 256
+#define FLIGHT_WINDOW (4 * MAX_OBJECT_SIZE)    // how far followers may trail the leader
+#define FLIGHT_WAIT 1       // seconds the leader waits for a follower a window behind
+
+/* flight states */
+#define FL_FETCHING 0
+#define FL_DONE 1       // whole response is in cap
+#define FL_FAILED 2     // origin fetch failed, cap may hold a prefix
+
+/* A follower's response offset, for the leader to see who trails */
+typedef struct reader{
+    size_t off;
+    int cut;            // the leader gave up waiting for it
+    struct reader *next;
+} reader;
+
+/*
+ * One origin fetch shared by every concurrent miss on the same object.
+ * The leader appends the response to cap as it writes it to its own
+ * client; followers copy it out from their own offset. Past
+ * MAX_OBJECT_SIZE only the last FLIGHT_WINDOW bytes or so are kept : the
+ * leader waits up to FLIGHT_WAIT for followers further behind, then cuts
+ * them off
+ */
+typedef struct flight{
+    int port;
+    unsigned int hash;
+    char *host;
+    char *filename;
+    pthread_mutex_t lock;
+    pthread_cond_t grown;   // signalled when cap grows or the fetch ends
+    pthread_cond_t room;    // signalled when a follower moves on
+    capture cap;            // dropped past MAX_OBJECT_SIZE unless someone follows
+    size_t base;            // response offset of cap.data[0] : bytes before it were discarded
+    int state;
+    int framed;             // response is length- or chunk-delimited
+    int followers;          // followers still reading
+    reader *readers;        // those of them that started
+    int refs;               // leader + followers
+    struct flight *next;
+} flight;
+
+void flight_init();
+flight *flight_join(int port, char *host, char *filename, int *leader);
+flight *flight_alone(int port, char *host, char *filename);
+void flight_append(flight *f, char *data, size_t n);
+void flight_drop(flight *f);
+int flight_shared(flight *f);
+void flight_finish(flight *f, int ok, int framed);
+int flight_follow(flight *f, wbuf *out, int *framed);
+void flight_leave(flight *f);
+void flight_release(flight *f);
+void flight_report(FILE *fp);
+
+#endif
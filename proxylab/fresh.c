@@ -0,0 +1,333 @@
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "http.h"
+#include "fresh.h"
+
+/* What a response head says about storing and reusing it */
+typedef struct cacheinfo{
+    int status;
+    time_t date;            // -1 if absent or invalid
+    time_t expires;         // -1 if invalid : already expired
+    time_t last_modified;
+    int has_expires;
+    long age;               // Age header, 0 if none
+    long max_age;           // Cache-Control arguments, -1 if absent
+    long s_maxage;
+    long swr;               // stale-while-revalidate
+    int no_store;           // no-store or private : a shared cache must not keep it
+    int no_cache;
+    int must_revalidate;    // must-revalidate, proxy-revalidate or s-maxage : never served stale
+    int shared;             // public or s-maxage : may answer requests with credentials too
+} cacheinfo;
+
+/* Client headers dropped from revalidations : only ours are asked, and for the whole object */
+static char *conditionals[] = {"If-None-Match", "If-Modified-Since", "If-Match", "If-Unmodified-Since", "If-Range", "Range", NULL};
+/* Stored headers a 304 must not replace : they describe the stored body */
+static char *framing[] = {"Content-Length", "Transfer-Encoding", "Content-Encoding", "Content-Range", NULL};
+
+static request *queue[REFRESH_QUEUE];   // refreshes waiting for a thread
+static int qhead, qcount;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static void (*refresh_fn)(request *rq);
+static unsigned long stale_served, revalidated, not_modified, refreshes, dropped;
+
+static void *refresher(void *vargp);
+static void refresh_done(request *rq);
+static int name_is(const char *name, size_t len, const char *str);
+static int name_in(const char *name, size_t len, char **names);
+static void head_info(const char *resp, size_t len, cacheinfo *ci);
+static void directives(cacheinfo *ci, const char *v, size_t len);
+static long seconds(const char *p, const char *end);
+static int heuristic_status(int status);
+
+/*
+ * When a response stored at stored stops being fresh(RFC 9111 4.2) :
+ * its lifetime from s-maxage, max-age, Expires - Date, or heuristically
+ * 10% of its age since Last-Modified, less the age it already had. *stale
+ * adds the stale-while-revalidate window unless it must revalidate
+ */
+void fresh_compute(const char *resp, size_t len, time_t stored, time_t *expires, time_t *stale){
+    cacheinfo ci;
+    long lifetime, age;
+
+    head_info(resp, len, &ci);
+    time_t date = ci.date >= 0 ? ci.date : stored;
+    if(ci.no_cache) lifetime = 0;
+    else if(ci.s_maxage >= 0) lifetime = ci.s_maxage;
+    else if(ci.max_age >= 0) lifetime = ci.max_age;
+    else if(ci.has_expires) lifetime = ci.expires >= 0 ? ci.expires - date : 0;
+    else if(!heuristic_status(ci.status)) lifetime = 0;
+    else if(ci.last_modified >= 0 && ci.last_modified <= date){
+        lifetime = (date - ci.last_modified) / 10;
+        if(lifetime > FRESH_HEURISTIC_MAX) lifetime = FRESH_HEURISTIC_MAX;
+    }
+    else lifetime = FRESH_DEFAULT;
+    if(lifetime < 0) lifetime = 0;
+
+    age = stored > date ? stored - date : 0;
+    if(ci.age > age) age = ci.age;
+    *expires = stored + lifetime - age;
+    *stale = *expires + ((ci.must_revalidate || ci.no_cache || ci.swr < 0) ? 0 : ci.swr);
+}
+
+/* Whether a response may be stored at all : a final one a shared cache may keep(a 206 as pieces, range_store()) */
+int fresh_storable(const char *resp, size_t len){
+    cacheinfo ci;
+    head_info(resp, len, &ci);
+    return ci.status >= 200 && ci.status != 304 && !ci.no_store;
+}
+
+/*
+ * Whether a response may be stored for, or reused to answer, a request
+ * with Authorization or Cookie : only if the origin marked it public or
+ * gave it an s-maxage(RFC 9111 3.5), so one user's copy never reaches another
+ */
+int fresh_shareable(const char *resp, size_t len){
+    cacheinfo ci;
+    head_info(resp, len, &ci);
+    return ci.shared;
+}
+
+/* Where pb's freshness state lives : on the stored payload an opened copy came from */
+static pbuf *state_of(pbuf *pb){
+    return pb -> stored_as ? pb -> stored_as : pb;
+}
+
+/* Whether pb may be served at now, working out and keeping its freshness the first time */
+int fresh_state(pbuf *pb, time_t now){
+    pbuf *st = state_of(pb);
+    time_t expires = __atomic_load_n(&st -> expires, __ATOMIC_ACQUIRE), stale;
+
+    if(expires == 0){       // racing readers work out the same values
+        fresh_compute(pb -> data, pb -> size, pb -> stored, &expires, &stale);
+        if(expires == 0) expires = -1;
+        __atomic_store_n(&st -> stale_until, stale, __ATOMIC_RELAXED);
+        __atomic_store_n(&st -> expires, expires, __ATOMIC_RELEASE);
+    }
+    else stale = __atomic_load_n(&st -> stale_until, __ATOMIC_RELAXED);
+    if(now < expires) return FRESH_OK;
+    if(now < stale){
+        __atomic_fetch_add(&stale_served, 1, __ATOMIC_RELAXED);
+        return FRESH_STALE_OK;
+    }
+    return FRESH_STALE;
+}
+
+/*
+ * Make rq's origin request revalidate pb : the client's own conditional
+ * and range headers are dropped, so any 304 answers ours about the whole
+ * object, and pb's ETag and Last-Modified are asked for. Returns 0 if pb
+ * has neither, in which case the request just refetches
+ */
+int fresh_conditional(request *rq, pbuf *pb){
+    hline etag, modified;
+    int has_etag = http_find_header(pb -> data, pb -> size, "ETag", 4, &etag);
+    int has_modified = http_find_header(pb -> data, pb -> size, "Last-Modified", 13, &modified);
+    char *extra = Malloc((has_etag ? etag.valuelen : 0) + (has_modified ? modified.valuelen : 0) + 64);
+    size_t len = 0;
+
+    if(has_etag) len += sprintf(extra + len, "If-None-Match: %.*s\r\n", (int)etag.valuelen, etag.value);
+    if(has_modified) len += sprintf(extra + len, "If-Modified-Since: %.*s\r\n", (int)modified.valuelen, modified.value);
+    extra[len] = '\0';
+    request_rewrite(rq, conditionals, extra);
+    free(extra);
+    if(!has_etag && !has_modified) return 0;
+    __atomic_fetch_add(&revalidated, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * The stored response pb refreshed by a 304 whose head is head[0, headlen) :
+ * its headers replace the stored ones of the same name, except those
+ * describing the stored body, which is kept as is. Caller frees it
+ */
+char *fresh_merge(pbuf *pb, const char *head, size_t headlen, size_t *len){
+    const char *p = http_head_start(pb -> data, pb -> size), *end = pb -> data + pb -> size;
+    char *data = Malloc(pb -> size + headlen + 2);
+    size_t n = p - pb -> data;
+    hline h, other;
+
+    memcpy(data, pb -> data, n);        // status line
+    while(http_next_header(&p, end, &h)){
+        if(!name_in(h.name, h.namelen, framing) && http_find_header(head, headlen, h.name, h.namelen, &other)) continue;
+        memcpy(data + n, h.line, h.len);
+        n += h.len;
+    }
+    const char *q = http_head_start(head, headlen);
+    while(http_next_header(&q, head + headlen, &h)){
+        if(name_in(h.name, h.namelen, framing)) continue;
+        memcpy(data + n, h.line, h.len);
+        n += h.len;
+    }
+    memcpy(data + n, "\r\n", 2);
+    n += 2;
+    memcpy(data + n, p, end - p);       // http_next_header() left p at the body
+    *len = n + (end - p);
+    __atomic_fetch_add(&not_modified, 1, __ATOMIC_RELAXED);
+    return data;
+}
+
+/* Start the refresh threads; fn fetches a request with no client waiting for it */
+void refresh_init(void (*fn)(request *rq)){
+    sigset_t all, prev;
+    pthread_t tid;
+    int i;
+
+    refresh_fn = fn;
+    /* refreshers never handle signals : keep SIGUSR1 for the accept loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &prev);
+    for(i = 0; i < REFRESH_THREADS; i++){
+        Pthread_create(&tid, NULL, refresher, NULL);
+        Pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * Queue a background revalidation of pb, served stale for rq, unless one
+ * is already queued or running. The refresh works on its own copy of rq
+ */
+void refresh_start(request *rq, pbuf *pb){
+    int idle = 0;
+    if(!__atomic_compare_exchange_n(&state_of(pb) -> refreshing, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+
+    request *job = Calloc(1, sizeof(request));
+    job -> port = rq -> port;
+    job -> server = strdup(rq -> server);
+    job -> filename = strdup(rq -> filename);
+    job -> out = Malloc(rq -> outlen);
+    memcpy(job -> out, rq -> out, rq -> outlen);
+    job -> outlen = rq -> outlen;
+    job -> unshared = rq -> unshared;
+    job -> credentials = rq -> credentials;
+    pbuf_pin(pb);
+    job -> stale = pb;
+    fresh_conditional(job, pb);
+
+    pthread_mutex_lock(&lock);
+    if(qcount == REFRESH_QUEUE){
+        dropped++;
+        pthread_mutex_unlock(&lock);
+        refresh_done(job);
+        return;
+    }
+    queue[(qhead + qcount++) % REFRESH_QUEUE] = job;
+    refreshes++;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+}
+
+void fresh_report(FILE *fp){
+    pthread_mutex_lock(&lock);
+    fprintf(fp, "fresh: %lu stale hits served, %lu revalidations(%lu not modified), %lu background refreshes, %lu dropped\n",
+        __atomic_load_n(&stale_served, __ATOMIC_RELAXED), __atomic_load_n(&revalidated, __ATOMIC_RELAXED),
+        __atomic_load_n(&not_modified, __ATOMIC_RELAXED), refreshes, dropped);
+    pthread_mutex_unlock(&lock);
+}
+
+static void *refresher(void *vargp){
+    while(1){
+        pthread_mutex_lock(&lock);
+        while(qcount == 0) pthread_cond_wait(&work, &lock);
+        request *job = queue[qhead];
+        qhead = (qhead + 1) % REFRESH_QUEUE;
+        qcount--;
+        pthread_mutex_unlock(&lock);
+
+        refresh_fn(job);
+        refresh_done(job);
+    }
+    return NULL;
+}
+
+/* Let the next stale hit refresh again(if this one failed), and free the job */
+static void refresh_done(request *rq){
+    __atomic_store_n(&state_of(rq -> stale) -> refreshing, 0, __ATOMIC_RELEASE);
+    free_request(rq);
+    free(rq);
+}
+
+static int name_is(const char *name, size_t len, const char *str){
+    return strlen(str) == len && !strncasecmp(name, str, len);
+}
+
+static int name_in(const char *name, size_t len, char **names){
+    for(; *names; names++)
+        if(name_is(name, len, *names)) return 1;
+    return 0;
+}
+
+static void head_info(const char *resp, size_t len, cacheinfo *ci){
+    const char *p = http_head_start(resp, len);
+    hline h;
+
+    memset(ci, 0, sizeof(cacheinfo));
+    ci -> date = ci -> last_modified = -1;
+    ci -> max_age = ci -> s_maxage = ci -> swr = -1;
+    if(len >= 12 && !strncmp(resp, "HTTP/1.", 7) && resp[8] == ' '
+        && isdigit((unsigned char)resp[9]) && isdigit((unsigned char)resp[10]) && isdigit((unsigned char)resp[11]))
+        ci -> status = (resp[9] - '0') * 100 + (resp[10] - '0') * 10 + resp[11] - '0';
+    while(http_next_header(&p, resp + len, &h)){
+        if(name_is(h.name, h.namelen, "Date")) ci -> date = http_date(h.value, h.valuelen);
+        else if(name_is(h.name, h.namelen, "Expires")){
+            ci -> has_expires = 1;
+            ci -> expires = http_date(h.value, h.valuelen);
+        }
+        else if(name_is(h.name, h.namelen, "Last-Modified")) ci -> last_modified = http_date(h.value, h.valuelen);
+        else if(name_is(h.name, h.namelen, "Age")){
+            long age = seconds(h.value, h.value + h.valuelen);
+            if(age > 0) ci -> age = age;
+        }
+        else if(name_is(h.name, h.namelen, "Cache-Control")) directives(ci, h.value, h.valuelen);
+    }
+}
+
+/* Cache-Control directives a shared cache acts on; arguments may be quoted */
+static void directives(cacheinfo *ci, const char *v, size_t len){
+    const char *p = v, *end = v + len, *s;
+    while(p < end){
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        for(s = p; p < end && *p != '=' && *p != ',' && *p != ' ' && *p != '\t'; p++)
+            ;
+        size_t n = p - s;
+        long arg = -1;
+        if(p < end && *p == '='){
+            if(++p < end && *p == '"') p++;
+            arg = seconds(p, end);
+        }
+        while(p < end && *p != ',') p++;
+
+        if(name_is(s, n, "max-age")) ci -> max_age = arg;
+        else if(name_is(s, n, "s-maxage")){
+            ci -> s_maxage = arg;
+            ci -> must_revalidate = 1;
+            ci -> shared = 1;
+        }
+        else if(name_is(s, n, "public")) ci -> shared = 1;
+        else if(name_is(s, n, "stale-while-revalidate")) ci -> swr = arg;
+        else if(name_is(s, n, "no-store") || name_is(s, n, "private")) ci -> no_store = 1;
+        else if(name_is(s, n, "no-cache")) ci -> no_cache = 1;
+        else if(name_is(s, n, "must-revalidate") || name_is(s, n, "proxy-revalidate")) ci -> must_revalidate = 1;
+    }
+}
+
+/* delta-seconds at p, capped at 2^31 as RFC 9111 1.2.2 asks; -1 if there are no digits */
+static long seconds(const char *p, const char *end){
+    long v = 0;
+    int digits = 0;
+    for(; p < end && isdigit((unsigned char)*p); p++, digits++)
+        if((v = v * 10 + *p - '0') > 2147483648L) v = 2147483648L;
+    return digits ? v : -1;
+}
+
+/* Status codes cacheable without explicit freshness(RFC 9110 15.1) */
+static int heuristic_status(int status){
+    static int codes[] = {200, 203, 204, 206, 300, 301, 308, 404, 405, 410, 414, 501, 0};
+    int i;
+    for(i = 0; codes[i]; i++)
+        if(codes[i] == status) return 1;
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __FRESH_H__
+#define __FRESH_H__
+
+#include <stdio.h>
+#include <time.h>
+#include "proxy.h"
+
+#define FRESH_DEFAULT 300           // seconds a response with no freshness information or Last-Modified stays fresh
+#define FRESH_HEURISTIC_MAX 86400   // cap on the Last-Modified heuristic(10% of the object's age)
+#define REFRESH_THREADS 2           // background refresh threads
+#define REFRESH_QUEUE 256           // refreshes waiting for one; more are dropped
+
+/* fresh_state() results */
+#define FRESH_OK 0                  // serve it
+#define FRESH_STALE_OK 1            // serve it, refreshing it in the background(stale-while-revalidate)
+#define FRESH_STALE 2               // revalidate or refetch before serving
+
+void fresh_compute(const char *resp, size_t len, time_t stored, time_t *expires, time_t *stale);
+int fresh_storable(const char *resp, size_t len);
+int fresh_shareable(const char *resp, size_t len);
+int fresh_state(pbuf *pb, time_t now);
+int fresh_conditional(request *rq, pbuf *pb);
+char *fresh_merge(pbuf *pb, const char *head, size_t headlen, size_t *len);
+void refresh_init(void (*fn)(request *rq));
+void refresh_start(request *rq, pbuf *pb);
+void fresh_report(FILE *fp);
+
+#endif
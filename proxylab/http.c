@@ -0,0 +1,280 @@
+#include "csapp.h"
+#include "http.h"
+
+static int request_line(httpreq *r, const char *buf, size_t from, size_t to);
+static int parse_target(httpreq *r, const char *buf);
+static int header_line(httpreq *r, const char *buf, size_t from, size_t to);
+static int has_ctl(const char *p, const char *end);
+static inline int is_tchar(unsigned char c);
+
+#define SPAN(buf, from, to) ((span){(from) - (buf), (to) - (from)})
+
+void http_init(httpreq *r){
+    memset(&r -> method, 0, sizeof(span));
+    memset(&r -> uri, 0, sizeof(span));
+    memset(&r -> host, 0, sizeof(span));
+    memset(&r -> path, 0, sizeof(span));
+    r -> port = r -> minor = 0;
+    r -> nheaders = 0;
+    r -> len = 0;
+    r -> line = r -> scan = 0;
+    r -> started = 0;
+}
+
+/*
+ * Parse as much of the request head in buf[0, len) as has arrived,
+ * resuming where the last call on r stopped, so every byte is looked at
+ * once however the head trickles in. buf may have moved since, as long as
+ * its contents didn't. Returns the head length once the blank line is in,
+ * HTTP_AGAIN, or an error; the head may not exceed max bytes
+ */
+int http_parse(httpreq *r, const char *buf, size_t len, size_t max){
+    int rc;
+
+    if(r -> len) return r -> len;
+    while(r -> scan < len){
+        const char *nl = memchr(buf + r -> scan, '\n', len - r -> scan);
+        if(nl == NULL){
+            r -> scan = len;
+            break;
+        }
+        size_t stop = nl - buf;
+        r -> scan = stop + 1;
+        if(r -> scan > max) return HTTP_TOO_LARGE;
+        if(stop > r -> line && buf[stop - 1] == '\r') stop--;   // bare LF is tolerated
+
+        if(stop == r -> line){
+            if(r -> started) return r -> len = r -> scan;
+            /* stray blank lines before a request line(after a body) are skipped */
+        }
+        else if(!r -> started){
+            if((rc = request_line(r, buf, r -> line, stop)) < 0) return rc;
+            r -> started = 1;
+        }
+        else if((rc = header_line(r, buf, r -> line, stop)) < 0) return rc;
+        r -> line = r -> scan;
+    }
+    if(len >= max) return HTTP_TOO_LARGE;
+    if(len - r -> line > (r -> started ? HTTP_MAX_LINE + 1 : HTTP_MAX_METHOD + HTTP_MAX_URI + 16))   // + CR
+        return HTTP_TOO_LARGE;
+    return HTTP_AGAIN;
+}
+
+/* First header called name(case-insensitive), NULL if none */
+httphdr *http_header(httpreq *r, const char *buf, const char *name){
+    int i;
+    for(i = 0; i < r -> nheaders; i++)
+        if(http_span_is(buf, r -> headers[i].name, name)) return &r -> headers[i];
+    return NULL;
+}
+
+/* Whether span s of buf is str, ignoring case */
+int http_span_is(const char *buf, span s, const char *str){
+    return strlen(str) == s.len && !strncasecmp(buf + s.off, str, s.len);
+}
+
+/* NUL-terminated copy of span s of buf */
+char *http_strdup(const char *buf, span s){
+    char *str = Malloc(s.len + 1);
+    memcpy(str, buf + s.off, s.len);
+    str[s.len] = '\0';
+    return str;
+}
+
+/* Whether the comma-separated value[0, len) contains token(case-insensitive) */
+int http_has_token(const char *value, size_t len, const char *token){
+    const char *p = value, *end = value + len;
+    size_t n = strlen(token);
+    while(p < end){
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if((size_t)(end - p) >= n && !strncasecmp(p, token, n) && (p + n == end || strchr(" \t,", p[n])))
+            return 1;
+        while(p < end && *p != ',') p++;
+    }
+    return 0;
+}
+
+/* An HTTP-date in s[0, len) : IMF-fixdate, or the obsolete RFC 850 and asctime formats. -1 if it is none */
+time_t http_date(const char *s, size_t len){
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char buf[64], mon[4], *m;
+    int day, year, hh, mm, ss;
+    struct tm tm;
+
+    if(len >= sizeof(buf)) return -1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    if(sscanf(buf, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &day, mon, &year, &hh, &mm, &ss) == 6)
+        ;
+    else if(sscanf(buf, "%*[A-Za-z], %2d-%3s-%2d %2d:%2d:%2d GMT", &day, mon, &year, &hh, &mm, &ss) == 6)
+        year += year < 70 ? 2000 : 1900;
+    else if(sscanf(buf, "%*3s %3s %2d %2d:%2d:%2d %4d", mon, &day, &hh, &mm, &ss, &year) != 6)
+        return -1;
+    if(strlen(mon) != 3 || !(m = strstr(months, mon)) || (m - months) % 3) return -1;
+    if(day < 1 || day > 31 || hh > 23 || mm > 59 || ss > 60 || year < 1970) return -1;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_mday = day;
+    tm.tm_hour = hh;
+    tm.tm_min = mm;
+    tm.tm_sec = ss;
+    return timegm(&tm);
+}
+
+/* First header line of a head : what follows the status or request line */
+const char *http_head_start(const char *resp, size_t len){
+    const char *nl = memchr(resp, '\n', len);
+    return nl ? nl + 1 : resp + len;
+}
+
+/*
+ * Split the header line at *p and move past it. Returns 0 at the blank
+ * line ending the head, leaving *p after it, or at the end of the bytes
+ */
+int http_next_header(const char **p, const char *end, hline *h){
+    while(*p < end){
+        const char *s = *p, *nl = memchr(s, '\n', end - s), *e, *colon;
+        if(nl == NULL){
+            *p = end;
+            return 0;
+        }
+        *p = nl + 1;
+        e = (nl > s && nl[-1] == '\r') ? nl - 1 : nl;
+        if(e == s) return 0;
+        if((colon = memchr(s, ':', e - s)) == NULL) continue;   // not a field : skip it
+        h -> line = s;
+        h -> len = nl + 1 - s;
+        h -> name = s;
+        h -> namelen = colon - s;
+        for(s = colon + 1; s < e && (*s == ' ' || *s == '\t'); s++)
+            ;
+        while(e > s && (e[-1] == ' ' || e[-1] == '\t')) e--;
+        h -> value = s;
+        h -> valuelen = e - s;
+        return 1;
+    }
+    return 0;
+}
+
+/* First header called name[0, namelen) in the head of resp[0, len); *h is left alone if there is none */
+int http_find_header(const char *resp, size_t len, const char *name, size_t namelen, hline *h){
+    const char *p = http_head_start(resp, len);
+    hline cur;
+    while(http_next_header(&p, resp + len, &cur))
+        if(cur.namelen == namelen && !strncasecmp(cur.name, name, namelen)){
+            *h = cur;
+            return 1;
+        }
+    return 0;
+}
+
+/* method SP request-target SP HTTP/1.x */
+static int request_line(httpreq *r, const char *buf, size_t from, size_t to){
+    const char *p = buf + from, *end = buf + to, *s;
+
+    for(s = p; p < end && is_tchar(*p); p++)
+        ;
+    if(p == s || p == end || *p != ' ') return HTTP_ERROR;
+    if(p - s > HTTP_MAX_METHOD) return HTTP_TOO_LARGE;
+    r -> method = SPAN(buf, s, p);
+
+    for(s = ++p; p < end && (unsigned char)*p > ' ' && *p != 0x7f; p++)
+        ;
+    if(p == s || p == end || *p != ' ') return HTTP_ERROR;
+    if(p - s > HTTP_MAX_URI) return HTTP_TOO_LARGE;
+    r -> uri = SPAN(buf, s, p);
+
+    p++;
+    if(end - p != 8 || memcmp(p, "HTTP/1.", 7) || !isdigit((unsigned char)p[7])) return HTTP_ERROR;
+    r -> minor = p[7] - '0';
+    return parse_target(r, buf);
+}
+
+/*
+ * Split an absolute-form target into host, port and path. Other forms are
+ * left with an empty host for the caller to refuse or resolve via Host
+ */
+static int parse_target(httpreq *r, const char *buf){
+    const char *p = buf + r -> uri.off, *end = p + r -> uri.len, *s;
+
+    if(r -> uri.len < 7 || strncasecmp(p, "http://", 7)) return 0;
+    p += 7;
+    if(p < end && *p == '['){      // IPv6 literal
+        for(s = ++p; p < end && *p != ']'; p++)
+            ;
+        if(p == end) return HTTP_ERROR;
+        r -> host = SPAN(buf, s, p++);
+    }
+    else{
+        for(s = p; p < end && *p != ':' && *p != '/' && *p != '?' && *p != '@'; p++)
+            ;
+        r -> host = SPAN(buf, s, p);
+    }
+    if(r -> host.len == 0 || (p < end && *p == '@')) return HTTP_ERROR;    // no userinfo
+    if(r -> host.len > HTTP_MAX_HOST) return HTTP_TOO_LARGE;
+
+    r -> port = 80;
+    if(p < end && *p == ':'){
+        int port = 0, digits = 0;
+        for(p++; p < end && isdigit((unsigned char)*p); p++){
+            if(++digits > 5) return HTTP_ERROR;
+            port = port * 10 + *p - '0';
+        }
+        if(digits && (port == 0 || port > 65535)) return HTTP_ERROR;
+        if(digits) r -> port = port;    // "host:" means the default
+    }
+    if(p < end && *p != '/' && *p != '?') return HTTP_ERROR;
+    if(p < end && *p == '/') p++;
+    r -> path = SPAN(buf, p, end);
+    return 0;
+}
+
+/* field-name ":" OWS field-value OWS; folded lines and whitespace before the colon are refused */
+static int header_line(httpreq *r, const char *buf, size_t from, size_t to){
+    const char *p = buf + from, *end = buf + to, *s, *e;
+
+    if(r -> nheaders == HTTP_MAX_HEADERS || to - from > HTTP_MAX_LINE) return HTTP_TOO_LARGE;
+    httphdr *h = &r -> headers[r -> nheaders];
+    for(s = p; p < end && is_tchar(*p); p++)
+        ;
+    if(p == s || p == end || *p != ':') return HTTP_ERROR;
+    h -> name = SPAN(buf, s, p);
+
+    for(p++; p < end && (*p == ' ' || *p == '\t'); p++)
+        ;
+    s = p;
+    if(has_ctl(s, end)) return HTTP_ERROR;     // CR, NUL and other controls
+    for(e = end; e > s && (e[-1] == ' ' || e[-1] == '\t'); e--)
+        ;
+    h -> value = SPAN(buf, s, e);
+    r -> nheaders++;
+    return 0;
+}
+
+/*
+ * Whether [p, end) holds a control character other than tab. Eight bytes
+ * at a time : a word with a byte below 0x20 or equal to 0x7f stops the
+ * fast loop, and the bytes from there on decide
+ */
+static int has_ctl(const char *p, const char *end){
+    const unsigned long long ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    unsigned long long x, del;
+    for(; end - p >= 8; p += 8){
+        memcpy(&x, p, 8);
+        del = x ^ (ones * 0x7f);
+        if(((x - ones * ' ') & ~x & highs) | ((del - ones) & ~del & highs)) break;
+    }
+    for(; p < end; p++){
+        unsigned char c = *p;
+        if((c < ' ' && c != '\t') || c == 0x7f) return 1;
+    }
+    return 0;
+}
+
+/* RFC 9110 token characters : visible ASCII but "(),/:;<=>?@[\]{} as a bitmap over 0..127 */
+static inline int is_tchar(unsigned char c){
+    static const unsigned long long tchar[2] = {0x03ff6cfa00000000ULL, 0x57ffffffc7fffffeULL};
+    return c < 128 && (tchar[c >> 6] >> (c & 63) & 1);
+}
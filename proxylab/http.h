@@ -0,0 +1,77 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#define HTTP_MAX_METHOD 16
+#define HTTP_MAX_URI 8192
+#define HTTP_MAX_HOST 255
+#define HTTP_MAX_LINE 8192          // longest header line
+#define HTTP_MAX_HEADERS 100
+
+/* http_parse() results besides the head length */
+#define HTTP_AGAIN 0                // head incomplete : call again with more bytes
+#define HTTP_ERROR (-1)             // malformed
+#define HTTP_TOO_LARGE (-2)         // past one of the limits above, or the caller's
+
+/*
+ * Bytes [off, off + len) of the buffer being parsed. Offsets rather than
+ * pointers, so a buffer that moves between calls(realloc, compaction)
+ * keeps its spans valid
+ */
+typedef struct span{
+    unsigned int off;
+    unsigned int len;
+} span;
+
+typedef struct httphdr{
+    span name;
+    span value;             // optional whitespace trimmed
+} httphdr;
+
+/* A request head parsed in place; nothing is copied out of the buffer */
+typedef struct httpreq{
+    span method;
+    span uri;
+    span host;              // of an absolute-form uri("http://host[:port]/path"), else empty
+    span path;              // what follows the host, minus one leading '/'
+    int port;               // 80 if the uri names none, 0 if it isn't absolute-form
+    int minor;              // HTTP/1.minor
+    httphdr headers[HTTP_MAX_HEADERS];
+    int nheaders;
+    size_t len;             // head length once complete, blank line included
+
+    /* where the next call resumes */
+    size_t line;            // start of the line being parsed
+    size_t scan;            // bytes of it already searched for its end
+    int started;            // request line parsed
+} httpreq;
+
+#define SPAN_PTR(buf, s) ((buf) + (s).off)
+
+/*
+ * One header line of a head already in a buffer(a stored response, an
+ * origin request), for walking it with http_next_header()
+ */
+typedef struct hline{
+    const char *line;       // the whole line, line end included
+    size_t len;
+    const char *name;
+    size_t namelen;
+    const char *value;      // optional whitespace trimmed
+    size_t valuelen;
+} hline;
+
+void http_init(httpreq *r);
+int http_parse(httpreq *r, const char *buf, size_t len, size_t max);
+httphdr *http_header(httpreq *r, const char *buf, const char *name);
+int http_span_is(const char *buf, span s, const char *str);
+char *http_strdup(const char *buf, span s);
+int http_has_token(const char *value, size_t len, const char *token);
+time_t http_date(const char *s, size_t len);
+const char *http_head_start(const char *head, size_t len);
+int http_next_header(const char **p, const char *end, hline *h);
+int http_find_header(const char *head, size_t len, const char *name, size_t namelen, hline *h);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * lz4.c - a small LZ4 block codec : greedy single-probe hashing for the
+ * compressor, as lz4's fast mode does, and a decoder that checks every
+ * length and offset against both buffers, so corrupt input fails
+ * instead of writing out of bounds. Output is interchangeable with
+ * LZ4_compress_default()/LZ4_decompress_safe()
+ */
+#include <string.h>
+#include "lz4.h"
+
+typedef unsigned char byte;
+
+static unsigned int read32(const byte *p){
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned int hash4(unsigned int v){
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+/* The part of a length past the token's 15 : 255s, then the remainder */
+static byte *put_length(byte *op, size_t len){
+    while(len >= 255){
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Length continued past the token's 15 by bytes at *ip; -1 if they run past end */
+static long get_length(const byte **ip, const byte *end, size_t len){
+    byte b;
+    do{
+        if(*ip >= end) return -1;
+        b = *(*ip)++;
+        len += b;
+    }while(b == 255);
+    return len;
+}
+
+/*
+ * Compress src[0, srclen) into dst, writing at most dstcap bytes.
+ * Returns the compressed length, or 0 if it doesn't fit in dstcap
+ * (so a cap below srclen also rejects data that won't shrink enough)
+ */
+int lz4_compress(const char *source, int srclen, char *dest, int dstcap){
+    const byte *src = (const byte *)source, *ip = src, *anchor = src, *end = src + srclen;
+    byte *op = (byte *)dest, *oend = op + dstcap, *token;
+    int table[1 << LZ4_HASH_LOG];
+    unsigned int searches = 0;
+    size_t litlen, mlen;
+
+    if(srclen > LZ4_MFLIMIT){
+        const byte *mflimit = end - LZ4_MFLIMIT, *matchlimit = end - LZ4_LASTLITERALS;
+        memset(table, 0xff, sizeof(table));     // -1 : no position yet
+        while(ip < mflimit){
+            unsigned int h = hash4(read32(ip));
+            int ref = table[h];
+            table[h] = ip - src;
+            if(ref < 0 || ip - (src + ref) > LZ4_MAX_DISTANCE || read32(src + ref) != read32(ip)){
+                ip += 1 + (searches++ >> 6);    // skip faster through data that doesn't match
+                continue;
+            }
+            const byte *match = src + ref, *p = ip + LZ4_MINMATCH, *m = match + LZ4_MINMATCH;
+            while(ip > anchor && match > src && ip[-1] == match[-1]) ip--, match--;
+            while(p < matchlimit && *p == *m) p++, m++;
+            litlen = ip - anchor;
+            mlen = p - ip - LZ4_MINMATCH;
+            if((size_t)(oend - op) < 1 + litlen + litlen / 255 + 1 + 2 + mlen / 255 + 1) return 0;
+
+            token = op++;
+            *token = (litlen >= 15 ? 15 : litlen) << 4 | (mlen >= 15 ? 15 : mlen);
+            if(litlen >= 15) op = put_length(op, litlen - 15);
+            memcpy(op, anchor, litlen);
+            op += litlen;
+            *op++ = (ip - match) & 0xff;
+            *op++ = (ip - match) >> 8;
+            if(mlen >= 15) op = put_length(op, mlen - 15);
+
+            if(p - 2 > src) table[hash4(read32(p - 2))] = p - 2 - src;
+            ip = anchor = p;
+            searches = 0;
+        }
+    }
+
+    /* the rest as literals */
+    litlen = end - anchor;
+    if((size_t)(oend - op) < 1 + litlen + litlen / 255 + 1) return 0;
+    *op++ = (litlen >= 15 ? 15 : litlen) << 4;
+    if(litlen >= 15) op = put_length(op, litlen - 15);
+    memcpy(op, anchor, litlen);
+    op += litlen;
+    return op - (byte *)dest;
+}
+
+/*
+ * Decompress src[0, srclen) into dst, which has room for dstlen bytes.
+ * Returns the decompressed length, or -1 if src is malformed or would
+ * overflow dst
+ */
+int lz4_decompress(const char *source, int srclen, char *dest, int dstlen){
+    const byte *ip = (const byte *)source, *iend = ip + srclen;
+    byte *dst = (byte *)dest, *op = dst, *oend = dst + dstlen;
+    long len;
+
+    while(ip < iend){
+        unsigned int token = *ip++;
+        if((len = token >> 4) == 15 && (len = get_length(&ip, iend, len)) < 0) return -1;
+        if(len > iend - ip || len > oend - op) return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if(ip == iend) break;       // the last sequence is literals only
+
+        if(iend - ip < 2) return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if(off == 0 || off > (size_t)(op - dst)) return -1;
+        if((len = token & 15) == 15 && (len = get_length(&ip, iend, len)) < 0) return -1;
+        len += LZ4_MINMATCH;
+        if(len > oend - op) return -1;
+
+        const byte *m = op - off;
+        if(off >= (size_t)len){
+            memcpy(op, m, len);
+            op += len;
+        }
+        else while(len--) *op++ = *m++;     // overlapping : a repeating pattern
+    }
+    return op - dst;
+}
@@ -0,0 +1,19 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+/*
+ * LZ4 block format(no frame : the caller keeps the original length) :
+ * sequences of a token, literals and a 2-byte match offset into the
+ * previous 64 KiB, the last 5 bytes always literals
+ */
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5      // the block ends in at least this many literals
+#define LZ4_MFLIMIT 12          // no match starts within this many bytes of the end
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_HASH_LOG 12         // 4096-entry match finder, 16 KiB of stack
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)     // worst case output for n input bytes
+
+int lz4_compress(const char *src, int srclen, char *dst, int dstcap);
+int lz4_decompress(const char *src, int srclen, char *dst, int dstlen);
+
+#endif
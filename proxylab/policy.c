@@ -0,0 +1,342 @@
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+
+static void lru_admit(shard *s, node *nd);
+static node *lru_victim(shard *s);
+static void lru_requeue(shard *s, node *nd);
+static void slru_admit(shard *s, node *nd);
+static node *slru_victim(shard *s);
+static void slru_requeue(shard *s, node *nd);
+static void clock_admit(shard *s, node *nd);
+static node *clock_victim(shard *s);
+static void clock_requeue(shard *s, node *nd);
+static void tinylfu_init(shard *s);
+static void tinylfu_admit(shard *s, node *nd);
+static node *tinylfu_victim(shard *s);
+static void tinylfu_requeue(shard *s, node *nd);
+static void gdsf_init(shard *s);
+static void gdsf_admit(shard *s, node *nd);
+static node *gdsf_victim(shard *s);
+static void gdsf_remove(shard *s, node *nd);
+static void gdsf_requeue(shard *s, node *nd);
+
+static policy policies[] = {
+    {"lru", NULL, lru_admit, lru_victim, NULL, lru_requeue},
+    {"slru", NULL, slru_admit, slru_victim, NULL, slru_requeue},
+    {"clock", NULL, clock_admit, clock_victim, NULL, clock_requeue},
+    {"tinylfu", tinylfu_init, tinylfu_admit, tinylfu_victim, NULL, tinylfu_requeue},
+    {"gdsf", gdsf_init, gdsf_admit, gdsf_victim, gdsf_remove, gdsf_requeue},
+};
+
+policy *cache_policy = &policies[0];    // set before init_cache()
+
+static const unsigned int seeds[SKETCH_DEPTH] = {0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu};
+
+policy *policy_find(char *name){
+    size_t i;
+    for(i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+        if(!strcasecmp(policies[i].name, name)) return &policies[i];
+    return NULL;
+}
+
+/* Record an access from the lock-free hit path : flag and counter updates only */
+void policy_touch(shard *s, node *nd, unsigned int hash){
+    /* skip the store if already set to keep the line shared */
+    if(nd && !__atomic_load_n(&nd -> referenced, __ATOMIC_RELAXED))
+        __atomic_store_n(&nd -> referenced, 1, __ATOMIC_RELAXED);
+    if(nd && s -> pq) __atomic_add_fetch(&nd -> hits, 1, __ATOMIC_RELAXED);
+    if(s -> sketch) sketch_add(s -> sketch, hash);
+}
+
+/* Consume a node's referenced flag */
+static int take_ref(node *nd){
+    if(!__atomic_load_n(&nd -> referenced, __ATOMIC_RELAXED)) return 0;
+    __atomic_store_n(&nd -> referenced, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * Least recently used node of list l. Referenced tail nodes get their
+ * deferred move to the front first
+ */
+static node *lru_tail(shard *s, int l){
+    nlist *ls = &s -> lists[l];
+    node *nd;
+    size_t scanned = 0;
+    while((nd = ls -> end -> prev) != ls -> start && scanned++ < s -> count && take_ref(nd))
+        list_move(s, l, nd);
+    return nd == ls -> start ? NULL : nd;
+}
+
+/*
+ * Segmented LRU over lists p(probation) and p + 1(protected) sharing
+ * maincap bytes : nodes hit while on probation are promoted, protected
+ * overflow falls back to probation, and the victim is probation's tail
+ */
+static node *segmented_victim(shard *s, int p, size_t maincap){
+    nlist *prob = &s -> lists[p], *prot = &s -> lists[p + 1];
+    size_t protcap = maincap * SLRU_PROTECTED / 100, scanned = 0;
+    node *nd, *d;
+    while((nd = prob -> end -> prev) != prob -> start && scanned++ < s -> count && take_ref(nd)){
+        list_move(s, p + 1, nd);
+        while(prot -> size > protcap && (d = lru_tail(s, p + 1)) != NULL) list_move(s, p, d);
+    }
+    if(nd != prob -> start) return nd;
+    return lru_tail(s, p + 1);  // probation is empty
+}
+
+/*
+ * Move nd to the middle of list l by bytes, ahead of its older half : far
+ * enough from the tail for a second pass, behind everything used since.
+ * Walks half the list, but only when a victim was just compressed
+ */
+static void list_middle(shard *s, int l, node *nd){
+    nlist *ls = &s -> lists[l];
+    node *at;
+    size_t seen = 0;
+
+    list_unlink(s, nd);
+    for(at = ls -> end -> prev; at != ls -> start && seen < ls -> size / 2; at = at -> prev) seen += at -> size;
+    nd -> prev = at;
+    nd -> next = at -> next;
+    at -> next -> prev = nd;
+    at -> next = nd;
+    ls -> size += nd -> size;
+    nd -> list = l;
+}
+
+/* LRU with lazy promotion : one list, victim from the tail */
+static void lru_admit(shard *s, node *nd){
+    list_push(s, 0, nd);
+}
+
+static node *lru_victim(shard *s){
+    return lru_tail(s, 0);
+}
+
+static void lru_requeue(shard *s, node *nd){
+    list_middle(s, 0, nd);
+}
+
+/* SLRU : list 0 is probation, where new nodes start, list 1 protected */
+static void slru_admit(shard *s, node *nd){
+    list_push(s, 0, nd);
+}
+
+static node *slru_victim(shard *s){
+    return segmented_victim(s, 0, s -> capacity);
+}
+
+/* Back to the head of probation, where a hit still promotes it */
+static void slru_requeue(shard *s, node *nd){
+    list_move(s, 0, nd);
+}
+
+/* CLOCK : nodes never move; new ones go just behind the hand so it reaches them last */
+static void clock_admit(shard *s, node *nd){
+    if(s -> hand == NULL){
+        list_push(s, 0, nd);
+        return;
+    }
+    nd -> prev = s -> hand;
+    nd -> next = s -> hand -> next;
+    s -> hand -> next -> prev = nd;
+    s -> hand -> next = nd;
+    s -> lists[0].size += nd -> size;
+    nd -> list = 0;
+}
+
+/* Sweep from the hand towards the front, clearing flags, until an unreferenced node */
+static node *clock_victim(shard *s){
+    nlist *ls = &s -> lists[0];
+    node *nd = s -> hand ? s -> hand : ls -> end -> prev;
+    size_t scanned = 0;
+    if(nd == ls -> start) return NULL;
+    while(scanned++ < 2 * s -> count && take_ref(nd)){
+        nd = nd -> prev;
+        if(nd == ls -> start) nd = ls -> end -> prev;   // wrap around
+    }
+    s -> hand = nd;     // list_unlink() steps it on
+    return nd;
+}
+
+/* Nodes never move : step the hand past nd, which it then reaches a whole sweep later */
+static void clock_requeue(shard *s, node *nd){
+    nlist *ls = &s -> lists[0];
+    s -> hand = nd -> prev != ls -> start ? nd -> prev : ls -> end -> prev;    // wrap around
+}
+
+/* W-TinyLFU : list 0 is the admission window, 1 and 2 the main area's SLRU */
+static void tinylfu_init(shard *s){
+    s -> sketch = Calloc(1, sizeof(sketch));
+}
+
+static void tinylfu_admit(shard *s, node *nd){
+    if(__atomic_load_n(&s -> sketch -> accesses, __ATOMIC_RELAXED) >= (unsigned long)SKETCH_SAMPLE * SKETCH_WIDTH)
+        sketch_age(s -> sketch);
+    list_push(s, 0, nd);
+}
+
+/*
+ * Window overflow moves to the main area while it has room. Once it is
+ * full, the window's LRU victim only gets in if the sketch says it is used
+ * more often than the main area's own victim, which it then evicts;
+ * otherwise the window victim goes. A scan of one-hit wonders passes
+ * through the window without displacing anything hot
+ */
+static node *tinylfu_victim(shard *s){
+    size_t wcap = s -> capacity * TINYLFU_WINDOW / 100, maincap = s -> capacity - wcap;
+    node *cand = NULL, *v;
+
+    while(s -> lists[0].size > wcap && (cand = lru_tail(s, 0)) != NULL
+        && s -> lists[1].size + s -> lists[2].size + cand -> size <= maincap){
+        list_move(s, 1, cand);
+        cand = NULL;
+    }
+    v = segmented_victim(s, 1, maincap);
+    if(cand == NULL) return v ? v : lru_tail(s, 0);
+    if(v == NULL) return cand;
+    if(sketch_estimate(s -> sketch, cand -> hash) <= sketch_estimate(s -> sketch, v -> hash)) return cand;
+    list_move(s, 1, cand);
+    return v;
+}
+
+/* To the head of the main area's probation, where it no longer competes with the window */
+static void tinylfu_requeue(shard *s, node *nd){
+    list_move(s, 1, nd);
+}
+
+/*
+ * GDSF : priority = L + frequency * cost / size, so cheap-to-refetch and
+ * large objects go first. L rises to each victim's priority, which ages
+ * out objects that were popular long ago. Hits only count; a node's
+ * priority catches up when it surfaces at the top of the heap
+ */
+static void gdsf_init(shard *s){
+    s -> pq = Calloc(1, sizeof(pqueue));
+    s -> pq -> cap = GDSF_INIT_HEAP;
+    s -> pq -> heap = Malloc(s -> pq -> cap * sizeof(node*));
+}
+
+static double gdsf_priority(pqueue *pq, node *nd){
+    double cost = nd -> cost ? nd -> cost : GDSF_DEFAULT_COST;
+    return pq -> inflation + (1.0 + nd -> seen) * cost / (nd -> size ? nd -> size : 1);
+}
+
+static void heap_swap(pqueue *pq, size_t i, size_t j){
+    node *t = pq -> heap[i];
+    pq -> heap[i] = pq -> heap[j];
+    pq -> heap[j] = t;
+    pq -> heap[i] -> heapidx = i;
+    pq -> heap[j] -> heapidx = j;
+}
+
+static void sift_up(pqueue *pq, size_t i){
+    while(i > 0 && pq -> heap[(i - 1) / 2] -> prio > pq -> heap[i] -> prio){
+        heap_swap(pq, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(pqueue *pq, size_t i){
+    while(1){
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if(l < pq -> len && pq -> heap[l] -> prio < pq -> heap[m] -> prio) m = l;
+        if(r < pq -> len && pq -> heap[r] -> prio < pq -> heap[m] -> prio) m = r;
+        if(m == i) return;
+        heap_swap(pq, i, m);
+        i = m;
+    }
+}
+
+static void gdsf_admit(shard *s, node *nd){
+    pqueue *pq = s -> pq;
+    if(pq -> len == pq -> cap){
+        pq -> cap *= 2;
+        pq -> heap = Realloc(pq -> heap, pq -> cap * sizeof(node*));
+    }
+    nd -> prio = gdsf_priority(pq, nd);
+    nd -> heapidx = pq -> len;
+    pq -> heap[pq -> len++] = nd;
+    sift_up(pq, nd -> heapidx);
+    list_push(s, 0, nd);    // list 0 only keeps every node reachable, e.g. for snapshots
+}
+
+/* Lowest priority node, after bringing up to date any that was hit since it was ranked */
+static node *gdsf_victim(shard *s){
+    pqueue *pq = s -> pq;
+    while(pq -> len){
+        node *nd = pq -> heap[0];
+        unsigned int hits = __atomic_load_n(&nd -> hits, __ATOMIC_RELAXED);
+        if(hits == nd -> seen){
+            pq -> inflation = nd -> prio;
+            return nd;
+        }
+        nd -> seen = hits;
+        nd -> prio = gdsf_priority(pq, nd);     // only ever rises, so it sinks
+        sift_down(pq, 0);
+    }
+    return NULL;
+}
+
+static void gdsf_remove(shard *s, node *nd){
+    pqueue *pq = s -> pq;
+    size_t i = nd -> heapidx;
+    if(--pq -> len == i) return;
+    heap_swap(pq, i, pq -> len);
+    sift_down(pq, i);
+    sift_up(pq, i);
+}
+
+/* Smaller for the same cost : ranked again, higher */
+static void gdsf_requeue(shard *s, node *nd){
+    nd -> prio = gdsf_priority(s -> pq, nd);
+    sift_down(s -> pq, nd -> heapidx);
+    sift_up(s -> pq, nd -> heapidx);
+}
+
+static unsigned int sketch_index(unsigned int hash, int row){
+    unsigned int h = hash * seeds[row];
+    return (h ^ (h >> 16)) & (SKETCH_WIDTH - 1);
+}
+
+/* Count an access in every row, saturating; safe without the lock */
+void sketch_add(sketch *sk, unsigned int hash){
+    int i;
+    for(i = 0; i < SKETCH_DEPTH; i++){
+        unsigned int idx = sketch_index(hash, i), shift = (idx & 1) * 4;
+        unsigned char *b = &sk -> rows[i][idx >> 1];
+        unsigned char old = __atomic_load_n(b, __ATOMIC_RELAXED), new;
+        do{
+            if(((old >> shift) & 0xf) == SKETCH_MAX) break;
+            new = old + (1 << shift);
+        }while(!__atomic_compare_exchange_n(b, &old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    __atomic_add_fetch(&sk -> accesses, 1, __ATOMIC_RELAXED);
+}
+
+/* Estimated recent accesses : the smallest of the key's counters */
+int sketch_estimate(sketch *sk, unsigned int hash){
+    int i, est = SKETCH_MAX;
+    for(i = 0; i < SKETCH_DEPTH; i++){
+        unsigned int idx = sketch_index(hash, i);
+        int c = (__atomic_load_n(&sk -> rows[i][idx >> 1], __ATOMIC_RELAXED) >> ((idx & 1) * 4)) & 0xf;
+        if(c < est) est = c;
+    }
+    return est;
+}
+
+/*
+ * Halve every counter so old popularity fades; caller holds the write
+ * lock. Hits keep counting meanwhile, so an increment may be lost
+ */
+void sketch_age(sketch *sk){
+    int i, j;
+    for(i = 0; i < SKETCH_DEPTH; i++)
+        for(j = 0; j < SKETCH_WIDTH / 2; j++){
+            unsigned char *b = &sk -> rows[i][j];
+            __atomic_store_n(b, (__atomic_load_n(b, __ATOMIC_RELAXED) >> 1) & 0x77, __ATOMIC_RELAXED);
+        }
+    __atomic_store_n(&sk -> accesses, __atomic_load_n(&sk -> accesses, __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,51 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "cache.h"
+
+#define SLRU_PROTECTED 80       // % of the main area kept for objects hit since admission
+#define TINYLFU_WINDOW 1        // % of a shard given to the admission window
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096       // counters per row, a power of 2
+#define SKETCH_MAX 15           // counters are 4 bits
+#define SKETCH_SAMPLE 10        // halve every counter after SAMPLE * WIDTH accesses
+#define GDSF_DEFAULT_COST 1000  // usec assumed for objects whose miss latency wasn't measured
+#define GDSF_INIT_HEAP 64
+
+/* Count-min sketch of recent access frequency, two 4-bit counters per byte */
+typedef struct sketch{
+    unsigned char rows[SKETCH_DEPTH][SKETCH_WIDTH / 2];
+    unsigned long accesses;     // since the last aging
+} sketch;
+
+/* GDSF's min-heap of nodes by priority */
+typedef struct pqueue{
+    struct node **heap;
+    size_t len;
+    size_t cap;
+    double inflation;       // L : the last victim's priority, the base of every new one
+} pqueue;
+
+/*
+ * An eviction policy. Hits only ever set nd->referenced and bump the
+ * sketch(policy_touch); the policy reacts to them under the write lock
+ */
+typedef struct policy{
+    char *name;
+    void (*init)(shard *s);             // optional per-shard setup
+    void (*admit)(shard *s, node *nd);  // link a new node
+    node *(*victim)(shard *s);          // pick the next node to evict, left linked
+    void (*remove)(shard *s, node *nd); // optional : a node leaves, evicted or replaced
+    void (*requeue)(shard *s, node *nd);    // victim nd was shrunk instead of evicted : place it for a second pass
+} policy;
+
+extern policy *cache_policy;
+
+policy *policy_find(char *name);
+void policy_touch(shard *s, node *nd, unsigned int hash);
+
+void sketch_add(sketch *sk, unsigned int hash);
+int sketch_estimate(sketch *sk, unsigned int hash);
+void sketch_age(sketch *sk);
+
+#endif
@@ -1,143 +1,898 @@
 #include "csapp.h"
 #include "cache.h"
+#include "proxy.h"
+#include "sbuf.h"
+#include "event.h"
+#include "uring.h"
+#include "upstream.h"
+#include "flight.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "policy.h"
+#include "dns.h"
+#include "http.h"
+#include "wbuf.h"
+#include "fresh.h"
+#include "range.h"
+#include "cold.h"
+#include "stats.h"
 #include <stdbool.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/tcp.h>
 
-#define MAX_OBJECT_SIZE 102400
-#define MAX_HEADER_SIZE 16384
-#define HOSTLEN 256
-#define SERVLEN 8
+#define THREADS_PER_CORE 4      // workers block on I/O, so oversubscribe the cores
+#define QUEUE_PER_THREAD 4
+#define KEEPALIVE_TIMEOUT 5     // seconds a worker waits for a client's next request
+#define SPLICE_CHUNK 65536      // bytes moved per splice, one default-sized pipe
 
+/* glibc only declares splice under _GNU_SOURCE, which clashes with csapp.h's gai_error */
+extern ssize_t splice(int fdin, loff_t *offin, int fdout, loff_t *offout, size_t len, unsigned int flags);
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_MORE 4
+#endif
+
+/* forward() outcomes */
+#define FWD_KEEP 1      // response relayed, origin connection can be reused
+#define FWD_DONE 0      // response relayed, origin connection must be closed
+#define FWD_STALE (-1)  // origin closed before answering, nothing was sent to the client
+#define FWD_ERROR (-2)
+
+void usage(char *prog);
+void report_handler(int sig);
 void *init(void *vargp);
-void doit(int connfd);
-void forward(rio_t *rio, int connfd, char *server, int *port, char *filename);
-int parse_uri(char *uri, char* server, char *filename);
+void doit(int connfd, long long accepted);
+int handle_request(rio_t *client_rio, wbuf *out);
+flight *join_flight(request *rq, char *key, int *leader);
+int fetch(request *rq, wbuf *out, flight *fl, int *framed);
+int forward(rio_t *rio, wbuf *out, request *rq, flight *fl, int *framed);
+char *frame_capture(capture *cp, size_t headlen, size_t *len);
+int relay(rio_t *rio, wbuf *out, flight *fl, long long length);
+int relay_chunked(rio_t *rio, wbuf *out, flight *fl);
+ssize_t next_line(rio_t *rio, wbuf *out, flight *fl, char **linep);
+long long line_number(char *p, int base);
+long long relay_splice(int srcfd, int connfd, int *pfd, long long length);
+int *worker_pipe(void);
+int send_client(wbuf *out, flight *fl, char *buf, size_t n);
+int flush_client(wbuf *out, flight *fl);
+int serve_cached(wbuf *out, request *rq, pbuf *pb);
+int send_range(wbuf *out, rangeresp *rr);
+int range_fill(request *rq, wbuf *out);
+void refresh(request *rq);
 
 cache *caches = NULL;
-sem_t mutex;
+sbuf_t sbuf;    // accepted connections waiting for a worker
+static __thread int splice_pipe[2] = {-1, -1};  // each worker's pass-through pipe
+volatile sig_atomic_t report_requested = 0;
 
 int main(int argc, char** argv) {
+    int ncores = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = THREADS_PER_CORE * ncores;
+    int nloops = ncores;
+    int qsize = 0;
+    char *mode = "thread";
+    char *diskdir = NULL, *snapfile = NULL;
+    long disksize = DISK_DEFAULT_SIZE;
+    int dnsttl = DNS_DEFAULT_TTL;
+    int compress = 1;
+    int opt, i;
+    static struct option longopts[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"threads", required_argument, NULL, 't'},
+        {"queue", required_argument, NULL, 'q'},
+        {"loops", required_argument, NULL, 'l'},
+        {"disk", required_argument, NULL, 'd'},
+        {"disk-size", required_argument, NULL, 'D'},
+        {"snapshot", required_argument, NULL, 's'},
+        {"policy", required_argument, NULL, 'p'},
+        {"dns-ttl", required_argument, NULL, 'T'},
+        {"compress", required_argument, NULL, 'z'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while((opt = getopt_long(argc, argv, "m:t:q:l:d:D:s:p:T:z:", longopts, NULL)) != -1){
+        switch(opt){
+        case 'm': mode = optarg; break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'q': qsize = atoi(optarg); break;
+        case 'l': nloops = atoi(optarg); break;
+        case 'd': diskdir = optarg; break;
+        case 'D': disksize = atol(optarg); break;
+        case 's': snapfile = optarg; break;
+        case 'p': if((cache_policy = policy_find(optarg)) == NULL) usage(argv[0]); break;
+        case 'T': dnsttl = atoi(optarg); break;
+        case 'z': compress = strcmp(optarg, "off") != 0; break;
+        default: usage(argv[0]);
+        }
+    }
     /* if port number not given */
-    if(argc != 2) {
-    	fprintf(stderr, "Port number required\n");
-    	return 1;
+    if(optind != argc - 1 || nthreads <= 0 || qsize < 0 || nloops <= 0 || disksize <= 0 || dnsttl <= 0) usage(argv[0]);
+    if(strcmp(mode, "thread") && strcmp(mode, "epoll") && strcmp(mode, "uring")) usage(argv[0]);
+    if(!strcmp(mode, "uring") && !uring_supported()){
+        fprintf(stderr, "io_uring is not available on this kernel\n");
+        return 1;
     }
+    if(qsize == 0) qsize = QUEUE_PER_THREAD * nthreads;
 
-    /* initiate cache */
-   	caches = init_cache();
-    V(&mutex);
+    /* initiate cache and origin connection pool */
+   	caches = init_cache(CACHE_SHARDS);
+    stats_init();
+    if(compress) cold_init();   // victims get a second, compressed pass before eviction
+    if(snapfile){
+        /* warm up from the last snapshot before serving, then own SIGTERM/SIGUSR2 before any thread exists */
+        long n = snapshot_load(caches, snapfile);
+        if(n > 0) fprintf(stderr, "snapshot: loaded %ld objects from %s\n", n, snapfile);
+        snapshot_start(caches, snapfile);
+    }
+    upstream_init();
+    dns_init(dnsttl);
+    flight_init();
+    refresh_init(refresh);
+    if(diskdir){
+        if(disk_init(diskdir, disksize) < 0) return 1;
+        evict_hook = disk_spill;    // memory-tier victims move down to disk
+    }
 
-    struct sockaddr_in clientaddr;
-    socklen_t clientlen = sizeof(struct sockaddr_in);
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
     pthread_t tid;
+    sigset_t mask, prev;
 
     Signal(SIGPIPE, SIG_IGN);
-    int listenfd = Open_listenfd(argv[1]);
+    int listenfd = Open_listenfd(argv[optind]);
+
+    /* Event-driven modes : a few epoll loops or io_uring rings drive the sockets instead of the pool */
+    if(!strcmp(mode, "epoll")) event_serve(listenfd, nloops);
+    if(!strcmp(mode, "uring")) uring_serve(listenfd, nloops);
+
+    /* Prethread the pool with SIGUSR1 blocked so only the accept loop handles it */
+    sbuf_init(&sbuf, qsize);
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    Sigprocmask(SIG_BLOCK, &mask, &prev);
+    for(i = 0; i < nthreads; i++) Pthread_create(&tid, NULL, init, NULL);
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    /* SIGUSR1 prints queue stats; installed without SA_RESTART so it interrupts accept */
+    struct sigaction action;
+    action.sa_handler = report_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    if(sigaction(SIGUSR1, &action, NULL) < 0) unix_error("Signal error");
 
 	while (1) {
-        int *connfdp = malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, init, connfdp);
+        clientlen = sizeof(clientaddr);
+        int connfd = accept(listenfd, (SA *) &clientaddr, &clientlen);
+        if(report_requested){
+            report_requested = 0;
+            sbuf_report(&sbuf, stderr);
+            upstream_report(stderr);
+            dns_report(stderr);
+            flight_report(stderr);
+            wbuf_report(stderr);
+            fresh_report(stderr);
+            range_report(stderr);
+            disk_report(stderr);
+            cache_report(caches, stderr);
+            cold_report(stderr);
+            arena_report(caches -> mem, stderr);
+            stats_report(stderr);
+        }
+        if(connfd < 0){
+            if(errno != EINTR) unix_error("Accept error");
+            continue;
+        }
+        sbuf_insert(&sbuf, connfd);   // blocks while the queue is full
     }
     exit(0);
 }
 
-/*  Detach all threads & begin routine */
+void usage(char *prog){
+    fprintf(stderr, "usage: %s [--mode=thread|epoll|uring] [-t threads] [-q queue] [-l loops] [-d diskdir [-D MiB]] [-s snapshot]\n"
+        "          [-p lru|slru|clock|tinylfu|gdsf] [-T dns-ttl] [-z on|off] <port>\n", prog);
+    exit(1);
+}
+
+void report_handler(int sig){
+    report_requested = 1;
+}
+
+/*  Worker thread : detach & serve queued connections forever */
 void *init(void *vargp) {
-	int connfd = *((int*)vargp);    // copy and free fd to avoid race condition
 	Pthread_detach(pthread_self()); // detach thread
-    free(vargp);
-    doit(connfd);   // operate
-    Close(connfd);  // close
+    while(1){
+        struct timespec enq;
+        int connfd = sbuf_remove(&sbuf, &enq);
+        doit(connfd, enq.tv_sec * 1000000000LL + enq.tv_nsec);    // operate
+        Close(connfd);  // close
+    }
     return NULL;
 }
 
-/* Parse request and process */
-void doit(int connfd){
-	rio_t client_rio, server_rio;
-	
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version;
-    char header[MAX_HEADER_SIZE];
+/*
+ * Serve requests from one client connection, in order, until it closes or
+ * stops keeping alive. accepted(stats_now() time) starts the first one's clock
+ */
+void doit(int connfd, long long accepted){
+	rio_t client_rio;
+    wbuf out;
+    struct timeval idle = {KEEPALIVE_TIMEOUT, 0};
 
-	/* Read header to buffer */
+    /* a silent keep-alive client would otherwise pin this worker forever */
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    set_nodelay(connfd);
 	Rio_readinitb(&client_rio, connfd);
-	if (!Rio_readlineb(&client_rio, buf, MAXLINE)) return;
-    sscanf(buf, "%s %s HTTP/1.%c", method, uri, &version);
-    printf("%s", buf);
+    wbuf_init(&out, connfd);
+    out.start = accepted;
+    while(handle_request(&client_rio, &out) > 0)
+        ;   // pipelined requests are already waiting in client_rio's buffer
+    return;
+}
+
+/* Parse one request and process; returns 1 if the client connection can serve another */
+int handle_request(rio_t *client_rio, wbuf *out){
+    httpreq hp;
+    request rq;
+    int n, parsed;
+
+	/* Parse the head in place in client_rio's buffer, reading until its blank line is in */
+    http_init(&hp);
+    while((n = http_parse(&hp, client_rio -> rio_bufptr, client_rio -> rio_cnt, MAX_HEADER_SIZE)) == HTTP_AGAIN)
+        if(rio_fillb(client_rio) <= 0) return 0;    // EOF, error or idle timeout
+    if(n < 0) return 0;     // malformed or too large
+    parsed = parse_request(&hp, client_rio -> rio_bufptr, &rq, 1);
+    rio_skipb(client_rio, n);
+    if(parsed < 0) return 0;
+    if(out -> start == 0) out -> start = stats_now();   // a kept-alive connection's next request
+
+    /* The proxy's own stats */
+    if(rq.stats){
+        pbuf *page = stats_page(rq.stats);
+        int keep = wbuf_add(out, page -> data, page -> size) == 0 && wbuf_end(out) == 0 && rq.keepalive;
+        pbuf_unpin(page);
+        free_request(&rq);
+        return keep;
+    }
+    stats_add(ST_REQUESTS, 1);
+
+    /* Check if the finding payload exist in cache; a stale one is revalidated on the way */
+    long long start = stats_now();
+    pbuf *payload = cache_lookup(&rq, 1);
+    stats_time(PH_LOOKUP, start);
+
+    /* Hit : write straight from the pinned cache buffer, then release it */
+    if(payload){
+        stats_add(ST_HITS, 1);
+        int keep = serve_cached(out, &rq, payload) == 0 && rq.keepalive;
+        pbuf_unpin(payload);
+        free_request(&rq);
+        return keep;
+    }
+
+    /* A range of an object only partly cached : from its pieces, fetching what they lack */
+    if(rq.range && (n = range_fill(&rq, out)) != 0){
+        stats_add(ST_HITS, 1);
+        int keep = n > 0 && rq.keepalive;
+        free_request(&rq);
+        return keep;
+    }
+
+    /* Miss : follow the fetch of this object(or these bytes of it) already in flight, or lead one */
+    char *key = rq.range ? range_key(rq.range, rq.filename) : rq.filename;
+    int leader, tries, framed = 0, rc = 0;
+    stats_add(ST_MISSES, 1);
+    for(tries = 0; tries < 2 && rc == 0; tries++){
+        flight *fl = join_flight(&rq, key, &leader);
+        if(leader) rc = fetch(&rq, out, fl, &framed);
+        else rc = flight_follow(fl, out, &framed);   // 0 : leader failed before sending anything
+        if(rc != 0) count_miss(caches, rq.port, rq.server, rq.filename, fl -> cap.total);
+        flight_release(fl);
+    }
+    /* the client can only tell where this response ended if it was length- or chunk-delimited */
+    int keep = rq.keepalive && rc > 0 && framed;
+    if(key != rq.filename) free(key);
+    free_request(&rq);
+    return keep;
+}
+
+/* The flight fetching key for rq : a shared one, or one of its own if rq's headers may change the answer */
+flight *join_flight(request *rq, char *key, int *leader){
+    if(!rq -> unshared) return flight_join(rq -> port, rq -> server, key, leader);
+    *leader = 1;
+    return flight_alone(rq -> port, rq -> server, key);
+}
+
+/*
+ * Lead a miss : get the response from the origin over a pooled keep-alive
+ * connection when there is one, feeding fl's followers as it arrives.
+ * Returns 1 if the whole response was relayed, -1 otherwise
+ */
+int fetch(request *rq, wbuf *out, flight *fl, int *framed){
+	rio_t server_rio;
+    int attempt, reused, rc = FWD_ERROR;
+    rq -> started = now_usec();
+    for(attempt = 0; attempt < 2; attempt++){
+        int srcfd = upstream_get(rq -> server, rq -> port, &reused);
+        if(srcfd < 0) break;
+
+        if(rio_writen(srcfd, rq -> out, rq -> outlen) != (ssize_t)rq -> outlen) rc = FWD_STALE;    // send header to server
+        else{
+            rq -> mark = stats_now();
+            Rio_readinitb(&server_rio, srcfd);
+            rc = forward(&server_rio, out, rq, fl, framed);   // get from server and forward to client
+        }
+
+        if(rc == FWD_KEEP) upstream_put(rq -> server, rq -> port, srcfd);
+        else Close(srcfd);
+        if(rc != FWD_STALE || !reused) break;   // only a stale pooled connection is worth a retry
+    }
+    stats_add(ST_BYTES_IN, fl -> cap.total);
+    flight_finish(fl, rc >= FWD_DONE, *framed);
+    return rc >= FWD_DONE ? 1 : -1;
+}
+
+/*
+ * Turn a parsed request head in buf into a request, building the HTTP/1.1
+ * request to send the origin, which asks it to keep the connection open
+ * if keepalive is set. Each header is copied once, straight from buf into
+ * the origin request. Returns -1 if the request can't be served
+ */
+int parse_request(httpreq *hp, char *buf, request *rq, int keepalive){
+    int i, has_host = 0;
+
+    memset(rq, 0, sizeof(request));
+    rq -> keepalive = (hp -> minor >= 1);     // HTTP/1.1 clients persist unless they say close
+    printf("%.*s %.*s HTTP/1.%d\r\n", (int)hp -> method.len, SPAN_PTR(buf, hp -> method),
+        (int)hp -> uri.len, SPAN_PTR(buf, hp -> uri), hp -> minor);
     /* Process only GET request */
-    if (strcasecmp(method, "GET")) {
+    if(!http_span_is(buf, hp -> method, "GET")){
         fprintf(stderr, "501 Not Implemented : Does not implement this method");
-        return;
+        return -1;
     }
+    /* Origin-form : only the proxy's own stats page is served */
+    if(hp -> host.len == 0 && (rq -> stats = stats_target(SPAN_PTR(buf, hp -> uri), hp -> uri.len))){
+        for(i = 0; i < hp -> nheaders; i++){
+            httphdr *h = &hp -> headers[i];
+            if(is_hop_name(buf, h -> name) && http_has_token(SPAN_PTR(buf, h -> value), h -> value.len, "close"))
+                rq -> keepalive = 0;
+            else if(http_span_is(buf, h -> name, "Accept")
+                && http_has_token(SPAN_PTR(buf, h -> value), h -> value.len, "application/json"))
+                rq -> stats = STATS_JSON;
+        }
+        return 0;
+    }
+    if(hp -> host.len == 0){
+        fprintf(stderr, "Error: invalid uri!\n");
+        return -1;
+    }
+    rq -> port = hp -> port;
+    rq -> server = http_strdup(buf, hp -> host);
+    rq -> filename = http_strdup(buf, hp -> path);
 
-	while(Rio_readlineb(&client_rio, buf, MAXLINE) != 0){
-        if(strcmp(buf, "\r\n") == 0) break;
-        if(strstr(buf, "Connection:") == buf) sprintf(buf, "Connection: close\r\n");
-        else if(strstr(buf, "Proxy-Connection:") == buf) sprintf(buf, "Proxy-Connection: close\r\n");
-        strcat(header, buf);
+    /* Origin request : our request line, the client's end-to-end headers, our connection header */
+    rq -> out = Malloc(hp -> len + hp -> nheaders + hp -> host.len + hp -> path.len + MAXLINE);
+    rq -> outlen = sprintf(rq -> out, "GET /%s HTTP/1.1\r\n", rq -> filename);
+    for(i = 0; i < hp -> nheaders; i++){
+        httphdr *h = &hp -> headers[i];
+        if(is_hop_name(buf, h -> name)){
+            if(http_has_token(SPAN_PTR(buf, h -> value), h -> value.len, "close")) rq -> keepalive = 0;
+            continue;
+        }
+        if(http_span_is(buf, h -> name, "Host")) has_host = 1;
+        else if(http_span_is(buf, h -> name, "Range")) rq -> range = http_strdup(buf, h -> value);
+        else if(http_span_is(buf, h -> name, "If-Range")) rq -> if_range = http_strdup(buf, h -> value);
+        if(is_varying_name(buf, h -> name)) rq -> unshared = 1;
+        if(http_span_is(buf, h -> name, "Authorization") || http_span_is(buf, h -> name, "Cookie")) rq -> credentials = 1;
+        memcpy(rq -> out + rq -> outlen, SPAN_PTR(buf, h -> name), h -> name.len);
+        rq -> outlen += h -> name.len;
+        memcpy(rq -> out + rq -> outlen, ": ", 2);
+        rq -> outlen += 2;
+        memcpy(rq -> out + rq -> outlen, SPAN_PTR(buf, h -> value), h -> value.len);
+        rq -> outlen += h -> value.len;
+        memcpy(rq -> out + rq -> outlen, "\r\n", 2);
+        rq -> outlen += 2;
+    }
+    if(!has_host){
+        int v6 = strchr(rq -> server, ':') != NULL;     // an IPv6 literal : parse_target took its brackets off
+        rq -> outlen += sprintf(rq -> out + rq -> outlen, "Host: %s%s%s", v6 ? "[" : "", rq -> server, v6 ? "]" : "");
+        if(rq -> port != 80) rq -> outlen += sprintf(rq -> out + rq -> outlen, ":%d", rq -> port);
+        rq -> outlen += sprintf(rq -> out + rq -> outlen, "\r\n");
     }
-    strcat(header, "\r\n");
+    rq -> outlen += sprintf(rq -> out + rq -> outlen, "Connection: %s\r\n\r\n", keepalive ? "keep-alive" : "close");
+    return 0;
+}
 
-    char filename[MAXLINE], server[MAXLINE], port[MAXLINE];
-    size_t size;
-    int server_port = parse_uri(uri, server, filename);
+void free_request(request *rq){
+    if(rq -> stale) pbuf_unpin(rq -> stale);
+    free(rq -> server);
+    free(rq -> filename);
+    free(rq -> out);
+    free(rq -> range);
+    free(rq -> if_range);
+    memset(rq, 0, sizeof(request));
+}
 
-    /* Check if the finding payload exist in cache */
-    P(&mutex);
-    char *payload = get_payload(caches, server_port, &size, server, filename);
-    V(&mutex);
+/*
+ * Rebuild rq's origin request without the headers named in drop(NULL
+ * terminated), adding extra, whole header lines, before its blank line
+ */
+void request_rewrite(request *rq, char **drop, const char *extra){
+    size_t elen = strlen(extra);
+    char *out = Malloc(rq -> outlen + elen + 2), **d;
+    const char *p = http_head_start(rq -> out, rq -> outlen), *end = rq -> out + rq -> outlen;
+    size_t len = p - rq -> out;
+    hline h;
 
-    /* Hit : write to client and return */
-    if(payload){
-    	Rio_writen(connfd, payload, size);
+    memcpy(out, rq -> out, len);        // request line
+    while(http_next_header(&p, end, &h)){
+        for(d = drop; *d; d++)
+            if(strlen(*d) == h.namelen && !strncasecmp(h.name, *d, h.namelen)) break;
+        if(*d) continue;
+        memcpy(out + len, h.line, h.len);
+        len += h.len;
+    }
+    memcpy(out + len, extra, elen);
+    memcpy(out + len + elen, "\r\n", 2);
+    free(rq -> out);
+    rq -> out = out;
+    rq -> outlen = len + elen + 2;
+}
+
+/*
+ * Find an object in memory, then on disk; an L2 hit is copied back into
+ * memory. Returns it if it may be served, starting a background refresh
+ * if it is stale within its stale-while-revalidate window; caller must
+ * pbuf_unpin() it. A copy too stale to serve is dropped, or with
+ * revalidate kept in rq -> stale with rq's origin request made conditional
+ */
+pbuf *cache_lookup(request *rq, int revalidate){
+    pbuf *pb = get_payload(caches, rq -> port, rq -> server, rq -> filename);
+    if(!pb && (pb = disk_get(rq -> port, rq -> server, rq -> filename)))
+        insert_at(caches, rq -> port, pb -> size, pb -> data, rq -> server, rq -> filename, 0, pb -> stored);
+    if(pb == NULL) return NULL;
+    if(rq -> credentials && !fresh_shareable(pb -> data, pb -> size)){     // may be meant for whoever stored it only
+        pbuf_unpin(pb);
+        return NULL;
+    }
+
+    switch(fresh_state(pb, time(NULL))){
+    case FRESH_STALE_OK:
+        refresh_start(rq, pb);
+        return pb;
+    case FRESH_OK:
+        return pb;
+    }
+    if(revalidate){     // asks for all of it : the client's range goes too
+        rq -> stale = pb;
+        fresh_conditional(rq, pb);
+        free(rq -> range);
+        rq -> range = NULL;
+    }
+    else pbuf_unpin(pb);
+    return NULL;
+}
+
+/* Answer rq from pinned pb : the ranges it asks for, if pb can serve them, else all of pb */
+int serve_cached(wbuf *out, request *rq, pbuf *pb){
+    rangeresp rr;
+
+    if(rq -> range && range_serve(pb, rq, &rr) == 0) return send_range(out, &rr);
+    return wbuf_add(out, pb -> data, pb -> size) == 0 ? wbuf_end(out) : -1;
+}
+
+/* Write a range answer, borrowing the pinned payload it points into, then free it */
+int send_range(wbuf *out, rangeresp *rr){
+    int i, rc = -1;
+
+    for(i = 0; i < rr -> niov; i++)
+        if(wbuf_add(out, rr -> iov[i].iov_base, rr -> iov[i].iov_len) < 0) break;
+    if(i == rr -> niov) rc = wbuf_end(out);
+    range_free(rr);
+    return rc;
+}
+
+/*
+ * Answer a range miss from the cached pieces of its object, first
+ * fetching, with no client attached, the one span that holds all they
+ * lack of it, if that fits in an object. Returns 1 if rq was answered,
+ * -1 if the client is gone, 0 to pass the request through instead
+ */
+int range_fill(request *rq, wbuf *out){
+    pbuf *pb = range_lookup(rq);
+    rangeresp rr;
+    int rc;
+
+    if(pb == NULL) return 0;
+    if((rc = range_serve(pb, rq, &rr)) == RANGE_UNCOVERED && rr.need.last - rr.need.first < MAX_OBJECT_SIZE){
+        char *saved = rq -> out, *key;
+        size_t savedlen = rq -> outlen;
+        int leader, framed = 0;
+        wbuf none;
+
+        rq -> out = Malloc(savedlen);
+        memcpy(rq -> out, saved, savedlen);
+        if(range_request(rq, pb, rr.need)){
+            char range[64];
+            sprintf(range, "bytes=%zu-%zu", rr.need.first, rr.need.last);
+            key = range_key(range, rq -> filename);
+            wbuf_init(&none, -1);
+            flight *fl = join_flight(rq, key, &leader);
+            if(leader) fetch(rq, &none, fl, &framed);
+            else flight_leave(fl);
+            flight_release(fl);
+            free(key);
+        }
+        free(rq -> out);
+        rq -> out = saved;
+        rq -> outlen = savedlen;
+
+        /* the span is merged into the pieces, or the object changed and came back whole */
+        pbuf_unpin(pb);
+        if((pb = cache_lookup(rq, 0)) == NULL && (pb = range_lookup(rq)) == NULL) return 0;
+        rc = range_serve(pb, rq, &rr);
+    }
+    if(rc < 0){
+        pbuf_unpin(pb);
+        return 0;
+    }
+    rc = send_range(out, &rr);
+    pbuf_unpin(pb);
+    return rc < 0 ? -1 : 1;
+}
+
+/*
+ * Background refresh of a stale hit : a miss with no client, whose 304
+ * or new response lands in the cache. A fetch of it already in flight
+ * will do the same
+ */
+void refresh(request *rq){
+    wbuf none;
+    int leader, framed = 0;
+
+    wbuf_init(&none, -1);
+    flight *fl = join_flight(rq, rq -> filename, &leader);
+    if(leader) fetch(rq, &none, fl, &framed);
+    else flight_leave(fl);
+    flight_release(fl);
+}
+
+/*
+ * Cache a freshly fetched object, dropping any older copy the disk tier
+ * has. What the fetch took is the object's cost to the eviction policy
+ */
+void cache_store(request *rq, char *data, size_t len){
+    if(!fresh_storable(data, len) || (rq -> credentials && !fresh_shareable(data, len))) return;
+    unsigned long cost = rq -> started ? now_usec() - rq -> started : 0;
+    if(range_store(rq, data, len, cost)) return;    // a 206 : kept as pieces of the object
+    insert(caches, rq -> port, len, data, rq -> server, rq -> filename, cost);
+    disk_forget(rq -> port, rq -> server, rq -> filename);
+}
+
+/* Keep a copy of the response for the cache while it still fits in an object */
+void capture_append(capture *cp, char *data, size_t n){
+    cp -> total += n;
+    if(cp -> dropped) return;
+    if(cp -> len + n > MAX_OBJECT_SIZE){
+        capture_free(cp);
+        cp -> dropped = 1;
         return;
     }
+    capture_grow(cp, data, n);
+}
 
-    /* Miss : get from server */
-    sprintf(port, "%d", server_port);
-    int srcfd = Open_clientfd(server, port);
+/* Append to a capture whatever its size */
+void capture_grow(capture *cp, char *data, size_t n){
+    if(cp -> len + n > cp -> cap){
+        while(cp -> len + n > cp -> cap) cp -> cap = cp -> cap ? cp -> cap * 2 : MAXBUF;
+        if(cp -> cap > MAX_OBJECT_SIZE && cp -> len + n <= MAX_OBJECT_SIZE) cp -> cap = MAX_OBJECT_SIZE;
+        cp -> data = Realloc(cp -> data, cp -> cap);
+    }
+    memcpy(cp -> data + cp -> len, data, n);
+    cp -> len += n;
+}
 
-    sprintf(buf, "GET /%s HTTP/1.0\r\n%s", filename, header);
-    Rio_writen(srcfd, buf, strlen(buf));    // send header to server
+void capture_free(capture *cp){
+    free(cp -> data);
+    cp -> data = NULL;
+    cp -> len = cp -> cap = 0;
+}
 
-    Rio_readinitb(&server_rio, srcfd);
-    forward(&server_rio, connfd, server, &server_port, filename);   // get from server and forward to client
+/* Monotonic clock in usec, for measuring fetch latency */
+long long now_usec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-    Close(srcfd);
-    return;
+/*
+ * Responses leave in several writes(head, then body flushes) : without
+ * this, Nagle holds each tail back until the client's delayed ACK
+ */
+void set_nodelay(int fd){
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 }
 
-/* Read from server and forward(write) to client */
-void forward(rio_t *rio, int connfd, char *server, int *port, char *filename){
-	char buf[MAX_OBJECT_SIZE], payload[MAX_OBJECT_SIZE];
-    size_t size, read=0;
-	while ((size = Rio_readnb(rio, buf, MAXLINE))){
-		Rio_writen(connfd, buf, size);
-        memcpy(payload + read, buf, size);
-        read += size;
-	}
-    /* Save the payload in cache */
-    P(&mutex);
-    insert(caches, *port, read, payload, server, filename);
-    V(&mutex);
-	return;
-}
-
-/* Parser request uri and return server's port */
-int parse_uri(char* uri, char* server, char* filename) {
-    if (strstr(uri, "http://") != uri) {
-        fprintf(stderr, "Error: invalid uri!\n");
-        exit(0);
-    }
-    uri += strlen("http://");   // remove http://
-    int port;
-    char *file;
-    char *tmp;    
-    strncpy(server, uri, strpbrk(uri, ":/")-uri);
-    tmp = strchr(uri, ':');
-    file = strchr(uri, '/');
-    *file = '\0';
-    if(!tmp) port = 80; // default port : 80
-    else port = atoi(tmp+1);    // write speficied port
-    strcpy(filename, file+1);
-    return port;
-}
\ No newline at end of file
+/*
+ * Read one response from server and forward(write) it to client and fl's
+ * followers. The body is delimited by chunked encoding, Content-Length or
+ * EOF, so a keep-alive origin connection is left positioned at the next
+ * response. Hop-by-hop headers are dropped. The client's copy is gathered
+ * in out, so a response that arrives in one read leaves in one writev.
+ * *framed tells whether the client can find the end of the response
+ * without EOF
+ */
+int forward(rio_t *rio, wbuf *out, request *rq, flight *fl, int *framed){
+	char *line;
+    capture *cap = &fl -> cap;      // only this thread writes it, so reading it needs no lock
+    capture head = {0};             // a 304's head, to refresh the stale copy with
+    size_t headlen = 0;
+    ssize_t n;
+    long long length = -1;      // body length, -1 : until EOF
+    int minor = 0, status = 0, chunked = 0, conn_close = 0, conn_keep = 0, no_store = 0, rc;
+
+    /*
+     * Header lines are looked at in place in rio's buffer(each ends in '\n',
+     * which stops every scan below) and consumed once handled.
+     * Status line : an origin that closes before it is a stale pooled connection
+     */
+    if((n = next_line(rio, out, fl, &line)) <= 0) return FWD_STALE;
+    if(n < 13 || strncmp(line, "HTTP/1.", 7) || !isdigit((unsigned char)line[7]) || line[8] != ' ') return FWD_ERROR;
+    minor = line[7] - '0';
+    rq -> mark = stats_time(PH_TTFB, rq -> mark);
+    if((status = line_number(line + 8, 10)) < 0) return FWD_ERROR;
+    int merge = status == 304 && rq -> stale;   // our revalidation : the stale copy is still good
+    do{
+        if(line[n - 1] != '\n'){      // longer than rio's buffer, or cut short by EOF
+            capture_free(&head);
+            return FWD_ERROR;
+        }
+        rio_skipb(rio, n);      // line stays readable until the next peek
+        if(!strncasecmp(line, "Connection:", 11)){
+            conn_close = has_token(line + 11, "close");
+            conn_keep = has_token(line + 11, "keep-alive");
+        }
+        if(is_hop_header(line)) continue;
+        if(merge) capture_grow(&head, line, n);
+        else if(send_client(out, fl, line, n) < 0) return FWD_ERROR;
+        if(n == 2 && line[0] == '\r') break;
+        if(!strncasecmp(line, "Content-Length:", 15)) length = line_number(line + 15, 10);
+        else if(!strncasecmp(line, "Transfer-Encoding:", 18) && has_token(line + 18, "chunked")) chunked = 1;
+        else if(!strncasecmp(line, "Cache-Control:", 14))
+            no_store |= has_token(line + 14, "no-store") || has_token(line + 14, "private");
+    }while((n = next_line(rio, out, fl, &line)) > 0);
+    if(n <= 0){
+        capture_free(&head);
+        return FWD_ERROR;
+    }
+    headlen = cap -> len;
+
+    /* Known to be uncacheable : stop copying now so the whole body is spliced */
+    if(no_store || length > MAX_OBJECT_SIZE) flight_drop(fl);
+
+    /* Body */
+    if((status >= 100 && status < 200) || status == 204 || status == 304) length = 0;
+    if(merge){      // the refreshed copy is the response, and what gets cached
+        size_t len;
+        char *data = fresh_merge(rq -> stale, head.data, head.len, &len);
+        capture_free(&head);
+        rc = send_client(out, fl, data, len);
+        free(data);
+    }
+    else if(chunked) rc = relay_chunked(rio, out, fl);
+    else rc = relay(rio, out, fl, length);
+    if(rc < 0 || (wbuf_end(out) < 0 && !flight_shared(fl))) return FWD_ERROR;
+    stats_time(PH_BODY, rq -> mark);
+    *framed = merge || chunked || length >= 0;
+
+    /* Save the payload in cache, adding the length an EOF-delimited response lacked */
+    if(!cap -> dropped && !no_store && fl -> base == 0 && cap -> len <= MAX_OBJECT_SIZE){
+        if(*framed) cache_store(rq, cap -> data, cap -> len);
+        else{
+            size_t len;
+            char *data = frame_capture(cap, headlen, &len);
+            cache_store(rq, data, len);
+            free(data);
+        }
+    }
+
+    if((minor >= 1 ? conn_close : !conn_keep) || (!chunked && length < 0)) return FWD_DONE;
+    return rio -> rio_cnt == 0 ? FWD_KEEP : FWD_DONE;   // unsolicited extra bytes : don't reuse
+}
+
+/*
+ * Copy of an EOF-delimited response given a Content-Length, so it can be
+ * replayed from the cache on a persistent connection. Caller frees it
+ */
+char *frame_capture(capture *cp, size_t headlen, size_t *len){
+    char line[64];
+    int linelen = sprintf(line, "Content-Length: %zu\r\n", cp -> len - headlen);
+    char *data = Malloc(cp -> len + linelen);
+
+    /* headers without their terminating CRLF, our length line, the CRLF, the body */
+    memcpy(data, cp -> data, headlen - 2);
+    memcpy(data + headlen - 2, line, linelen);
+    memcpy(data + headlen - 2 + linelen, cp -> data + headlen - 2, cp -> len - headlen + 2);
+    *len = cp -> len + linelen;
+    return data;
+}
+
+/*
+ * Relay length body bytes(or up to EOF if length < 0) from server to client,
+ * straight out of rio's buffer. What is queued for the client goes out
+ * before waiting on the origin. Once the capture is dropped nothing needs
+ * to pass through user space, so past what rio already buffered the rest
+ * is spliced
+ */
+int relay(rio_t *rio, wbuf *out, flight *fl, long long length){
+    ssize_t n;
+    int *pfd;
+    while(length != 0){
+        if(rio -> rio_cnt <= 0){
+            if(flush_client(out, fl) < 0) return -1;
+            if(fl -> cap.dropped && out -> fd >= 0 && (pfd = worker_pipe())){
+                long long moved = relay_splice(rio -> rio_fd, out -> fd, pfd, length);
+                if(moved < 0) return -1;
+                fl -> cap.total += moved;
+                stats_add(ST_BYTES_OUT, moved);
+                return 0;
+            }
+            if((n = rio_fillb(rio)) < 0) return -1;
+            if(n == 0) return length < 0 ? 0 : -1;      // EOF is only fine when it delimits the body
+        }
+        size_t want = rio -> rio_cnt;
+        if(length >= 0 && (long long)want > length) want = length;
+        if(send_client(out, fl, rio -> rio_bufptr, want) < 0) return -1;
+        rio_skipb(rio, want);
+        if(length > 0) length -= want;
+    }
+    return 0;
+}
+
+/* Relay a chunked body : size line, data and CRLF per chunk, then the trailer */
+int relay_chunked(rio_t *rio, wbuf *out, flight *fl){
+	char *line;
+    ssize_t n;
+    while(1){
+        if((n = next_line(rio, out, fl, &line)) <= 0 || line[n - 1] != '\n') return -1;
+        rio_skipb(rio, n);
+        if(send_client(out, fl, line, n) < 0) return -1;
+        long long size = line_number(line, 16);
+        if(size < 0) return -1;
+        if(size == 0) break;
+        if(relay(rio, out, fl, size + 2) < 0) return -1;
+    }
+    do{     // trailer fields up to the final CRLF
+        if((n = next_line(rio, out, fl, &line)) <= 0 || line[n - 1] != '\n') return -1;
+        rio_skipb(rio, n);
+        if(send_client(out, fl, line, n) < 0) return -1;
+    }while(!(n == 2 && line[0] == '\r'));
+    return 0;
+}
+
+/*
+ * Peek the next line from the origin, first sending what is queued for the
+ * client when the line isn't buffered yet : nothing is held back from the
+ * client while waiting on the origin
+ */
+ssize_t next_line(rio_t *rio, wbuf *out, flight *fl, char **linep){
+    if((rio -> rio_cnt <= 0 || !rio_findnl(rio -> rio_bufptr, rio -> rio_cnt)) && flush_client(out, fl) < 0) return -1;
+    return rio_peeklineb(rio, linep);
+}
+
+/*
+ * The number at the start of a header value or chunk-size line, after
+ * blanks; -1 if there is none or it overflows. Never reads past the line
+ */
+long long line_number(char *p, int base){
+    long long v = 0;
+    int d, digits = 0;
+    while(*p == ' ' || *p == '\t') p++;
+    for(;; p++, digits++){
+        unsigned char c = *p;
+        if(isdigit(c)) d = c - '0';
+        else if(base == 16 && isxdigit(c)) d = tolower(c) - 'a' + 10;
+        else break;
+        if(v > (LLONG_MAX - d) / base) return -1;
+        v = v * base + d;
+    }
+    return digits ? v : -1;
+}
+
+/*
+ * Move length bytes(or up to EOF if length < 0) from srcfd to connfd through
+ * the worker's pipe without copying them into user space. Returns the
+ * bytes moved, -1 on error
+ */
+long long relay_splice(int srcfd, int connfd, int *pfd, long long length){
+    long long moved = 0;
+    ssize_t n, m;
+    while(length != 0){
+        size_t want = (length < 0 || length > SPLICE_CHUNK) ? SPLICE_CHUNK : (size_t)length;
+        if((n = splice(srcfd, NULL, pfd[1], NULL, want, SPLICE_F_MOVE)) < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(n == 0) return length < 0 ? moved : -1;     // EOF is only fine when it delimits the body
+        if(length > 0) length -= n;
+        moved += n;
+        /* hint that more follows only when it does, or the last segment waits on the cork */
+        unsigned int flags = SPLICE_F_MOVE | (length != 0 ? SPLICE_F_MORE : 0);
+        while(n > 0){
+            if((m = splice(pfd[0], NULL, connfd, NULL, n, flags)) <= 0){
+                if(m < 0 && errno == EINTR) continue;
+                /* bytes stranded in the pipe would leak into the next response */
+                Close(pfd[0]);
+                Close(pfd[1]);
+                pfd[0] = pfd[1] = -1;
+                return -1;
+            }
+            n -= m;
+        }
+    }
+    return moved;
+}
+
+/* This worker's pass-through pipe, created on first use; NULL means copy instead */
+int *worker_pipe(void){
+    if(splice_pipe[0] < 0 && pipe(splice_pipe) < 0){
+        splice_pipe[0] = splice_pipe[1] = -1;
+        return NULL;
+    }
+    return splice_pipe;
+}
+
+/*
+ * Hand response bytes to the flight(followers and the cache copy), then
+ * queue them for the client; buf may be overwritten once this returns. A
+ * leader whose client went away keeps going while others still follow
+ */
+int send_client(wbuf *out, flight *fl, char *buf, size_t n){
+    flight_append(fl, buf, n);
+    if(wbuf_put(out, buf, n) < 0 && !flight_shared(fl)) return -1;
+    return 0;
+}
+
+/* Write what is queued for the client, with the same leniency */
+int flush_client(wbuf *out, flight *fl){
+    if(wbuf_flush(out) < 0 && !flight_shared(fl)) return -1;
+    return 0;
+}
+
+/* Connection-scoped headers the proxy must not pass along */
+static char *hop_headers[] = {"Connection", "Proxy-Connection", "Keep-Alive", NULL};
+
+int is_hop_header(char *line){
+    char **h;
+    for(h = hop_headers; *h; h++)
+        if(!strncasecmp(line, *h, strlen(*h)) && line[strlen(*h)] == ':') return 1;
+    return 0;
+}
+
+int is_hop_name(char *buf, span name){
+    char **h;
+    for(h = hop_headers; *h; h++)
+        if(http_span_is(buf, name, *h)) return 1;
+    return 0;
+}
+
+/*
+ * Request headers that can make the origin answer one client differently
+ * from the next(a 304, a 412, a 200 instead of a 206, per-user content) :
+ * such a fetch is never shared through a flight
+ */
+static char *varying_headers[] = {"If-None-Match", "If-Modified-Since", "If-Match", "If-Unmodified-Since",
+    "If-Range", "Authorization", "Cookie", NULL};
+
+int is_varying_name(char *buf, span name){
+    char **h;
+    for(h = varying_headers; *h; h++)
+        if(http_span_is(buf, name, *h)) return 1;
+    return 0;
+}
+
+/* Whether a comma-separated header value(up to its line end) contains token(case-insensitive) */
+int has_token(char *value, char *token){
+    return http_has_token(value, strcspn(value, "\r\n"), token);
+}
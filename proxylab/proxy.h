@@ -0,0 +1,55 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "cache.h"
+#include "http.h"
+
+#define MAX_HEADER_SIZE 16384
+#define HOSTLEN 256
+#define SERVLEN 8
+
+/* A parsed client request, shared by every I/O engine */
+typedef struct request{
+    int port;
+    char *server;
+    char *filename;
+    char *out;          // rewritten request to send to the origin on a miss
+    size_t outlen;
+    int keepalive;      // client wants the connection kept open after the response
+    long long started;  // usec the origin fetch began, 0 if it hasn't
+    pbuf *stale;        // pinned cached copy out asks the origin to revalidate, NULL if none
+    char *range;        // the client's Range and If-Range values, NULL if it sent none
+    char *if_range;
+    int unshared;       // sent headers the origin may answer differently(validators, credentials)
+    int credentials;    // sent Authorization or Cookie : only responses marked shareable are stored or reused
+    int stats;          // asks for the proxy's own stats page(STATS_TEXT or STATS_JSON), 0 if not
+    long long mark;     // stats_now() at the start of the origin phase being timed
+} request;
+
+/* Copy of an origin response being collected for the cache */
+typedef struct capture{
+    char *data;
+    size_t len;
+    size_t cap;
+    int dropped;        // response outgrew MAX_OBJECT_SIZE, don't cache it
+    size_t total;       // bytes relayed from the origin, kept or not
+} capture;
+
+extern cache *caches;
+
+int parse_request(httpreq *hp, char *buf, request *rq, int keepalive);
+void free_request(request *rq);
+void request_rewrite(request *rq, char **drop, const char *extra);
+pbuf *cache_lookup(request *rq, int revalidate);
+void cache_store(request *rq, char *data, size_t len);
+int is_hop_header(char *line);
+int is_hop_name(char *buf, span name);
+int is_varying_name(char *buf, span name);
+int has_token(char *value, char *token);
+void capture_append(capture *cp, char *data, size_t n);
+void capture_grow(capture *cp, char *data, size_t n);
+void capture_free(capture *cp);
+long long now_usec(void);
+void set_nodelay(int fd);
+
+#endif
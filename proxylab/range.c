@@ -0,0 +1,490 @@
+#include "csapp.h"
+#include "range.h"
+#include "fresh.h"
+
+/*
+ * Index of a partial object, the pieces of one object its 206s brought
+ * in. Its cache entry holds the last 206's head(less Content-Range and
+ * Content-Length), this index, then the bytes of each span in order
+ */
+typedef struct partial{
+    size_t total;           // length of the whole object
+    int nspans;
+    byterange spans[PARTIAL_SPANS];     // sorted, neither overlapping nor touching
+} partial;
+
+/* What ranges of a cached object can be answered from : a whole object is one span */
+typedef struct rview{
+    const char *head;
+    size_t headlen;         // blank line included
+    size_t total;
+    int nspans;
+    byterange spans[PARTIAL_SPANS];
+    const char *data[PARTIAL_SPANS];    // bytes of each span
+    int partial;
+} rview;
+
+/* A span of bytes to store, with where they are now */
+typedef struct piece{
+    byterange r;
+    const char *data;
+} piece;
+
+/* updated with atomics by every worker */
+static unsigned long served, multipart, unsatisfiable, from_pieces, pieces_stored, gaps;
+static unsigned long boundaries;
+
+static int status_of(const char *resp, size_t len);
+static size_t head_end(const char *resp, size_t len);
+static int view_of(pbuf *pb, rview *v);
+static int if_range_holds(request *rq, rview *v);
+static int same_object(const char *a, size_t alen, const char *b, size_t blen);
+static void uncovered(rview *v, byterange *r, int n, byterange *need);
+static int build(rangeresp *rr, rview *v, byterange *r, const char **at, int n);
+static char *partial_key(const char *filename);
+static void flat_free(pbuf *pb);
+
+/*
+ * Ranges a Range header value asks of a size-byte object(RFC 9110 14.1.2),
+ * into r. Returns how many are satisfiable, which may be 0, or RANGE_IGNORE
+ * if the header is malformed, not in bytes, or asks for more than RANGE_MAX
+ */
+int range_parse(const char *value, size_t size, byterange *r){
+    const char *p = value;
+    char *end;
+    int n = 0;
+
+    if(strncasecmp(p, "bytes=", 6)) return RANGE_IGNORE;
+    p += 6;
+    while(1){
+        size_t first = 0, last = 0;
+        int has_first, has_last;
+
+        while(*p == ' ' || *p == '\t') p++;
+        if((has_first = isdigit((unsigned char)*p))){
+            first = strtoull(p, &end, 10);
+            p = end;
+        }
+        if(*p++ != '-') return RANGE_IGNORE;
+        if((has_last = isdigit((unsigned char)*p))){
+            last = strtoull(p, &end, 10);
+            p = end;
+        }
+        if(!has_first && !has_last) return RANGE_IGNORE;
+        if(has_first && has_last && last < first) return RANGE_IGNORE;
+
+        if(!has_first){     // suffix : the last `last` bytes
+            if(last > 0 && size > 0){
+                if(n == RANGE_MAX) return RANGE_IGNORE;
+                r[n].first = last >= size ? 0 : size - last;
+                r[n++].last = size - 1;
+            }
+        }
+        else if(first < size){
+            if(n == RANGE_MAX) return RANGE_IGNORE;
+            r[n].first = first;
+            r[n++].last = (!has_last || last >= size) ? size - 1 : last;
+        }
+        while(*p == ' ' || *p == '\t') p++;
+        if(*p == '\0') return n;
+        if(*p++ != ',') return RANGE_IGNORE;
+    }
+}
+
+/*
+ * Answer rq's Range from pinned pb into rr : a 206, single part or
+ * multipart/byteranges, or a 416 if no range is satisfiable. Returns 0
+ * once rr is ready(range_free() it after the write), RANGE_IGNORE if
+ * the whole object should be sent instead(no Range, a failed If-Range,
+ * an object that isn't a plain 200), or RANGE_UNCOVERED with rr -> need
+ * spanning what partial pb lacks
+ */
+int range_serve(pbuf *pb, request *rq, rangeresp *rr){
+    byterange r[RANGE_MAX];
+    const char *at[RANGE_MAX];
+    rview v;
+    int i, k, n;
+
+    rr -> text = NULL;
+    rr -> niov = 0;
+    rr -> len = 0;
+    if(rq -> range == NULL || view_of(pb, &v) < 0 || !if_range_holds(rq, &v)) return RANGE_IGNORE;
+    if((n = range_parse(rq -> range, v.total, r)) == RANGE_IGNORE) return RANGE_IGNORE;
+    if(n == 0){
+        rr -> text = Malloc(128);
+        rr -> len = sprintf(rr -> text, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n", v.total);
+        rr -> iov[0].iov_base = rr -> text;
+        rr -> iov[0].iov_len = rr -> len;
+        rr -> niov = 1;
+        __atomic_fetch_add(&unsatisfiable, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    /* spans never touch, so a range held at all is held by one of them */
+    for(i = 0; i < n; i++){
+        for(k = 0; k < v.nspans; k++)
+            if(v.spans[k].first <= r[i].first && r[i].last <= v.spans[k].last) break;
+        if(k == v.nspans){
+            uncovered(&v, r, n, &rr -> need);
+            return RANGE_UNCOVERED;
+        }
+        at[i] = v.data[k] + (r[i].first - v.spans[k].first);
+    }
+    if(v.partial) __atomic_fetch_add(&from_pieces, 1, __ATOMIC_RELAXED);
+    return build(rr, &v, r, at, n);
+}
+
+void range_free(rangeresp *rr){
+    free(rr -> text);
+    rr -> text = NULL;
+}
+
+/*
+ * Flight key of a range miss : unlike the filename a whole fetch goes
+ * by, so a 206 is never replayed to a client that wanted all of it or
+ * other bytes. Control characters can't appear in a request target,
+ * so no client request collides with it. Caller frees it
+ */
+char *range_key(const char *range, const char *filename){
+    char *key = Malloc(strlen(range) + strlen(filename) + 3);
+    sprintf(key, "\x01%s\x01%s", range, filename);
+    return key;
+}
+
+/*
+ * Make rq's origin request ask for only need of the object partial pb
+ * has pieces of, if it is still that object : one that changed comes
+ * back whole. Returns 0, leaving rq alone, if pb has no validator to
+ * ask that with, as its pieces couldn't be told to belong together
+ */
+int range_request(request *rq, pbuf *pb, byterange need){
+    static char *drop[] = {"Range", "If-Range", NULL};
+    char extra[MAXLINE];
+    hline h;
+    int len;
+
+    if(!(http_find_header(pb -> data, pb -> size, "ETag", 4, &h) && h.valuelen > 0 && h.value[0] == '"')
+        && !http_find_header(pb -> data, pb -> size, "Last-Modified", 13, &h)) return 0;
+    if(h.valuelen > MAXLINE / 2) return 0;
+    len = sprintf(extra, "Range: bytes=%zu-%zu\r\n", need.first, need.last);
+    sprintf(extra + len, "If-Range: %.*s\r\n", (int)h.valuelen, h.value);
+    request_rewrite(rq, drop, extra);
+    __atomic_fetch_add(&gaps, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * The pieces of rq's object cached so far, pinned, or NULL if there are
+ * none still fresh enough to serve. Pieces are never refreshed in the
+ * background : once stale, the next 206 starts them over
+ */
+pbuf *range_lookup(request *rq){
+    char *key = partial_key(rq -> filename);
+    pbuf *pb = get_payload(caches, rq -> port, rq -> server, key);
+
+    free(key);
+    if(pb && (fresh_state(pb, time(NULL)) == FRESH_STALE || (rq -> credentials && !fresh_shareable(pb -> data, pb -> size)))){
+        pbuf_unpin(pb);
+        return NULL;
+    }
+    return pb;
+}
+
+/*
+ * Keep a single-part 206 as pieces of its object, merged with the pieces
+ * of the same object(by validator and length) already cached; pieces of
+ * another object, or more than fit in an entry, are dropped for the new
+ * one. Returns 0 if data isn't a 206, for the caller to cache as a whole
+ */
+int range_store(request *rq, char *data, size_t len, unsigned long cost){
+    size_t headlen = head_end(data, len), total, first, last, outhead, bytes, off;
+    char value[96], tail, *key, *out;
+    piece pieces[PARTIAL_SPANS + 1];
+    partial ix;
+    rview v;
+    hline h;
+    int i, k, n = 0;
+
+    if(status_of(data, len) != 206) return 0;
+    if(!http_find_header(data, headlen, "Content-Range", 13, &h) || h.valuelen >= sizeof(value))
+        return 1;       // multipart : not worth taking apart
+    memcpy(value, h.value, h.valuelen);
+    value[h.valuelen] = '\0';
+    if(sscanf(value, "bytes %zu-%zu/%zu%c", &first, &last, &total, &tail) != 3
+        || last < first || last >= total || len - headlen != last - first + 1) return 1;
+
+    key = partial_key(rq -> filename);
+    pbuf *old = get_payload(caches, rq -> port, rq -> server, key);
+    if(old && fresh_state(old, time(NULL)) != FRESH_STALE && view_of(old, &v) == 0 && v.partial
+        && v.total == total && same_object(v.head, v.headlen, data, headlen))
+        for(n = 0; n < v.nspans; n++){
+            pieces[n].r = v.spans[n];
+            pieces[n].data = v.data[n];
+        }
+    pieces[n].r.first = first;      // last, so it wins where pieces overlap
+    pieces[n].r.last = last;
+    pieces[n++].data = data + headlen;
+
+    /* the origin's head, for freshness and the headers of what is served from it */
+    out = Malloc(headlen);
+    const char *p = http_head_start(data, headlen);
+    outhead = p - data;
+    memcpy(out, data, outhead);
+    while(http_next_header(&p, data + headlen, &h)){
+        if((h.namelen == 13 && !strncasecmp(h.name, "Content-Range", 13))
+            || (h.namelen == 14 && !strncasecmp(h.name, "Content-Length", 14))) continue;
+        memcpy(out + outhead, h.line, h.len);
+        outhead += h.len;
+    }
+    memcpy(out + outhead, "\r\n", 2);
+    outhead += 2;
+
+    /* spans : the pieces sorted, those overlapping or touching merged */
+    while(1){
+        byterange sorted[PARTIAL_SPANS + 1];
+        for(i = 0; i < n; i++){
+            for(k = i; k > 0 && sorted[k - 1].first > pieces[i].r.first; k--) sorted[k] = sorted[k - 1];
+            sorted[k] = pieces[i].r;
+        }
+        ix.total = total;
+        ix.nspans = 0;
+        for(i = 0, bytes = 0; i < n; i++){
+            if(ix.nspans > 0 && sorted[i].first <= ix.spans[ix.nspans - 1].last + 1){
+                byterange *cur = &ix.spans[ix.nspans - 1];
+                if(sorted[i].last > cur -> last){
+                    bytes += sorted[i].last - cur -> last;
+                    cur -> last = sorted[i].last;
+                }
+                continue;
+            }
+            if(ix.nspans == PARTIAL_SPANS) break;
+            ix.spans[ix.nspans++] = sorted[i];
+            bytes += sorted[i].last - sorted[i].first + 1;
+        }
+        if(n == 1 || (i == n && outhead + sizeof(ix) + bytes <= MAX_OBJECT_SIZE)) break;
+        pieces[0] = pieces[n - 1];      // too much to keep together : only the new piece
+        n = 1;
+    }
+
+    out = Realloc(out, outhead + sizeof(ix) + bytes);
+    memcpy(out + outhead, &ix, sizeof(ix));
+    for(i = 0; i < n; i++){
+        for(k = 0, off = outhead + sizeof(ix); ix.spans[k].last < pieces[i].r.first; k++)
+            off += ix.spans[k].last - ix.spans[k].first + 1;
+        memcpy(out + off + (pieces[i].r.first - ix.spans[k].first), pieces[i].data,
+            pieces[i].r.last - pieces[i].r.first + 1);
+    }
+    insert(caches, rq -> port, outhead + sizeof(ix) + bytes, out, rq -> server, key, cost);
+    __atomic_fetch_add(&pieces_stored, 1, __ATOMIC_RELAXED);
+    pbuf_unpin(old);
+    free(out);
+    free(key);
+    return 1;
+}
+
+/*
+ * rq's answer from pinned pb, for the event loops, which send a single
+ * buffer : pb itself, or the 206 or 416 built from it in a buffer of its
+ * own(pb unpinned). NULL, pb unpinned, if pb is pieces that can't answer
+ */
+pbuf *range_apply(request *rq, pbuf *pb){
+    rangeresp rr;
+    int i;
+
+    if(range_serve(pb, rq, &rr) < 0){
+        if(status_of(pb -> data, pb -> size) != 206) return pb;
+        pbuf_unpin(pb);
+        return NULL;
+    }
+    pbuf *flat = Malloc(sizeof(pbuf) + rr.len);
+    memset(flat, 0, sizeof(pbuf));
+    flat -> refs = 1;
+    flat -> data = (char *)(flat + 1);
+    flat -> release = flat_free;
+    for(i = 0; i < rr.niov; i++){
+        memcpy(flat -> data + flat -> size, rr.iov[i].iov_base, rr.iov[i].iov_len);
+        flat -> size += rr.iov[i].iov_len;
+    }
+    range_free(&rr);
+    pbuf_unpin(pb);
+    return flat;
+}
+
+void range_report(FILE *fp){
+    fprintf(fp, "range: %lu served(%lu multipart, %lu from pieces), %lu unsatisfiable, %lu pieces stored, %lu gaps fetched\n",
+        __atomic_load_n(&served, __ATOMIC_RELAXED), __atomic_load_n(&multipart, __ATOMIC_RELAXED),
+        __atomic_load_n(&from_pieces, __ATOMIC_RELAXED), __atomic_load_n(&unsatisfiable, __ATOMIC_RELAXED),
+        __atomic_load_n(&pieces_stored, __ATOMIC_RELAXED), __atomic_load_n(&gaps, __ATOMIC_RELAXED));
+}
+
+/* Status code of a stored response, 0 if its status line is unreadable */
+static int status_of(const char *resp, size_t len){
+    if(len < 12 || strncmp(resp, "HTTP/1.", 7) || resp[8] != ' ') return 0;
+    return atoi(resp + 9);
+}
+
+/* Length of resp's head, its blank line included */
+static size_t head_end(const char *resp, size_t len){
+    const char *p = http_head_start(resp, len);
+    hline h;
+    while(http_next_header(&p, resp + len, &h))
+        ;
+    return p - resp;
+}
+
+/*
+ * Spans of pb to answer ranges from : the index of pieces, or all of a
+ * plain 200's body. -1 if the body might not be the object's bytes
+ * as they are(chunked, or an error page)
+ */
+static int view_of(pbuf *pb, rview *v){
+    int i, status = status_of(pb -> data, pb -> size);
+    hline h;
+
+    v -> head = pb -> data;
+    v -> headlen = head_end(pb -> data, pb -> size);
+    if((v -> partial = status == 206)){
+        partial ix;
+        if(v -> headlen + sizeof(ix) > pb -> size) return -1;
+        memcpy(&ix, pb -> data + v -> headlen, sizeof(ix));     // the index may sit unaligned
+        const char *p = pb -> data + v -> headlen + sizeof(ix);
+        v -> total = ix.total;
+        v -> nspans = ix.nspans;
+        for(i = 0; i < ix.nspans; i++){
+            v -> spans[i] = ix.spans[i];
+            v -> data[i] = p;
+            p += ix.spans[i].last - ix.spans[i].first + 1;
+        }
+        return 0;
+    }
+    if(status != 200 || !http_find_header(v -> head, v -> headlen, "Content-Length", 14, &h)
+        || http_find_header(v -> head, v -> headlen, "Transfer-Encoding", 17, &h)) return -1;
+    v -> total = pb -> size - v -> headlen;
+    v -> nspans = v -> total > 0;
+    v -> spans[0].first = 0;
+    v -> spans[0].last = v -> total - 1;
+    v -> data[0] = v -> head + v -> headlen;
+    return 0;
+}
+
+/*
+ * Whether rq's If-Range, if any, names the cached object : its strong
+ * ETag, or its Last-Modified date. Otherwise it must get all of it
+ */
+static int if_range_holds(request *rq, rview *v){
+    size_t len;
+    hline h;
+
+    if(rq -> if_range == NULL) return 1;
+    len = strlen(rq -> if_range);
+    if(rq -> if_range[0] == '"')
+        return http_find_header(v -> head, v -> headlen, "ETag", 4, &h)
+            && h.valuelen == len && !memcmp(h.value, rq -> if_range, len);
+    if(rq -> if_range[0] == 'W') return 0;      // weak tags never match
+    time_t date = http_date(rq -> if_range, len);
+    return date >= 0 && http_find_header(v -> head, v -> headlen, "Last-Modified", 13, &h)
+        && http_date(h.value, h.valuelen) == date;
+}
+
+/* Whether two heads are of the same version of an object, going by strong ETag, else Last-Modified */
+static int same_object(const char *a, size_t alen, const char *b, size_t blen){
+    hline x, y;
+    int hx = http_find_header(a, alen, "ETag", 4, &x), hy = http_find_header(b, blen, "ETag", 4, &y);
+
+    if(hx || hy)
+        return hx && hy && x.valuelen == y.valuelen && x.valuelen > 0 && x.value[0] == '"'
+            && !memcmp(x.value, y.value, x.valuelen);
+    return http_find_header(a, alen, "Last-Modified", 13, &x) && http_find_header(b, blen, "Last-Modified", 13, &y)
+        && x.valuelen == y.valuelen && !memcmp(x.value, y.value, x.valuelen);
+}
+
+/* need : from the first byte of r no span of v holds to the last one */
+static void uncovered(rview *v, byterange *r, int n, byterange *need){
+    long long pos;
+    int i, k;
+
+    need -> first = (size_t)-1;
+    need -> last = 0;
+    for(i = 0; i < n; i++){
+        for(pos = r[i].first, k = 0; k < v -> nspans && (long long)v -> spans[k].first <= pos; k++)
+            if((long long)v -> spans[k].last >= pos) pos = v -> spans[k].last + 1;
+        if(pos <= (long long)r[i].last && (size_t)pos < need -> first) need -> first = pos;
+        for(pos = r[i].last, k = v -> nspans - 1; k >= 0 && (long long)v -> spans[k].last >= pos; k--)
+            if((long long)v -> spans[k].first <= pos) pos = (long long)v -> spans[k].first - 1;
+        if(pos >= (long long)r[i].first && (size_t)pos > need -> last) need -> last = pos;
+    }
+}
+
+/*
+ * Lay out the 206 for ranges r of v, whose bytes are at at : the cached
+ * head less its framing, then one Content-Range, or a multipart/byteranges
+ * body whose parts each carry the object's Content-Type
+ */
+static int build(rangeresp *rr, rview *v, byterange *r, const char **at, int n){
+    const char *p = http_head_start(v -> head, v -> headlen), *end = v -> head + v -> headlen;
+    hline h, type = {0};
+    char boundary[24];
+    size_t off = 0, body = 0;
+    int i;
+
+    if(!http_find_header(v -> head, v -> headlen, "Content-Type", 12, &type)) type.valuelen = 0;
+    rr -> text = Malloc(v -> headlen + n * (type.valuelen + 128) + 256);
+
+    /* multipart body pieces first : the head's Content-Length needs their sizes */
+    if(n > 1){
+        sprintf(boundary, "%016lx", __atomic_add_fetch(&boundaries, 1, __ATOMIC_RELAXED) * 0x9e3779b97f4a7c15UL);
+        for(i = 0; i < n; i++){
+            char *part = rr -> text + off;
+            off += sprintf(part, "\r\n--%s\r\n", boundary);
+            if(type.valuelen) off += sprintf(rr -> text + off, "Content-Type: %.*s\r\n", (int)type.valuelen, type.value);
+            off += sprintf(rr -> text + off, "Content-Range: bytes %zu-%zu/%zu\r\n\r\n", r[i].first, r[i].last, v -> total);
+            rr -> iov[1 + 2 * i].iov_base = part;
+            rr -> iov[1 + 2 * i].iov_len = rr -> text + off - part;
+            rr -> iov[2 + 2 * i].iov_base = (void *)at[i];
+            rr -> iov[2 + 2 * i].iov_len = r[i].last - r[i].first + 1;
+            body += rr -> iov[1 + 2 * i].iov_len + rr -> iov[2 + 2 * i].iov_len;
+        }
+        rr -> iov[1 + 2 * n].iov_base = rr -> text + off;
+        rr -> iov[1 + 2 * n].iov_len = sprintf(rr -> text + off, "\r\n--%s--\r\n", boundary);
+        body += rr -> iov[1 + 2 * n].iov_len;
+        off += rr -> iov[1 + 2 * n].iov_len;
+        rr -> niov = 2 * n + 2;
+        __atomic_fetch_add(&multipart, 1, __ATOMIC_RELAXED);
+    }
+    else{
+        rr -> iov[1].iov_base = (void *)at[0];
+        rr -> iov[1].iov_len = body = r[0].last - r[0].first + 1;
+        rr -> niov = 2;
+    }
+
+    char *head = rr -> text + off;
+    off += sprintf(head, "HTTP/1.1 206 Partial Content\r\n");
+    while(http_next_header(&p, end, &h)){
+        if((h.namelen == 14 && !strncasecmp(h.name, "Content-Length", 14))
+            || (h.namelen == 13 && !strncasecmp(h.name, "Content-Range", 13))
+            || (h.namelen == 17 && !strncasecmp(h.name, "Transfer-Encoding", 17))
+            || (n > 1 && h.namelen == 12 && !strncasecmp(h.name, "Content-Type", 12))) continue;
+        memcpy(rr -> text + off, h.line, h.len);
+        off += h.len;
+    }
+    if(n > 1) off += sprintf(rr -> text + off, "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+    else off += sprintf(rr -> text + off, "Content-Range: bytes %zu-%zu/%zu\r\n", r[0].first, r[0].last, v -> total);
+    off += sprintf(rr -> text + off, "Content-Length: %zu\r\n\r\n", body);
+    rr -> iov[0].iov_base = head;
+    rr -> iov[0].iov_len = rr -> text + off - head;
+    rr -> len = rr -> iov[0].iov_len + body;
+    __atomic_fetch_add(&served, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Cache key of an object's pieces; see range_key() for why it can't collide. Caller frees it */
+static char *partial_key(const char *filename){
+    char *key = Malloc(strlen(filename) + 2);
+    sprintf(key, "\x01%s", filename);
+    return key;
+}
+
+static void flat_free(pbuf *pb){
+    free(pb);
+}
@@ -0,0 +1,45 @@
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include <stdio.h>
+#include <sys/uio.h>
+#include "proxy.h"
+
+#define RANGE_MAX 16            // ranges served from one request; more and the whole object is sent
+#define PARTIAL_SPANS 32        // disjoint spans one partial object keeps
+
+/* range_parse() and range_serve() results besides a count or 0 */
+#define RANGE_IGNORE (-1)       // no usable Range : answer with the whole object
+#define RANGE_UNCOVERED (-2)    // a partial object lacks some of the bytes asked for
+
+/* Bytes [first, last] of an object, both inclusive as in Content-Range */
+typedef struct byterange{
+    size_t first;
+    size_t last;
+} byterange;
+
+/*
+ * A 206 or 416 answer built from a cached object : its head and part
+ * headers live in text, its body pieces are borrowed from the pinned
+ * payload, ready for a gathered write. need is what a partial object
+ * lacked when range_serve() returned RANGE_UNCOVERED
+ */
+typedef struct rangeresp{
+    char *text;
+    struct iovec iov[2 * RANGE_MAX + 2];
+    int niov;
+    size_t len;             // sum of the iovecs
+    byterange need;
+} rangeresp;
+
+int range_parse(const char *value, size_t size, byterange *r);
+int range_serve(pbuf *pb, request *rq, rangeresp *rr);
+void range_free(rangeresp *rr);
+char *range_key(const char *range, const char *filename);
+int range_request(request *rq, pbuf *pb, byterange need);
+pbuf *range_lookup(request *rq);
+int range_store(request *rq, char *data, size_t len, unsigned long cost);
+pbuf *range_apply(request *rq, pbuf *pb);
+void range_report(FILE *fp);
+
+#endif
@@ -0,0 +1,78 @@
+#include "csapp.h"
+#include "sbuf.h"
+#include <time.h>
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n){
+    sp -> buf = Calloc(n, sizeof(int));
+    sp -> enq = Calloc(n, sizeof(struct timespec));
+    sp -> n = n;
+    sp -> front = sp -> rear = 0;
+    Sem_init(&sp -> mutex, 0, 1);
+    Sem_init(&sp -> slots, 0, n);
+    Sem_init(&sp -> items, 0, 0);
+    sp -> inserted = sp -> full = 0;
+    sp -> max_depth = 0;
+    sp -> total_wait_us = sp -> max_wait_us = 0;
+}
+
+/* Clean up buffer sp */
+void sbuf_deinit(sbuf_t *sp){
+    Free(sp -> buf);
+    Free(sp -> enq);
+}
+
+/* Insert item onto the rear of shared buffer sp; blocks(backpressure) while it is full */
+void sbuf_insert(sbuf_t *sp, int item){
+    if(sem_trywait(&sp -> slots) < 0){
+        P(&sp -> mutex);
+        sp -> full++;
+        V(&sp -> mutex);
+        P(&sp -> slots);
+    }
+    P(&sp -> mutex);
+    int slot = (++sp -> rear) % (sp -> n);
+    sp -> buf[slot] = item;
+    clock_gettime(CLOCK_MONOTONIC, &sp -> enq[slot]);
+    sp -> inserted++;
+    if((int)(sp -> rear - sp -> front) > sp -> max_depth) sp -> max_depth = sp -> rear - sp -> front;
+    V(&sp -> mutex);
+    V(&sp -> items);
+}
+
+/* Remove and return the first item from buffer sp, accounting its queue wait; its enqueue time goes in *enq */
+int sbuf_remove(sbuf_t *sp, struct timespec *enq){
+    struct timespec now;
+    P(&sp -> items);
+    P(&sp -> mutex);
+    int slot = (++sp -> front) % (sp -> n);
+    int item = sp -> buf[slot];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double wait = (now.tv_sec - sp -> enq[slot].tv_sec) * 1e6
+        + (now.tv_nsec - sp -> enq[slot].tv_nsec) / 1e3;
+    sp -> total_wait_us += wait;
+    if(wait > sp -> max_wait_us) sp -> max_wait_us = wait;
+    if(enq) *enq = sp -> enq[slot];
+    V(&sp -> mutex);
+    V(&sp -> slots);
+    return item;
+}
+
+/* Number of queued items not yet taken by a worker */
+int sbuf_depth(sbuf_t *sp){
+    P(&sp -> mutex);
+    int depth = sp -> rear - sp -> front;
+    V(&sp -> mutex);
+    return depth;
+}
+
+/* Print queue depth and wait time statistics */
+void sbuf_report(sbuf_t *sp, FILE *fp){
+    P(&sp -> mutex);
+    unsigned long removed = sp -> front;
+    fprintf(fp, "queue: depth %lu/%d (max %d), %lu accepted, %lu waited for a slot, "
+        "wait avg %.1f us max %.1f us\n",
+        sp -> rear - sp -> front, sp -> n, sp -> max_depth, sp -> inserted, sp -> full,
+        removed ? sp -> total_wait_us / removed : 0.0, sp -> max_wait_us);
+    V(&sp -> mutex);
+}
@@ -0,0 +1,32 @@
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+/* Bounded FIFO of connected descriptors shared by the accept loop and the workers */
+typedef struct {
+    int *buf;               // Buffer array
+    struct timespec *enq;   // Enqueue time of each slot
+    int n;                  // Maximum number of slots
+    unsigned long front;    // buf[(front+1)%n] is first item
+    unsigned long rear;     // buf[rear%n] is last item
+    sem_t mutex;            // Protects accesses to buf and the stats below
+    sem_t slots;            // Counts available slots
+    sem_t items;            // Counts available items
+
+    /* stats, read by sbuf_report */
+    unsigned long inserted;
+    unsigned long full;     // inserts that had to wait for a free slot
+    int max_depth;
+    double total_wait_us;
+    double max_wait_us;
+} sbuf_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp, struct timespec *enq);
+int sbuf_depth(sbuf_t *sp);
+void sbuf_report(sbuf_t *sp, FILE *fp);
+
+#endif
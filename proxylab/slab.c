@@ -0,0 +1,233 @@
+#include "csapp.h"
+#include "slab.h"
+
+#define OS_PAGE 4096
+#define HEADER_SIZE ((sizeof(slab) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+#define PAGE_OF(p) ((slab*)((unsigned long)(p) & ~(unsigned long)(SLAB_PAGE - 1)))
+
+static int class_of(arena *a, size_t size);
+static size_t span_size(size_t size);
+static slab *page_get(arena *a);
+static void page_put(arena *a, slab *pg);
+static void partial_link(sclass *c, slab *pg);
+static void partial_unlink(sclass *c, slab *pg);
+
+/* Create an empty arena : size classes from SLAB_MIN growing by SLAB_GROWTH % up to SLAB_MAX_CLASS */
+arena *arena_new(void){
+    arena *a = Calloc(1, sizeof(arena));
+    size_t size = SLAB_MIN;
+    /* the top class fills a page exactly, header included */
+    size_t max = ((SLAB_PAGE - HEADER_SIZE) / (SLAB_PAGE / SLAB_MAX_CLASS)) & ~(size_t)(SLAB_ALIGN - 1);
+
+    pthread_mutex_init(&a -> lock, NULL);
+    while(a -> nclasses < SLAB_CLASSES){
+        sclass *c = &a -> classes[a -> nclasses++];
+        pthread_mutex_init(&c -> lock, NULL);
+        c -> size = size;
+        c -> slots = (SLAB_PAGE - HEADER_SIZE) / size;
+        if(size >= max) break;
+        size = (size * SLAB_GROWTH / 100 + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+        if(size > max) size = max;
+    }
+    return a;
+}
+
+/* Allocate size bytes, SLAB_ALIGN aligned; NULL if out of memory */
+void *arena_alloc(arena *a, size_t size){
+    int i = class_of(a, size);
+    void *p;
+
+    if(i < 0){
+        p = mmap(NULL, span_size(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED) return NULL;
+        __atomic_add_fetch(&a -> span_bytes, span_size(size), __ATOMIC_RELAXED);
+        __atomic_add_fetch(&a -> used_bytes, span_size(size), __ATOMIC_RELAXED);
+        return p;
+    }
+
+    sclass *c = &a -> classes[i];
+    pthread_mutex_lock(&c -> lock);
+    slab *pg = c -> partial;
+    if(pg == NULL){
+        if((pg = page_get(a)) == NULL){
+            pthread_mutex_unlock(&c -> lock);
+            return NULL;
+        }
+        pg -> free = NULL;
+        pg -> carve = (char*)pg + HEADER_SIZE;
+        pg -> used = 0;
+        pg -> cls = i;
+        partial_link(c, pg);
+        c -> pages++;
+    }
+    if(pg -> free){
+        p = pg -> free;
+        pg -> free = *(void**)p;
+    }
+    else{
+        p = pg -> carve;
+        pg -> carve += c -> size;
+    }
+    if(++pg -> used == c -> slots) partial_unlink(c, pg);   // full
+    pthread_mutex_unlock(&c -> lock);
+    __atomic_add_fetch(&a -> used_bytes, c -> size, __ATOMIC_RELAXED);
+    return p;
+}
+
+/* Free p, allocated with the same size; its page goes back to the arena once empty */
+void arena_free(arena *a, void *p, size_t size){
+    if(p == NULL) return;
+    if(class_of(a, size) < 0){
+        munmap(p, span_size(size));
+        __atomic_sub_fetch(&a -> span_bytes, span_size(size), __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&a -> used_bytes, span_size(size), __ATOMIC_RELAXED);
+        return;
+    }
+
+    slab *pg = PAGE_OF(p);
+    sclass *c = &a -> classes[pg -> cls];
+    pthread_mutex_lock(&c -> lock);
+    *(void**)p = pg -> free;
+    pg -> free = p;
+    if(pg -> used-- == c -> slots) partial_link(c, pg);     // was full
+    if(pg -> used == 0){
+        partial_unlink(c, pg);
+        c -> pages--;
+    }
+    else pg = NULL;
+    pthread_mutex_unlock(&c -> lock);
+    __atomic_sub_fetch(&a -> used_bytes, c -> size, __ATOMIC_RELAXED);
+    if(pg) page_put(a, pg);
+}
+
+/* Bytes an allocation of size really takes : its class's slot, or whole OS pages for a span */
+size_t arena_charge(arena *a, size_t size){
+    int i = class_of(a, size);
+    return i < 0 ? span_size(size) : a -> classes[i].size;
+}
+
+/* Bytes of memory the arena keeps resident : live pages, the few kept empty ones, and spans */
+size_t arena_resident(arena *a){
+    pthread_mutex_lock(&a -> lock);
+    size_t pages = (size_t)a -> nchunks * SLAB_CHUNK - a -> released;
+    size_t bytes = pages * SLAB_PAGE + a -> released * OS_PAGE;     // released pages keep their header
+    pthread_mutex_unlock(&a -> lock);
+    return bytes + __atomic_load_n(&a -> span_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Unmap every page at once. Whatever was allocated from the arena is gone
+ * with it, except spans, which must have been freed already
+ */
+void arena_destroy(arena *a){
+    int i;
+    for(i = 0; i < a -> nchunks; i++) munmap(a -> chunks[i], SLAB_CHUNK * SLAB_PAGE);
+    for(i = 0; i < a -> nclasses; i++) pthread_mutex_destroy(&a -> classes[i].lock);
+    pthread_mutex_destroy(&a -> lock);
+    free(a -> chunks);
+    free(a);
+}
+
+void arena_report(arena *a, FILE *fp){
+    unsigned long pages = 0;
+    int i;
+    for(i = 0; i < a -> nclasses; i++){
+        pthread_mutex_lock(&a -> classes[i].lock);
+        pages += a -> classes[i].pages;
+        pthread_mutex_unlock(&a -> classes[i].lock);
+    }
+    fprintf(fp, "slab: %zu KiB allocated, %zu KiB resident, %lu pages in use, %lu empty, %zu KiB in spans\n",
+        __atomic_load_n(&a -> used_bytes, __ATOMIC_RELAXED) >> 10, arena_resident(a) >> 10,
+        pages, a -> pooled + a -> released, __atomic_load_n(&a -> span_bytes, __ATOMIC_RELAXED) >> 10);
+}
+
+/* Smallest class that fits size, -1 if it needs a span */
+static int class_of(arena *a, size_t size){
+    int lo = 0, hi = a -> nclasses - 1;
+    if(size > a -> classes[hi].size) return -1;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(a -> classes[mid].size < size) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static size_t span_size(size_t size){
+    return (size + OS_PAGE - 1) & ~(size_t)(OS_PAGE - 1);
+}
+
+/* An empty page, resident ones first, mapping SLAB_CHUNK more aligned pages when there are none */
+static slab *page_get(arena *a){
+    size_t len = SLAB_CHUNK * SLAB_PAGE;
+    slab *pg;
+    int i;
+
+    pthread_mutex_lock(&a -> lock);
+    if(a -> pool == NULL && a -> idle == NULL){
+        /* over-map by a page, then trim to a SLAB_PAGE aligned run so PAGE_OF() finds headers */
+        char *m = mmap(NULL, len + SLAB_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(m == MAP_FAILED){
+            pthread_mutex_unlock(&a -> lock);
+            return NULL;
+        }
+        char *base = (char*)(((unsigned long)m + SLAB_PAGE - 1) & ~(unsigned long)(SLAB_PAGE - 1));
+        if(base > m) munmap(m, base - m);
+        munmap(base + len, m + len + SLAB_PAGE - (base + len));
+
+        if(a -> nchunks == a -> maxchunks){
+            a -> maxchunks = a -> maxchunks ? a -> maxchunks * 2 : 8;
+            a -> chunks = Realloc(a -> chunks, a -> maxchunks * sizeof(char*));
+        }
+        a -> chunks[a -> nchunks++] = base;
+        for(i = SLAB_CHUNK - 1; i >= 0; i--){   // only their headers are touched so far
+            pg = (slab*)(base + (size_t)i * SLAB_PAGE);
+            pg -> next = a -> idle;
+            a -> idle = pg;
+        }
+        a -> released += SLAB_CHUNK;
+    }
+    if((pg = a -> pool) != NULL){
+        a -> pool = pg -> next;
+        a -> pooled--;
+    }
+    else{
+        pg = a -> idle;
+        a -> idle = pg -> next;
+        a -> released--;
+    }
+    pthread_mutex_unlock(&a -> lock);
+    pg -> prev = pg -> next = NULL;
+    return pg;
+}
+
+/* Keep an empty page resident for reuse, or past SLAB_KEEP_PAGES hand all but its header back */
+static void page_put(arena *a, slab *pg){
+    pthread_mutex_lock(&a -> lock);
+    if(a -> pooled < SLAB_KEEP_PAGES){
+        pg -> next = a -> pool;
+        a -> pool = pg;
+        a -> pooled++;
+    }
+    else{
+        madvise((char*)pg + OS_PAGE, SLAB_PAGE - OS_PAGE, MADV_DONTNEED);
+        pg -> next = a -> idle;
+        a -> idle = pg;
+        a -> released++;
+    }
+    pthread_mutex_unlock(&a -> lock);
+}
+
+static void partial_link(sclass *c, slab *pg){
+    pg -> prev = NULL;
+    pg -> next = c -> partial;
+    if(c -> partial) c -> partial -> prev = pg;
+    c -> partial = pg;
+}
+
+static void partial_unlink(sclass *c, slab *pg){
+    if(pg -> prev) pg -> prev -> next = pg -> next;
+    else c -> partial = pg -> next;
+    if(pg -> next) pg -> next -> prev = pg -> prev;
+    pg -> prev = pg -> next = NULL;
+}
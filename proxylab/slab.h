@@ -0,0 +1,65 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdio.h>
+#include <pthread.h>
+
+#define SLAB_PAGE (32L << 10)       // bytes per slab page; pages are aligned to it
+#define SLAB_CHUNK 16               // pages mapped from the kernel at a time
+#define SLAB_ALIGN 16               // every slot size is a multiple of this
+#define SLAB_MIN 64                 // smallest size class
+#define SLAB_GROWTH 125             // each class is this % of the one below
+#define SLAB_MAX_CLASS (SLAB_PAGE / 4)  // larger allocations get a mapping of their own(a span)
+#define SLAB_CLASSES 32             // more than enough for MIN..MAX_CLASS at GROWTH
+#define SLAB_KEEP_PAGES 2           // empty pages kept resident; the rest are handed back
+
+/* Header at the start of every page : the page holds slots of one class */
+typedef struct slab{
+    struct slab *prev;
+    struct slab *next;      // on its class's partial list, or one of the arena's empty lists
+    void *free;             // freed slots, linked through their first word
+    char *carve;            // first never used slot, so pages are only touched as they fill
+    unsigned int used;      // slots handed out
+    int cls;
+} slab;
+
+/* One size class : pages with free slots, most recently freed into first */
+typedef struct sclass{
+    pthread_mutex_t lock;
+    size_t size;            // slot bytes
+    unsigned int slots;     // slots per page
+    slab *partial;
+    unsigned long pages;    // pages the class holds
+} sclass;
+
+/*
+ * Memory for cache nodes and payloads. Requests up to SLAB_MAX_CLASS are
+ * rounded up to a size class and served from that class's pages; bigger
+ * ones are rounded up to whole OS pages and mapped on their own. A page
+ * whose last slot is freed goes back to the arena, so classes don't hoard
+ * memory the workload moved away from
+ */
+typedef struct arena{
+    sclass classes[SLAB_CLASSES];
+    int nclasses;
+    pthread_mutex_t lock;   // guards the empty lists and the chunk list
+    slab *pool;             // empty pages kept resident, at most SLAB_KEEP_PAGES
+    slab *idle;             // empty pages handed back to the kernel but their header
+    unsigned long pooled;
+    unsigned long released; // on idle
+    char **chunks;          // every mapping of SLAB_CHUNK pages, for arena_destroy()
+    int nchunks;
+    int maxchunks;
+    size_t span_bytes;      // in span mappings
+    size_t used_bytes;      // slot and span bytes handed out
+} arena;
+
+arena *arena_new(void);
+void *arena_alloc(arena *a, size_t size);
+void arena_free(arena *a, void *p, size_t size);
+size_t arena_charge(arena *a, size_t size);
+size_t arena_resident(arena *a);
+void arena_destroy(arena *a);
+void arena_report(arena *a, FILE *fp);
+
+#endif
@@ -0,0 +1,194 @@
+#include "csapp.h"
+#include "cache.h"
+#include "snapshot.h"
+
+/* A node's key and pinned payload, taken under the read lock and written after it */
+typedef struct snapitem{
+    int port;
+    char *host;
+    char *filename;
+    pbuf *payload;
+} snapitem;
+
+static cache *snapcache;
+static char *snappath;
+
+static void *snapshot_thread(void *vargp);
+static size_t record_size(snaprec *rec);
+static int write_shard(FILE *fp, shard *s, unsigned long *count);
+
+/*
+ * Write every cached object to path, replacing it atomically : written
+ * to path.tmp first, synced, then renamed. Returns -1 on failure
+ */
+int snapshot_save(cache *c, char *path){
+    char tmp[MAXLINE];
+    snaphdr hdr = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0};
+    FILE *fp;
+    int i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if((fp = fopen(tmp, "w")) == NULL){
+        fprintf(stderr, "snapshot: can't create %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1) goto fail;
+    for(i = 0; i < c -> nshards; i++)
+        if(write_shard(fp, &c -> shards[i], &hdr.count) < 0) goto fail;
+
+    /* the count is only known now */
+    if(fseek(fp, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1) goto fail;
+    if(fflush(fp) != 0 || fsync(fileno(fp)) < 0) goto fail;
+    fclose(fp);
+    if(rename(tmp, path) < 0){
+        fprintf(stderr, "snapshot: can't rename %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    fprintf(stderr, "snapshot: saved %lu objects to %s\n", hdr.count, path);
+    return 0;
+
+fail:
+    fprintf(stderr, "snapshot: can't write %s: %s\n", tmp, strerror(errno));
+    fclose(fp);
+    unlink(tmp);
+    return -1;
+}
+
+/*
+ * Pin one shard's objects under its read lock, list by list from least to
+ * most recently used, then write them without holding it
+ */
+static int write_shard(FILE *fp, shard *s, unsigned long *count){
+    snapitem *items;
+    size_t n = 0, i;
+    node *nd;
+    int l, rc = 0;
+
+    pthread_rwlock_rdlock(&s -> lock);
+    items = Malloc((s -> count + 1) * sizeof(snapitem));
+    for(l = 0; l < CACHE_LISTS; l++){
+        nlist *ls = &s -> lists[l];
+        for(nd = ls -> end -> prev; nd != ls -> start; nd = nd -> prev){
+            if(nd -> payload == NULL) continue;
+            items[n].port = nd -> port;
+            items[n].host = strdup(nd -> host);
+            items[n].filename = strdup(nd -> filename);
+            items[n].payload = nd -> payload;
+            pbuf_pin(nd -> payload);
+            n++;
+        }
+    }
+    pthread_rwlock_unlock(&s -> lock);
+
+    for(i = 0; i < n; i++){
+        static char pad[SNAPSHOT_ALIGN];
+        if((items[i].payload = pbuf_open(items[i].payload)) == NULL){   // a cold one is saved inflated
+            free(items[i].host);
+            free(items[i].filename);
+            continue;
+        }
+        snaprec rec = {items[i].port, strlen(items[i].host) + 1, strlen(items[i].filename) + 1, items[i].payload -> size};
+        size_t padlen = record_size(&rec) - sizeof(rec) - rec.hostlen - rec.filelen - rec.size;
+        if(rc == 0 && (fwrite(&rec, sizeof(rec), 1, fp) != 1
+            || fwrite(items[i].host, rec.hostlen, 1, fp) != 1
+            || fwrite(items[i].filename, rec.filelen, 1, fp) != 1
+            || (rec.size && fwrite(items[i].payload -> data, rec.size, 1, fp) != 1)
+            || (padlen && fwrite(pad, padlen, 1, fp) != 1))) rc = -1;
+        if(rc == 0) (*count)++;
+        free(items[i].host);
+        free(items[i].filename);
+        pbuf_unpin(items[i].payload);
+    }
+    free(items);
+    return rc;
+}
+
+/*
+ * Map a snapshot and insert its objects in the order they were saved, so
+ * each shard's LRU order comes back. A missing file is an empty snapshot;
+ * a damaged one is loaded up to the damage. Returns the objects loaded
+ */
+long snapshot_load(cache *c, char *path){
+    struct stat st;
+    long loaded = 0;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0){
+        if(errno != ENOENT) fprintf(stderr, "snapshot: can't open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snaphdr)){
+        close(fd);
+        return 0;
+    }
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        fprintf(stderr, "snapshot: can't map %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    snaphdr *hdr = (snaphdr*)base;
+    size_t off = sizeof(snaphdr), end = st.st_size;
+    if(hdr -> magic != SNAPSHOT_MAGIC || hdr -> version != SNAPSHOT_VERSION){
+        fprintf(stderr, "snapshot: %s is not a version %d snapshot\n", path, SNAPSHOT_VERSION);
+        munmap(base, st.st_size);
+        return 0;
+    }
+    while((unsigned long)loaded < hdr -> count && off + sizeof(snaprec) <= end){
+        snaprec *rec = (snaprec*)(base + off);
+        char *host = (char*)(rec + 1), *filename = host + rec -> hostlen;
+        size_t len = record_size(rec);
+
+        if(rec -> size > MAX_OBJECT_SIZE || rec -> hostlen == 0 || rec -> filelen == 0 || len > end - off
+            || host[rec -> hostlen - 1] || filename[rec -> filelen - 1]) break;
+        insert(c, rec -> port, rec -> size, filename + rec -> filelen, host, filename, 0);
+        loaded++;
+        off += len;
+    }
+    if((unsigned long)loaded < hdr -> count)
+        fprintf(stderr, "snapshot: %s is damaged after %ld objects\n", path, loaded);
+    munmap(base, st.st_size);
+    return loaded;
+}
+
+static size_t record_size(snaprec *rec){
+    size_t n = sizeof(snaprec) + (size_t)rec -> hostlen + rec -> filelen + rec -> size;
+    return (n + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+}
+
+/*
+ * Take SIGTERM and SIGUSR2 from every thread : SIGUSR2 saves a snapshot,
+ * SIGTERM saves one and exits. Call before creating any other thread so
+ * they all inherit the blocked mask
+ */
+void snapshot_start(cache *c, char *path){
+    sigset_t mask;
+    pthread_t tid;
+
+    snapcache = c;
+    snappath = path;
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGUSR2);
+    if(pthread_sigmask(SIG_BLOCK, &mask, NULL) != 0) unix_error("pthread_sigmask error");
+    Pthread_create(&tid, NULL, snapshot_thread, NULL);
+}
+
+static void *snapshot_thread(void *vargp){
+    sigset_t mask;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGUSR2);
+    while(1){
+        if(sigwait(&mask, &sig) != 0) continue;
+        snapshot_save(snapcache, snappath);
+        if(sig == SIGTERM) exit(0);
+    }
+    return NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "cache.h"
+
+#define SNAPSHOT_MAGIC 0x50414e53u  // "SNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN 8            // records start aligned
+
+/* File header : count records follow, each shard list's from least to most recently used */
+typedef struct snaphdr{
+    unsigned int magic;
+    unsigned int version;
+    unsigned long count;
+} snaphdr;
+
+/* Record header : host and filename(with their NULs), the payload and padding follow it */
+typedef struct snaprec{
+    int port;
+    unsigned int hostlen;
+    unsigned int filelen;
+    size_t size;
+} snaprec;
+
+int snapshot_save(cache *c, char *path);
+long snapshot_load(cache *c, char *path);
+void snapshot_start(cache *c, char *path);
+
+#endif
@@ -0,0 +1,206 @@
+#include "csapp.h"
+#include "stats.h"
+#include "proxy.h"
+
+static tstats *all;                 // every thread's stats, pushed on first use, never freed
+static __thread tstats *mine;
+static long long started;           // stats_init() time, for the uptime
+
+static const char *phase_names[PH_COUNT] = {"first_byte", "lookup", "dns", "connect", "ttfb", "body"};
+static const char *counter_names[ST_COUNT] = {"requests", "hits", "misses", "bytes_in", "bytes_out"};
+
+static tstats *local(void);
+static int bucket_of(unsigned long v);
+static unsigned long bucket_top(int i);
+static unsigned long percentile(histogram *h, double q);
+static void collect(unsigned long *counters, histogram *phases);
+static void write_text(FILE *fp);
+static void write_json(FILE *fp);
+static void page_free(pbuf *pb);
+
+void stats_init(void){
+    started = stats_now();
+}
+
+/* Monotonic clock in ns, for phase timings */
+long long stats_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Owner-only update : a relaxed load and store, which readers see whole */
+static inline void bump(unsigned long *p, unsigned long n){
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+void stats_add(int counter, unsigned long n){
+    bump(&local() -> counters[counter], n);
+}
+
+/*
+ * Record the time since start(a stats_now() value; 0 records nothing)
+ * in phase's histogram. Returns now, so consecutive phases can chain
+ */
+long long stats_time(int phase, long long start){
+    long long now = stats_now();
+    if(start == 0 || now < start) return now;
+
+    histogram *h = &local() -> phases[phase];
+    unsigned long v = now - start;
+    bump(&h -> count, 1);
+    bump(&h -> sum, v);
+    bump(&h -> buckets[bucket_of(v)], 1);
+    if(v > h -> max) __atomic_store_n(&h -> max, v, __ATOMIC_RELAXED);
+    return now;
+}
+
+/* This thread's stats, registered the first time it records anything */
+static tstats *local(void){
+    if(mine) return mine;
+    mine = Calloc(1, sizeof(tstats));
+    mine -> next = __atomic_load_n(&all, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&all, &mine -> next, mine, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return mine;
+}
+
+/* Exact below STATS_SUB, then STATS_SUB buckets per power of two */
+static int bucket_of(unsigned long v){
+    if(v >= 1UL << STATS_MAX_BITS) v = (1UL << STATS_MAX_BITS) - 1;
+    if(v < STATS_SUB) return v;
+    int shift = 63 - __builtin_clzl(v) - STATS_SUB_BITS;
+    return shift * STATS_SUB + (v >> shift);
+}
+
+/* Largest value bucket i holds */
+static unsigned long bucket_top(int i){
+    if(i < STATS_SUB) return i;
+    int shift = i / STATS_SUB - 1;
+    unsigned long mant = i % STATS_SUB + STATS_SUB;
+    return ((mant + 1) << shift) - 1;
+}
+
+/* Upper bound of the bucket holding the q-th quantile, at most the largest value seen */
+static unsigned long percentile(histogram *h, double q){
+    unsigned long n = 0, total = 0;
+    int i;
+
+    for(i = 0; i < STATS_BUCKETS; i++) total += h -> buckets[i];
+    if(total == 0) return 0;
+    unsigned long rank = q * total + 0.5;
+    if(rank == 0) rank = 1;
+    for(i = 0; i < STATS_BUCKETS; i++)
+        if((n += h -> buckets[i]) >= rank) break;
+    unsigned long top = bucket_top(i);
+    return top < h -> max ? top : h -> max;
+}
+
+/* Sum every thread's stats; the copy is only as consistent as relaxed loads make it */
+static void collect(unsigned long *counters, histogram *phases){
+    tstats *t;
+    int i, j;
+
+    memset(counters, 0, ST_COUNT * sizeof(unsigned long));
+    memset(phases, 0, PH_COUNT * sizeof(histogram));
+    for(t = __atomic_load_n(&all, __ATOMIC_ACQUIRE); t; t = t -> next){
+        for(i = 0; i < ST_COUNT; i++) counters[i] += __atomic_load_n(&t -> counters[i], __ATOMIC_RELAXED);
+        for(i = 0; i < PH_COUNT; i++){
+            histogram *from = &t -> phases[i], *to = &phases[i];
+            unsigned long max = __atomic_load_n(&from -> max, __ATOMIC_RELAXED);
+            to -> count += __atomic_load_n(&from -> count, __ATOMIC_RELAXED);
+            to -> sum += __atomic_load_n(&from -> sum, __ATOMIC_RELAXED);
+            if(max > to -> max) to -> max = max;
+            for(j = 0; j < STATS_BUCKETS; j++) to -> buckets[j] += __atomic_load_n(&from -> buckets[j], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Which form of the stats page an origin-form uri asks for, 0 if it isn't the stats page */
+int stats_target(const char *uri, size_t len){
+    size_t n = strlen(STATS_PATH);
+    if(len < n || strncmp(uri, STATS_PATH, n)) return 0;
+    if(len == n) return STATS_TEXT;
+    if(uri[n] == '?'){      // ?format=json, ?json
+        for(; n + 4 <= len; n++) if(!strncmp(uri + n, "json", 4)) return STATS_JSON;
+        return STATS_TEXT;
+    }
+    if(len == n + 5 && !strncmp(uri + n, ".json", 5)) return STATS_JSON;
+    return 0;
+}
+
+/* The stats page as a whole HTTP response in a buffer of its own, freed by its last unpin */
+pbuf *stats_page(int format){
+    char *body = NULL, head[256];
+    size_t bodylen = 0;
+    FILE *fp = open_memstream(&body, &bodylen);
+
+    if(fp == NULL) unix_error("open_memstream error");
+    if(format == STATS_JSON) write_json(fp);
+    else write_text(fp);
+    fclose(fp);
+
+    int headlen = sprintf(head, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+        "Cache-Control: no-store\r\n\r\n", format == STATS_JSON ? "application/json" : "text/plain", bodylen);
+    pbuf *pb = Malloc(sizeof(pbuf) + headlen + bodylen);
+    memset(pb, 0, sizeof(pbuf));
+    pb -> refs = 1;
+    pb -> size = headlen + bodylen;
+    pb -> data = (char *)(pb + 1);
+    pb -> release = page_free;
+    memcpy(pb -> data, head, headlen);
+    memcpy(pb -> data + headlen, body, bodylen);
+    free(body);
+    return pb;
+}
+
+void stats_report(FILE *fp){
+    write_text(fp);
+}
+
+static void write_text(FILE *fp){
+    unsigned long counters[ST_COUNT];
+    histogram *phases = Malloc(PH_COUNT * sizeof(histogram));
+    cache_stats cs;
+    int i;
+
+    collect(counters, phases);
+    cache_totals(caches, &cs);
+    fprintf(fp, "stats: uptime %.1f s", (stats_now() - started) / 1e9);
+    for(i = 0; i < ST_COUNT; i++) fprintf(fp, ", %s %lu", counter_names[i], counters[i]);
+    fprintf(fp, ", evictions %lu\n", cs.evictions);
+    fprintf(fp, "%-12s %10s %10s %10s %10s %10s %10s %10s\n",
+        "phase(us)", "count", "mean", "p50", "p90", "p99", "p999", "max");
+    for(i = 0; i < PH_COUNT; i++){
+        histogram *h = &phases[i];
+        fprintf(fp, "%-12s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[i], h -> count,
+            h -> count ? h -> sum / 1e3 / h -> count : 0.0, percentile(h, 0.5) / 1e3, percentile(h, 0.9) / 1e3,
+            percentile(h, 0.99) / 1e3, percentile(h, 0.999) / 1e3, h -> max / 1e3);
+    }
+    free(phases);
+}
+
+static void write_json(FILE *fp){
+    unsigned long counters[ST_COUNT];
+    histogram *phases = Malloc(PH_COUNT * sizeof(histogram));
+    cache_stats cs;
+    int i;
+
+    collect(counters, phases);
+    cache_totals(caches, &cs);
+    fprintf(fp, "{\"uptime_s\":%.1f", (stats_now() - started) / 1e9);
+    for(i = 0; i < ST_COUNT; i++) fprintf(fp, ",\"%s\":%lu", counter_names[i], counters[i]);
+    fprintf(fp, ",\"evictions\":%lu,\"phases_us\":{", cs.evictions);
+    for(i = 0; i < PH_COUNT; i++){
+        histogram *h = &phases[i];
+        fprintf(fp, "%s\"%s\":{\"count\":%lu,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+            i ? "," : "", phase_names[i], h -> count, h -> count ? h -> sum / 1e3 / h -> count : 0.0,
+            percentile(h, 0.5) / 1e3, percentile(h, 0.9) / 1e3, percentile(h, 0.99) / 1e3,
+            percentile(h, 0.999) / 1e3, h -> max / 1e3);
+    }
+    fprintf(fp, "}}\n");
+}
+
+static void page_free(pbuf *pb){
+    free(pb);
+}
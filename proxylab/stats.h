@@ -0,0 +1,71 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include "cache.h"
+
+#define STATS_PATH "/__proxy_stats"     // origin-form request the proxy answers itself
+
+/*
+ * Log-linear(HDR style) latency histograms : values below STATS_SUB ns
+ * get a bucket each, past that every power of two is split into STATS_SUB
+ * buckets, so a percentile is within 1/STATS_SUB(~3%) of the truth.
+ * Values past 2^STATS_MAX_BITS ns(~18 min) land in the last bucket
+ */
+#define STATS_SUB_BITS 5
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 2) * STATS_SUB)
+
+/* stats_target() results */
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+/* Phases of a request that are timed */
+enum {
+    PH_FIRST_BYTE,      // accepted(or the next head read on a kept-alive connection) to first byte written
+    PH_LOOKUP,          // cache lookup, disk tier included
+    PH_DNS,             // origin name resolution
+    PH_CONNECT,         // origin connect
+    PH_TTFB,            // request sent to the origin until its status line
+    PH_BODY,            // status line until the end of the origin's response
+    PH_COUNT
+};
+
+/* Counters */
+enum {
+    ST_REQUESTS,
+    ST_HITS,            // answered from the cache, whole or from pieces
+    ST_MISSES,          // went to the origin
+    ST_BYTES_IN,        // read from origins
+    ST_BYTES_OUT,       // written to clients
+    ST_COUNT
+};
+
+typedef struct histogram{
+    unsigned long count;
+    unsigned long sum;          // ns
+    unsigned long max;
+    unsigned long buckets[STATS_BUCKETS];
+} histogram;
+
+/*
+ * One thread's statistics. Only the owning thread writes them, with
+ * plain relaxed stores(no locked instructions); readers add up every
+ * thread's copy
+ */
+typedef struct tstats{
+    unsigned long counters[ST_COUNT];
+    histogram phases[PH_COUNT];
+    struct tstats *next;
+} tstats;
+
+void stats_init(void);
+long long stats_now(void);
+void stats_add(int counter, unsigned long n);
+long long stats_time(int phase, long long start);
+int stats_target(const char *uri, size_t len);
+pbuf *stats_page(int format);
+void stats_report(FILE *fp);
+
+#endif
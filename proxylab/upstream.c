@@ -0,0 +1,179 @@
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "upstream.h"
+#include "dns.h"
+
+static upstream *table[UPSTREAM_BUCKETS];
+static sem_t mutex;
+static int total;       // idle connections over every origin
+static unsigned long opened, reused_count, expired, dead, crowded;
+
+static upstream *lookup(char *host, int port, int create);
+static void prune(upstream *up, time_t now, int probe);
+static void drop_oldest(void);
+static void *reaper(void *vargp);
+static int alive(int fd);
+
+/* Start the thread that sweeps the pool of origins nobody asks for anymore */
+void upstream_init(){
+    sigset_t all, prev;
+    pthread_t tid;
+
+    Sem_init(&mutex, 0, 1);
+    /* the reaper never handles signals : keep SIGUSR1 for the accept loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &prev);
+    Pthread_create(&tid, NULL, reaper, NULL);
+    Pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * Return a connection to host:port, borrowing an idle keep-alive one when
+ * the pool has a live one. *reused tells the caller a stale-connection
+ * failure is worth one retry on a fresh connection
+ */
+int upstream_get(char *host, int port, int *reused){
+    time_t now = time(NULL);
+    int fd = -1;
+
+    P(&mutex);
+    upstream *up = lookup(host, port, 0);
+    while(up && up -> nidle > 0 && fd < 0){
+        int i = --up -> nidle;      // most recently returned first
+        total--;
+        if(now - up -> since[i] >= UPSTREAM_IDLE_TIMEOUT){
+            close(up -> idle[i]);
+            expired++;
+        }
+        else if(!alive(up -> idle[i])){
+            close(up -> idle[i]);
+            dead++;
+        }
+        else fd = up -> idle[i];
+    }
+    if(fd >= 0) reused_count++;
+    V(&mutex);
+
+    *reused = (fd >= 0);
+    if(fd >= 0) return fd;
+
+    if((fd = dns_connect(host, port)) < 0) return -1;
+    P(&mutex);
+    opened++;
+    V(&mutex);
+    return fd;
+}
+
+/* Give a connection whose response was fully read back to the pool */
+void upstream_put(char *host, int port, int fd){
+    time_t now = time(NULL);
+
+    P(&mutex);
+    upstream *up = lookup(host, port, 1);
+    prune(up, now, 0);      // connections that idled out while nobody asked for this origin
+    if(up -> nidle < UPSTREAM_MAX_IDLE){
+        if(total == UPSTREAM_MAX_TOTAL) drop_oldest();
+        up -> idle[up -> nidle] = fd;
+        up -> since[up -> nidle++] = now;
+        total++;
+        fd = -1;
+    }
+    V(&mutex);
+    if(fd >= 0) Close(fd);      // pool for this origin is full
+}
+
+void upstream_report(FILE *fp){
+    P(&mutex);
+    fprintf(fp, "upstream: %lu opened, %lu reused, %lu idled out, %lu found closed, %lu closed for room, %d idle\n",
+        opened, reused_count, expired, dead, crowded, total);
+    V(&mutex);
+}
+
+/* Find(or create) the pool entry of host:port; caller holds mutex */
+static upstream *lookup(char *host, int port, int create){
+    unsigned int h = hash_key(port, host, "") & (UPSTREAM_BUCKETS - 1);
+    upstream *up;
+    for(up = table[h]; up; up = up -> next)
+        if(up -> port == port && !strcmp(up -> host, host)) return up;
+    if(!create) return NULL;
+    up = Calloc(1, sizeof(upstream));
+    up -> host = strdup(host);
+    up -> port = port;
+    up -> next = table[h];
+    table[h] = up;
+    return up;
+}
+
+/*
+ * Close up's connections that idled out, and if probe is set those the
+ * origin closed(left alone, they sit in CLOSE_WAIT); caller holds mutex
+ */
+static void prune(upstream *up, time_t now, int probe){
+    int i, j;
+    for(i = j = 0; i < up -> nidle; i++){
+        if(now - up -> since[i] >= UPSTREAM_IDLE_TIMEOUT){
+            close(up -> idle[i]);
+            expired++;
+            continue;
+        }
+        if(probe && !alive(up -> idle[i])){
+            close(up -> idle[i]);
+            dead++;
+            continue;
+        }
+        up -> idle[j] = up -> idle[i];
+        up -> since[j++] = up -> since[i];
+    }
+    total -= up -> nidle - j;
+    up -> nidle = j;
+}
+
+/* Make room in a full pool : close the connection idle the longest, whatever its origin; caller holds mutex */
+static void drop_oldest(void){
+    upstream *up, *old = NULL;
+    int h;
+    for(h = 0; h < UPSTREAM_BUCKETS; h++)
+        for(up = table[h]; up; up = up -> next)
+            if(up -> nidle && (old == NULL || up -> since[0] < old -> since[0])) old = up;
+    if(old == NULL) return;
+    close(old -> idle[0]);
+    memmove(old -> idle, old -> idle + 1, (old -> nidle - 1) * sizeof(int));
+    memmove(old -> since, old -> since + 1, (old -> nidle - 1) * sizeof(time_t));
+    old -> nidle--;
+    total--;
+    crowded++;
+}
+
+/* Every UPSTREAM_SWEEP seconds : prune every origin's connections, and free origins left with none */
+static void *reaper(void *vargp){
+    upstream **pp, *up;
+    int h;
+    while(1){
+        sleep(UPSTREAM_SWEEP);
+        time_t now = time(NULL);
+        P(&mutex);
+        for(h = 0; h < UPSTREAM_BUCKETS; h++){
+            for(pp = &table[h]; (up = *pp) != NULL; ){
+                prune(up, now, 1);
+                if(up -> nidle){
+                    pp = &up -> next;
+                    continue;
+                }
+                *pp = up -> next;
+                free(up -> host);
+                free(up);
+            }
+        }
+        V(&mutex);
+    }
+    return NULL;
+}
+
+/* An idle keep-alive socket is usable only if the origin hasn't closed it or sent junk */
+static int alive(int fd){
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
@@ -0,0 +1,27 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <stdio.h>
+
+#define UPSTREAM_BUCKETS 256
+#define UPSTREAM_MAX_IDLE 8         // idle keep-alive connections kept per (host, port)
+#define UPSTREAM_IDLE_TIMEOUT 30    // seconds an idle connection may sit in the pool
+#define UPSTREAM_MAX_TOTAL 256      // idle connections kept over every origin
+#define UPSTREAM_SWEEP 5            // seconds between sweeps of the whole pool
+
+/* Idle keep-alive connections to one origin, most recently used last */
+typedef struct upstream{
+    char *host;
+    int port;
+    int nidle;
+    int idle[UPSTREAM_MAX_IDLE];
+    time_t since[UPSTREAM_MAX_IDLE];
+    struct upstream *next;
+} upstream;
+
+void upstream_init();
+int upstream_get(char *host, int port, int *reused);
+void upstream_put(char *host, int port, int fd);
+void upstream_report(FILE *fp);
+
+#endif
@@ -0,0 +1,437 @@
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "uring.h"
+#include "dns.h"
+#include "range.h"
+#include "stats.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <poll.h>
+
+#define RING_ENTRIES 4096
+#define REQ_INIT_SIZE 1024
+
+/* user_data tags for completions that don't belong to a connection */
+#define UD_ACCEPT 0
+#define UD_IGNORE 1
+#define UD_DNS 2        // the dns box's eventfd became readable
+
+/* Connection states; each has exactly one operation in flight, but U_RESOLVE waits on the dns box */
+enum { U_READ_REQ, U_WRITE_HIT, U_RESOLVE, U_CONNECT, U_SEND_REQ, U_RECV_ORIGIN, U_SEND_CLIENT };
+
+/* Raw io_uring : the mmap'd submission and completion rings */
+typedef struct ring{
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;      // local tail, published to the kernel on submit
+    unsigned int to_submit;
+    int listenfd;
+    dnsbox box;                 // finished lookups of this ring's connections
+} ring;
+
+/* A client connection and the origin connection serving its miss */
+typedef struct uconn{
+    int state;
+    int clientfd;
+    int originfd;
+    char *req;              // client request head(s), grows up to MAX_HEADER_SIZE
+    size_t reqlen, reqcap;
+    size_t headlen;         // length of the first complete head in req
+    httpreq hp;             // that head, parsed in place as it arrives
+    request rq;             // parsed request, with the origin request in rq.out
+    size_t outoff;
+    pbuf *hit;              // pinned cache payload being sent to the client
+    size_t hitoff;
+    char *buf;              // origin bytes not yet sent to the client
+    size_t buflen, bufoff;
+    capture cap;            // response copy for the cache
+    dnswait dw;             // posted to the ring's box once the origin resolves
+    struct addrinfo *addrs; // origin addresses(dns_free)
+    struct addrinfo *addr;  // the address being connected to
+    long long start;        // stats_now() the request was asked for, 0 once its first byte is out
+} uconn;
+
+static void *ring_thread(void *vargp);
+static void ring_init(ring *r, int listenfd);
+static void ring_run(ring *r);
+static int ring_enter(ring *r, unsigned int to_submit, unsigned int min_complete);
+static struct io_uring_sqe *get_sqe(ring *r);
+static void prep(ring *r, int op, int fd, void *addr, unsigned int len, unsigned long long off, unsigned long long ud);
+static void submit_accept(ring *r);
+static void submit_close(ring *r, int fd);
+static void submit_dns(ring *r);
+static void conn_complete(ring *r, uconn *c, int res);
+static void conn_read(ring *r, uconn *c);
+static int conn_request(ring *r, uconn *c);
+static int conn_resolve(ring *r, uconn *c);
+static int conn_connect(ring *r, uconn *c);
+static void conn_close(ring *r, uconn *c);
+static void count_sent(uconn *c, int n);
+
+/* Serve listenfd from nrings io_uring threads; never returns */
+void uring_serve(int listenfd, int nrings){
+    int i;
+    pthread_t tid;
+    for(i = 0; i < nrings; i++){
+        ring *r = Malloc(sizeof(ring));
+        ring_init(r, listenfd);
+        if(i == nrings - 1){    // the calling thread runs the last ring
+            ring_run(r);
+        }
+        Pthread_create(&tid, NULL, ring_thread, r);
+        Pthread_detach(tid);
+    }
+}
+
+/* Report whether the kernel lets us create a ring at all */
+int uring_supported(){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, 1, &p);
+    if(fd < 0) return 0;
+    close(fd);
+    return 1;
+}
+
+static void *ring_thread(void *vargp){
+    ring_run((ring*)vargp);
+    return NULL;
+}
+
+/* Create a ring and map its submission queue, completion queue and sqe array */
+static void ring_init(ring *r, int listenfd){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if((r -> fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) < 0){
+        unix_error("io_uring_setup error");
+        exit(1);
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size) sq_size = cq_size;
+    char *sq = Mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP))
+        cq = Mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_CQ_RING);
+    r -> sqes = Mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r -> fd, IORING_OFF_SQES);
+
+    r -> sq_head = (unsigned int*)(sq + p.sq_off.head);
+    r -> sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+    r -> sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+    r -> sq_array = (unsigned int*)(sq + p.sq_off.array);
+    r -> cq_head = (unsigned int*)(cq + p.cq_off.head);
+    r -> cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+    r -> cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+    r -> cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r -> sq_entries = p.sq_entries;
+    r -> sqe_tail = *r -> sq_tail;
+    r -> to_submit = 0;
+    r -> listenfd = listenfd;
+    dnsbox_init(&r -> box);
+}
+
+/*
+ * Reap every available completion, letting handlers queue follow-up sqes,
+ * then submit the whole batch and wait for more in a single io_uring_enter
+ */
+static void ring_run(ring *r){
+    submit_accept(r);
+    submit_dns(r);
+    while(1){
+        if(ring_enter(r, r -> to_submit, 1) < 0 && errno != EINTR && errno != EBUSY)
+            unix_error("io_uring_enter error");
+
+        unsigned int head = *r -> cq_head;
+        unsigned int tail = __atomic_load_n(r -> cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++){
+            struct io_uring_cqe *cqe = &r -> cqes[head & *r -> cq_mask];
+            unsigned long long ud = cqe -> user_data;
+            int res = cqe -> res;
+            if(ud == UD_ACCEPT){
+                submit_accept(r);
+                if(res >= 0){
+                    uconn *c = Calloc(1, sizeof(uconn));
+                    set_nodelay(res);
+                    c -> state = U_READ_REQ;
+                    c -> clientfd = res;
+                    c -> originfd = -1;
+                    c -> start = stats_now();
+                    c -> dw.box = &r -> box;
+                    c -> dw.arg = c;
+                    http_init(&c -> hp);
+                    conn_read(r, c);
+                }
+                else if(res != -EINTR && res != -EAGAIN) fprintf(stderr, "Accept error: %s\n", strerror(-res));
+            }
+            else if(ud == UD_DNS){
+                dnswait *w, *next;
+                submit_dns(r);
+                for(w = dnsbox_take(&r -> box); w; w = next){
+                    next = w -> next;
+                    if(conn_resolve(r, w -> arg) < 0) conn_close(r, w -> arg);
+                }
+            }
+            else if(ud != UD_IGNORE) conn_complete(r, (uconn*)(unsigned long)ud, res);
+        }
+        __atomic_store_n(r -> cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* Publish queued sqes and optionally wait for completions */
+static int ring_enter(ring *r, unsigned int to_submit, unsigned int min_complete){
+    __atomic_store_n(r -> sq_tail, r -> sqe_tail, __ATOMIC_RELEASE);
+    int rc = syscall(__NR_io_uring_enter, r -> fd, to_submit, min_complete,
+        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(rc > 0) r -> to_submit -= rc;
+    return rc;
+}
+
+/* Next free sqe, flushing the queue to the kernel if it is full */
+static struct io_uring_sqe *get_sqe(ring *r){
+    while(r -> sqe_tail - __atomic_load_n(r -> sq_head, __ATOMIC_ACQUIRE) >= r -> sq_entries)
+        ring_enter(r, r -> to_submit, 0);
+    unsigned int idx = r -> sqe_tail & *r -> sq_mask;
+    struct io_uring_sqe *sqe = &r -> sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r -> sq_array[idx] = idx;
+    r -> sqe_tail++;
+    r -> to_submit++;
+    return sqe;
+}
+
+static void prep(ring *r, int op, int fd, void *addr, unsigned int len, unsigned long long off, unsigned long long ud){
+    struct io_uring_sqe *sqe = get_sqe(r);
+    sqe -> opcode = op;
+    sqe -> fd = fd;
+    sqe -> addr = (unsigned long)addr;
+    sqe -> len = len;
+    sqe -> off = off;
+    sqe -> user_data = ud;
+    if(op == IORING_OP_SEND) sqe -> msg_flags = MSG_NOSIGNAL;
+    if(op == IORING_OP_ACCEPT) sqe -> accept_flags = SOCK_CLOEXEC;
+}
+
+static void submit_accept(ring *r){
+    prep(r, IORING_OP_ACCEPT, r -> listenfd, NULL, 0, 0, UD_ACCEPT);
+}
+
+static void submit_close(ring *r, int fd){
+    prep(r, IORING_OP_CLOSE, fd, NULL, 0, 0, UD_IGNORE);
+}
+
+/* Wake up when resolver threads post to the box; re-armed after every completion */
+static void submit_dns(ring *r){
+    struct io_uring_sqe *sqe = get_sqe(r);
+    sqe -> opcode = IORING_OP_POLL_ADD;
+    sqe -> fd = r -> box.fd;
+    sqe -> poll_events = POLLIN;
+    sqe -> user_data = UD_DNS;
+}
+
+#define UD(c) ((unsigned long long)(unsigned long)(c))
+
+/* The one in-flight operation of c finished with res : queue the next one */
+static void conn_complete(ring *r, uconn *c, int res){
+    switch(c -> state){
+    case U_READ_REQ:
+        if(res <= 0){   // error or EOF before the head ended
+            conn_close(r, c);
+            return;
+        }
+        c -> reqlen += res;
+        c -> req[c -> reqlen] = '\0';
+        conn_read(r, c);
+        return;
+
+    case U_WRITE_HIT:
+        if(res <= 0){
+            conn_close(r, c);
+            return;
+        }
+        count_sent(c, res);
+        if((c -> hitoff += res) < c -> hit -> size){
+            prep(r, IORING_OP_SEND, c -> clientfd, c -> hit -> data + c -> hitoff, c -> hit -> size - c -> hitoff, 0, UD(c));
+            return;
+        }
+        if(!c -> rq.keepalive){
+            conn_close(r, c);
+            return;
+        }
+        /* keep the connection for the client's next request, starting with anything it pipelined */
+        pbuf_unpin(c -> hit);
+        c -> hit = NULL;
+        c -> hitoff = 0;
+        free_request(&c -> rq);
+        memmove(c -> req, c -> req + c -> headlen, c -> reqlen - c -> headlen + 1);
+        c -> reqlen -= c -> headlen;
+        http_init(&c -> hp);
+        c -> state = U_READ_REQ;
+        conn_read(r, c);
+        return;
+
+    case U_CONNECT:
+        if(res < 0){    // try the next address
+            dns_failed(c -> rq.server, c -> addr -> ai_addr);
+            submit_close(r, c -> originfd);
+            c -> originfd = -1;
+            c -> addr = c -> addr -> ai_next;
+            if(conn_connect(r, c) < 0) conn_close(r, c);
+            return;
+        }
+        stats_time(PH_CONNECT, c -> rq.mark);
+        c -> state = U_SEND_REQ;
+        res = 0;
+        /* fall through */
+    case U_SEND_REQ:
+        if(res < 0){
+            conn_close(r, c);
+            return;
+        }
+        if((c -> outoff += res) < c -> rq.outlen){
+            prep(r, IORING_OP_SEND, c -> originfd, c -> rq.out + c -> outoff, c -> rq.outlen - c -> outoff, 0, UD(c));
+            return;
+        }
+        c -> rq.mark = stats_now();
+        c -> buf = Malloc(MAXBUF);
+        c -> state = U_RECV_ORIGIN;
+        prep(r, IORING_OP_RECV, c -> originfd, c -> buf, MAXBUF, 0, UD(c));
+        return;
+
+    case U_RECV_ORIGIN:
+        if(res == 0) stats_time(PH_BODY, c -> rq.mark);
+        if(res <= 0){
+            /* Save the payload in cache */
+            if(res == 0 && !c -> cap.dropped)
+                cache_store(&c -> rq, c -> cap.data, c -> cap.len);
+            if(res == 0) count_miss(caches, c -> rq.port, c -> rq.server, c -> rq.filename, c -> cap.total);
+            conn_close(r, c);
+            return;
+        }
+        if(c -> cap.total == 0) c -> rq.mark = stats_time(PH_TTFB, c -> rq.mark);
+        stats_add(ST_BYTES_IN, res);
+        capture_append(&c -> cap, c -> buf, res);
+        c -> buflen = res;
+        c -> bufoff = 0;
+        c -> state = U_SEND_CLIENT;
+        prep(r, IORING_OP_SEND, c -> clientfd, c -> buf, c -> buflen, 0, UD(c));
+        return;
+
+    case U_SEND_CLIENT:
+        if(res < 0){
+            conn_close(r, c);
+            return;
+        }
+        count_sent(c, res);
+        if((c -> bufoff += res) < c -> buflen){
+            prep(r, IORING_OP_SEND, c -> clientfd, c -> buf + c -> bufoff, c -> buflen - c -> bufoff, 0, UD(c));
+            return;
+        }
+        c -> state = U_RECV_ORIGIN;
+        prep(r, IORING_OP_RECV, c -> originfd, c -> buf, MAXBUF, 0, UD(c));
+        return;
+    }
+}
+
+/* Start on the request head once it is complete in c->req, else queue a recv for more of it */
+static void conn_read(ring *r, uconn *c){
+    int rc;
+    if(c -> reqlen && (rc = http_parse(&c -> hp, c -> req, c -> reqlen, MAX_HEADER_SIZE)) != HTTP_AGAIN){
+        c -> headlen = rc;
+        if(rc < 0 || conn_request(r, c) < 0) conn_close(r, c);     // malformed, too large or unservable
+        return;
+    }
+    if(c -> reqlen + 1 >= c -> reqcap){
+        if(c -> reqcap >= MAX_HEADER_SIZE){     // request head too large
+            conn_close(r, c);
+            return;
+        }
+        c -> reqcap = c -> reqcap ? c -> reqcap * 2 : REQ_INIT_SIZE;
+        c -> req = Realloc(c -> req, c -> reqcap);
+    }
+    prep(r, IORING_OP_RECV, c -> clientfd, c -> req + c -> reqlen, c -> reqcap - c -> reqlen - 1, 0, UD(c));
+}
+
+/* Full request head is in : answer from the cache or start the origin fetch */
+static int conn_request(ring *r, uconn *c){
+    if(parse_request(&c -> hp, c -> req, &c -> rq, 0) < 0) return -1;
+    if(c -> start == 0) c -> start = stats_now();   // a kept-alive connection's next request
+
+    /* The proxy's own stats, sent like a hit */
+    if(c -> rq.stats) c -> hit = stats_page(c -> rq.stats);
+    else{
+        stats_add(ST_REQUESTS, 1);
+
+        /* Check if the finding payload exist in cache, or pieces of it holding the range asked for */
+        long long start = stats_now();
+        c -> hit = cache_lookup(&c -> rq, 0);
+        if(c -> rq.range && (c -> hit || (c -> hit = range_lookup(&c -> rq))))
+            c -> hit = range_apply(&c -> rq, c -> hit);
+        c -> rq.mark = stats_time(PH_LOOKUP, start);
+        stats_add(c -> hit ? ST_HITS : ST_MISSES, 1);
+    }
+    if(c -> hit){
+        c -> state = U_WRITE_HIT;
+        prep(r, IORING_OP_SEND, c -> clientfd, c -> hit -> data, c -> hit -> size, 0, UD(c));
+        return 0;
+    }
+
+    c -> rq.started = now_usec();
+    c -> state = U_RESOLVE;
+    return conn_resolve(r, c);
+}
+
+/* Look the origin up, leaving c parked on the ring's dns box if a resolver has to be asked */
+static int conn_resolve(ring *r, uconn *c){
+    int rc = dns_lookup(c -> rq.server, c -> rq.port, &c -> addrs, &c -> dw);
+    if(rc == DNS_PENDING) return 0;
+    if(rc != DNS_OK){
+        fprintf(stderr, "could not resolve %s\n", c -> rq.server);
+        return -1;
+    }
+    c -> rq.mark = stats_time(PH_DNS, c -> rq.mark);
+    c -> addr = c -> addrs;
+    c -> state = U_CONNECT;
+    return conn_connect(r, c);
+}
+
+/* Queue a connect to the next untried origin address */
+static int conn_connect(ring *r, uconn *c){
+    for(; c -> addr; c -> addr = c -> addr -> ai_next){
+        struct addrinfo *p = c -> addr;
+        if((c -> originfd = socket(p -> ai_family, p -> ai_socktype | SOCK_CLOEXEC, p -> ai_protocol)) < 0)
+            continue;
+        prep(r, IORING_OP_CONNECT, c -> originfd, p -> ai_addr, 0, p -> ai_addrlen, UD(c));
+        return 0;
+    }
+    fprintf(stderr, "connect failed (%s:%d)\n", c -> rq.server, c -> rq.port);
+    return -1;
+}
+
+/* Queue closes for both sockets and release everything else now */
+static void conn_close(ring *r, uconn *c){
+    submit_close(r, c -> clientfd);
+    if(c -> originfd >= 0) submit_close(r, c -> originfd);
+    if(c -> hit) pbuf_unpin(c -> hit);
+    if(c -> addrs) dns_free(c -> addrs);
+    free(c -> req);
+    free(c -> buf);
+    free_request(&c -> rq);
+    capture_free(&c -> cap);
+    free(c);
+}
+
+/* Account n bytes sent to c's client, the first of a response ending its first-byte time */
+static void count_sent(uconn *c, int n){
+    stats_add(ST_BYTES_OUT, n);
+    if(c -> start){
+        stats_time(PH_FIRST_BYTE, c -> start);
+        c -> start = 0;
+    }
+}
@@ -0,0 +1,8 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+/* Serve listenfd from nrings io_uring threads; never returns */
+void uring_serve(int listenfd, int nrings);
+int uring_supported();
+
+#endif
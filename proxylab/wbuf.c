@@ -0,0 +1,100 @@
+#include "csapp.h"
+#include "wbuf.h"
+#include "stats.h"
+
+/* updated with atomics by every worker */
+static unsigned long responses, calls, partial, sent;
+
+void wbuf_init(wbuf *w, int fd){
+    w -> fd = fd;
+    w -> niov = 0;
+    w -> staged = 0;
+    w -> failed = 0;
+    w -> start = 0;
+}
+
+/* Queue data[0, n) in place; it must stay valid until the next flush. -1 once a write failed */
+int wbuf_add(wbuf *w, const void *data, size_t n){
+    if(w -> failed) return -1;
+    if(n == 0) return 0;
+    if(w -> niov == WBUF_IOVS && wbuf_flush(w) < 0) return -1;
+    w -> iov[w -> niov].iov_base = (void *)data;
+    w -> iov[w -> niov].iov_len = n;
+    w -> niov++;
+    return 0;
+}
+
+/*
+ * Queue data[0, n) that is only valid during this call. Small pieces are
+ * copied into the stage, next to the pieces copied before them; a large
+ * one is sent right away, together with everything queued ahead of it
+ */
+int wbuf_put(wbuf *w, const void *data, size_t n){
+    if(w -> failed) return -1;
+    if(n > WBUF_COPY_MAX){
+        if(wbuf_add(w, data, n) < 0) return -1;
+        return wbuf_flush(w);
+    }
+    if((w -> staged + n > WBUF_STAGE || w -> niov == WBUF_IOVS) && wbuf_flush(w) < 0) return -1;
+
+    char *to = w -> stage + w -> staged;
+    memcpy(to, data, n);
+    w -> staged += n;
+    struct iovec *last = w -> niov ? &w -> iov[w -> niov - 1] : NULL;
+    if(last && (char *)last -> iov_base + last -> iov_len == to){
+        last -> iov_len += n;       // extends the previous copy
+        return 0;
+    }
+    return wbuf_add(w, to, n);
+}
+
+/* Write everything queued, resuming after partial writes. Returns 0, or -1 if the client is gone */
+int wbuf_flush(wbuf *w){
+    struct iovec *iov = w -> iov;
+    int niov = w -> niov;
+    ssize_t n;
+
+    w -> niov = 0;
+    w -> staged = 0;
+    if(w -> failed) return -1;
+    if(w -> fd < 0) return 0;
+    while(niov > 0){
+        if((n = writev(w -> fd, iov, niov)) < 0){
+            if(errno == EINTR) continue;
+            w -> failed = 1;
+            return -1;
+        }
+        __atomic_fetch_add(&calls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sent, n, __ATOMIC_RELAXED);
+        stats_add(ST_BYTES_OUT, n);
+        if(w -> start && n > 0){
+            stats_time(PH_FIRST_BYTE, w -> start);
+            w -> start = 0;
+        }
+        while(niov > 0 && (size_t)n >= iov -> iov_len){
+            n -= iov -> iov_len;
+            iov++;
+            niov--;
+        }
+        if(niov > 0){       // short write : resume mid-piece
+            __atomic_fetch_add(&partial, 1, __ATOMIC_RELAXED);
+            iov -> iov_base = (char *)iov -> iov_base + n;
+            iov -> iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Flush the rest of a response and count it */
+int wbuf_end(wbuf *w){
+    if(w -> fd >= 0) __atomic_fetch_add(&responses, 1, __ATOMIC_RELAXED);
+    return wbuf_flush(w);
+}
+
+void wbuf_report(FILE *fp){
+    unsigned long r = __atomic_load_n(&responses, __ATOMIC_RELAXED);
+    unsigned long c = __atomic_load_n(&calls, __ATOMIC_RELAXED);
+    fprintf(fp, "wbuf: %lu responses in %lu writev calls(%.2f each), %lu partial, %lu bytes\n",
+        r, c, r ? (double)c / r : 0.0, __atomic_load_n(&partial, __ATOMIC_RELAXED),
+        __atomic_load_n(&sent, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,35 @@
+#ifndef __WBUF_H__
+#define __WBUF_H__
+
+#include <stdio.h>
+#include <sys/uio.h>
+
+#define WBUF_IOVS 16
+#define WBUF_STAGE 8192         // room for copies of pieces that won't outlive the call
+#define WBUF_COPY_MAX 2048      // larger pieces are sent in place instead of copied
+
+/*
+ * Gathered writer for one client connection : the pieces of a response
+ * (status line, headers, body) queue up as iovecs and go out in one
+ * writev per flush, resumed across partial writes. Pieces are either
+ * borrowed(must stay valid until the flush) or copied into the stage.
+ * With fd -1 everything is discarded(a refresh nobody waits on)
+ */
+typedef struct wbuf{
+    int fd;
+    struct iovec iov[WBUF_IOVS];
+    int niov;
+    size_t staged;          // bytes of stage in use
+    int failed;             // a write failed : later pieces are dropped
+    long long start;        // stats_now() the response was asked for, 0 once its first byte is out
+    char stage[WBUF_STAGE];
+} wbuf;
+
+void wbuf_init(wbuf *w, int fd);
+int wbuf_add(wbuf *w, const void *data, size_t n);
+int wbuf_put(wbuf *w, const void *data, size_t n);
+int wbuf_flush(wbuf *w);
+int wbuf_end(wbuf *w);
+void wbuf_report(FILE *fp);
+
+#endif